@@ -68,7 +68,27 @@
  * int houseconfig_array_object (int parent, int index);
  *
  *    Retrieve an object (2nd form: as element of an array).
- * 
+ *
+ * int houseconfig_generation (void);
+ *
+ *    Return a number that changes each time a different configuration
+ *    is activated. An application may cache values retrieved from the
+ *    configuration for as long as the generation does not change.
+ *
+ * int houseconfig_lookup (int parent, const char *path);
+ * int houseconfig_resolve (int handle);
+ *
+ *    Register a path (relative to the specified parent) and return
+ *    a handle for it. The handle remains valid even if the configuration
+ *    changes: houseconfig_resolve() returns the current index of that
+ *    item, or -1 if that item is not present in the current configuration.
+ *    The index can then be used as the parent with an empty path, for
+ *    example: houseconfig_integer (houseconfig_resolve (handle), "").
+ *
+ * Each configuration is indexed when it is activated: all full paths are
+ * stored in a hash table, so that a search does not need to walk through
+ * the JSON structure. A path that does not start with '.' or '[' is not
+ * indexed, and is searched the old way.
  */
 
 #include <string.h>
@@ -81,6 +101,7 @@
 
 #include <echttp.h>
 #include <echttp_json.h>
+#include <echttp_hash.h>
 
 #include "houselog.h"
 #include "houseconfig.h"
@@ -90,6 +111,35 @@ static int   ConfigTokenAllocated = 0;
 static int   ConfigTokenCount = 0;
 static char *ConfigText = 0;
 static char *ConfigTextCurrent = 0;
+static int   ConfigGeneration = 0;
+
+// The path index: one entry per token, giving the token's full path.
+//
+#define CONFIG_HASH 1024
+
+typedef struct {
+    int path; // Offset in ConfigPathText.
+    unsigned int signature;
+    int next; // Next token with the same hash, plus one (0: none).
+} ConfigPathEntry;
+
+static ConfigPathEntry *ConfigPaths = 0;
+static int ConfigPathsSize = 0;
+static int ConfigPathIndex[CONFIG_HASH]; // Token index plus one (0: none).
+
+static char *ConfigPathText = 0;
+static int   ConfigPathTextSize = 0;
+static int   ConfigPathTextLength = 0;
+
+typedef struct {
+    char *path;
+    int index;
+    int generation;
+} ConfigHandle;
+
+static ConfigHandle *ConfigHandles = 0;
+static int ConfigHandlesCount = 0;
+static int ConfigHandlesSize = 0;
 
 #define HOUSECONFIG_PATH "/etc/house/"
 #define HOUSECONFIG_EXT  ".json"
@@ -99,10 +149,96 @@ static int ConfigFileEnabled = 1;
 static const char *ConfigFile = HOUSECONFIG_PATH "portal" HOUSECONFIG_EXT;
 static const char *ConfigName = 0; // Will point to base name in ConfigFile.
 
+static void houseconfig_index_add (int token, const char *path, int length) {
+
+    if (ConfigPathTextLength + length + 1 > ConfigPathTextSize) {
+        ConfigPathTextSize = ConfigPathTextLength + length + 1024;
+        ConfigPathText = realloc (ConfigPathText, ConfigPathTextSize);
+    }
+    ConfigPathEntry *entry = ConfigPaths + token;
+    entry->path = ConfigPathTextLength;
+    memcpy (ConfigPathText + ConfigPathTextLength, path, length);
+    ConfigPathText[ConfigPathTextLength + length] = 0;
+    ConfigPathTextLength += length + 1;
+
+    entry->signature = echttp_hash_signature (ConfigPathText + entry->path);
+    int slot = entry->signature % CONFIG_HASH;
+    entry->next = ConfigPathIndex[slot];
+    ConfigPathIndex[slot] = token + 1;
+}
+
+static void houseconfig_index_walk (int token, char *path, int length) {
+
+    houseconfig_index_add (token, path, length);
+
+    ParserToken *parent = ConfigParsed + token;
+    int count = parent->length;
+    if (count <= 0) return;
+    if (parent->type != PARSER_OBJECT && parent->type != PARSER_ARRAY) return;
+
+    int *children = malloc (count * sizeof(int));
+    if (!echttp_json_enumerate (parent, children)) {
+        int i;
+        for (i = 0; i < count; ++i) {
+            int child = token + children[i];
+            int added;
+            if (parent->type == PARSER_ARRAY) {
+                added = snprintf (path + length, 1024 - length, "[%d]", i);
+            } else {
+                added = snprintf (path + length, 1024 - length,
+                                  ".%s", ConfigParsed[child].key);
+            }
+            if (length + added >= 1024) continue; // Too deep, not indexed.
+            houseconfig_index_walk (child, path, length + added);
+        }
+    }
+    free (children);
+    path[length] = 0;
+}
+
+static void houseconfig_index (void) {
+
+    memset (ConfigPathIndex, 0, sizeof(ConfigPathIndex));
+    ConfigPathTextLength = 0;
+    if (ConfigTokenCount <= 0) return;
+
+    if (ConfigTokenCount > ConfigPathsSize) {
+        ConfigPathsSize = ConfigTokenAllocated;
+        ConfigPaths = realloc (ConfigPaths, ConfigPathsSize * sizeof(ConfigPathEntry));
+    }
+    char path[1024];
+    path[0] = 0;
+    houseconfig_index_walk (0, path, 0);
+}
+
+static int houseconfig_index_search (const char *path) {
+
+    unsigned int signature = echttp_hash_signature (path);
+    int token = ConfigPathIndex[signature % CONFIG_HASH];
+    while (token > 0) {
+        ConfigPathEntry *entry = ConfigPaths + token - 1;
+        if (entry->signature == signature &&
+            !strcmp (ConfigPathText + entry->path, path)) return token - 1;
+        token = entry->next;
+    }
+    return -1;
+}
+
+// Build the full path of an item. The parent must be valid, unless it
+// is the root (0).
+//
+static int houseconfig_index_full (int parent, const char *path,
+                                   char *full, int size) {
+    if (path[0] && path[0] != '.' && path[0] != '[') return 0;
+    const char *prefix = parent ? ConfigPathText + ConfigPaths[parent].path : "";
+    return snprintf (full, size, "%s%s", prefix, path) < size;
+}
+
 static const char *houseconfig_parse (void) {
 
     if (!ConfigText) {
         ConfigTokenCount = 0;
+        houseconfig_index ();
         return "no configuration";
     }
     int count = echttp_json_estimate(ConfigText);
@@ -119,6 +255,8 @@ static const char *houseconfig_parse (void) {
     if (error) {
         free (proposedconfig); // Don't touch the last valid config text.
         ConfigTokenCount = 0;
+        houseconfig_index ();
+        ConfigGeneration += 1;
         houselog_trace (HOUSE_FAILURE, "CONFIG", "ERROR %s", error);
         return error;
     }
@@ -126,6 +264,8 @@ static const char *houseconfig_parse (void) {
     // The new proposed config is in service now.
     if (ConfigTextCurrent) free (ConfigTextCurrent);
     ConfigTextCurrent = proposedconfig;
+    houseconfig_index ();
+    ConfigGeneration += 1;
     return 0;
 }
 
@@ -184,6 +324,12 @@ const char *houseconfig_load (int argc, const char **argv) {
 
 const char *houseconfig_update (const char *text) {
 
+    // Nothing to do if this is the configuration currently active. This
+    // avoids invalidating all the values that the application cached.
+    //
+    if (ConfigTokenCount > 0 &&
+        ConfigTextCurrent && !strcmp (text, ConfigTextCurrent)) return 0;
+
     if (ConfigText) echttp_parser_free (ConfigText);
     ConfigText = echttp_parser_string (text);
     const char *error = houseconfig_parse ();
@@ -205,9 +351,20 @@ int houseconfig_active (void) {
     return ConfigTokenCount > 0;
 }
 
+int houseconfig_generation (void) {
+    return ConfigGeneration;
+}
+
 int houseconfig_find (int parent, const char *path, int type) {
     int i;
     if (parent < 0 || parent >= ConfigTokenCount) return -1;
+
+    char full[1024];
+    if (houseconfig_index_full (parent, path, full, sizeof(full))) {
+        i = houseconfig_index_search (full);
+        if (i >= 0 && ConfigParsed[i].type == type) return i;
+        return -1;
+    }
     i = echttp_json_search(ConfigParsed+parent, path);
     if (i >= 0 && ConfigParsed[parent+i].type == type) return parent+i;
     return -1;
@@ -249,3 +406,37 @@ int houseconfig_object (int parent, const char *path) {
     return houseconfig_find(parent, path, PARSER_OBJECT);
 }
 
+
+int houseconfig_lookup (int parent, const char *path) {
+
+    char full[1024];
+    if (parent < 0) return -1;
+    if (parent > 0 && parent >= ConfigTokenCount) return -1;
+    if (!houseconfig_index_full (parent, path, full, sizeof(full))) return -1;
+
+    int i;
+    for (i = 0; i < ConfigHandlesCount; ++i) {
+        if (!strcmp (ConfigHandles[i].path, full)) return i;
+    }
+    if (ConfigHandlesCount >= ConfigHandlesSize) {
+        ConfigHandlesSize = ConfigHandlesCount + 16;
+        ConfigHandles = realloc (ConfigHandles,
+                                 ConfigHandlesSize * sizeof(ConfigHandle));
+    }
+    ConfigHandle *handle = ConfigHandles + ConfigHandlesCount;
+    handle->path = strdup (full);
+    handle->index = houseconfig_index_search (full);
+    handle->generation = ConfigGeneration;
+    return ConfigHandlesCount++;
+}
+
+int houseconfig_resolve (int handle) {
+
+    if (handle < 0 || handle >= ConfigHandlesCount) return -1;
+    ConfigHandle *cursor = ConfigHandles + handle;
+    if (cursor->generation != ConfigGeneration) {
+        cursor->index = houseconfig_index_search (cursor->path);
+        cursor->generation = ConfigGeneration;
+    }
+    return cursor->index;
+}
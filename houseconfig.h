@@ -28,6 +28,8 @@ const char *houseconfig_name (void);
 
 const char *houseconfig_update (const char *text);
 
+int houseconfig_generation (void);
+
 int houseconfig_find (int parent, const char *path, int type);
 
 const char *houseconfig_string  (int parent, const char *path);
@@ -39,3 +41,6 @@ int houseconfig_array_length (int array);
 
 int houseconfig_object       (int parent, const char *path);
 int houseconfig_array_object (int parent, int index);
+
+int houseconfig_lookup  (int parent, const char *path);
+int houseconfig_resolve (int handle);
@@ -40,6 +40,17 @@
  * date is more recent: it must simply match. This is because the "current"
  * tag may have been moved to an older revision.
  *
+ * Each file downloaded (or uploaded) is also saved to a disk cache, with
+ * its revision timestamp and a hash of its content. This cached copy is
+ * delivered on subscription, so that a service can start without waiting
+ * for the network, and still start if no HouseDepot service is reachable.
+ * The cached revision is then validated against the HouseDepot services
+ * like any other revision.
+ *
+ * The cache is indexed by URI. A scan merges the revisions listed by each
+ * HouseDepot service into the cache, and only the entries which detected
+ * revision changed are considered when refreshing.
+ *
  * void housedepositor_default (const char *arg);
  *
  *    Set default values for command line options. Call the function once for
@@ -50,6 +61,7 @@
  * 
  *    Recover these service configuration parameters:
  *       -group=*
+ *       -depot-cache=PATH  (default: /var/lib/house/depositor, empty: none)
  *
  * typedef void housedepositor_listener (const char *name, time_t timestamp,
  *                                       const char *data, int length);
@@ -61,7 +73,9 @@
  *    Subscribe for the specified file (on all HouseDepot services).
  *    It is legal to scan multiple files from multiple repositories.
  *    This does not download the file immediately, this is used to
- *    build a list to scan later.
+ *    build a list to scan later. However, if a copy of the file is
+ *    present in the local disk cache, the listener is called immediately
+ *    with that copy, before this function returns.
  * 
  * void housedepositor_put (const char *repository,
  *                          const char *name,
@@ -79,32 +93,72 @@
  *    from the specified file. The HouseDepot data's timestamp is set to the
  *    timestamp of the file as well. One benefit is that there is no local
  *    limit to the size of the data (there could be a limit on the server
- *    side).
+ *    side). The file is read once, into a private copy that is sent to
+ *    all HouseDepot services: the application may modify, truncate or
+ *    rotate the file as soon as this function returns.
+ *
+ * typedef void housedepositor_put_listener (const char *name,
+ *                                           const char *provider,
+ *                                           int status, int remaining);
+ *
+ * void housedepositor_put_listen (housedepositor_put_listener *listener);
+ *
+ *    Declare a listener to be called when a HouseDepot service has
+ *    responded to an update, whether it succeeded or not. The remaining
+ *    parameter is the count of HouseDepot services that have not responded
+ *    yet to the same update: 0 means that this update is complete. A status
+ *    of 0 indicates that no HouseDepot service could be reached.
  *
  * void housedepositor_periodic (time_t now);
  *
  *    Background updates.
+ *
+ * Only the HouseDepot services considered healthy by the discovery module
+ * are queried or updated. Each request's outcome and latency is reported
+ * back to the discovery module, so that failing services are skipped until
+ * they recover.
  */
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <echttp.h>
 #include <echttp_json.h>
+#include <echttp_hash.h>
 
 #include "houselog.h"
+#include "houselog_metrics.h"
 #include "housediscover.h"
+#include "houseportalredirect.h"
 #include "housedepositor.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
 #define DEPOT_URI_PREFIX "/depot/"
 
+#define DEPOT_READ_CHUNK (1024 * 1024) // Bounded size of each read.
+
 static const char *DepotGroup = "home";
 
+static const char *DepotStorePath = "/var/lib/house/depositor";
+static int DepotStoreReady = 0; // 0: not checked yet, 1: ready, -1: failed.
+
+static int MetricScanLatency = -1;
+static int MetricCheckLatency = -1;
+static int MetricDownloads = -1;
+static int MetricUploads = -1;
+static int MetricFailures = -1;
+
+static long long DepotScanStarted = 0;
+static long long DepotCheckStarted = 0;
+
 static int DepotScanPending = 0;
 static int DepotNeedScan = 0;
 static time_t DepotNextScan = 0;
@@ -116,6 +170,8 @@ static time_t DepotNextRefresh = 0;
 typedef struct {
     char *host;
     long long timestamp;
+    long long *stamps;  // Per repository, if the depot provides them.
+    int stampscount;
 } DepotServiceEntry;
 
 static DepotServiceEntry *DepotServices = 0;
@@ -130,20 +186,63 @@ typedef struct {
     time_t detected; // The most recent timestamp detected.
     char host[128];  // The host that holds the most recent timestamp.
     time_t hostalive; // The last time this host responded.
+    int dirty;       // This entry is listed in DepotDirty.
+    unsigned int signature;
+    int next;        // Index+1 of the next entry in the hash list.
 } DepotCacheEntry;
 
-#define MAX_CACHE 256
+// The entries are allocated individually because pending requests keep
+// a pointer to them. The hash index stores index+1, so that 0 means empty.
+//
+#define DEPOT_HASH 256
 
-static DepotCacheEntry DepotCache[MAX_CACHE];
-static int             DepotCacheCount = 0;
+static DepotCacheEntry **DepotCache = 0;
+static int               DepotCacheCount = 0;
+static int               DepotCacheSize = 0;
+static int               DepotCacheIndex[DEPOT_HASH];
 
-#define MAX_SOURCE 64
+// The entries which detected revision changed since the last refresh.
+//
+static DepotCacheEntry **DepotDirty = 0;
+static int               DepotDirtyCount = 0;
+static int               DepotDirtySize = 0;
 
-static char *DepotRepositories[MAX_SOURCE] = {0};
+typedef struct {
+    char *name;
+    int needscan;
+} DepotRepositoryEntry;
+
+static DepotRepositoryEntry *DepotRepositories = 0;
+static int                   DepotRepositoriesCount = 0;
+static int                   DepotRepositoriesSize = 0;
+
+// The latest listing received for each repository from each depot service,
+// used to make the next scan conditional (If-Modified-Since).
+//
+typedef struct {
+    char *url;
+    char *modified;  // The Last-Modified value of the latest listing.
+    char host[128];  // The host name reported in the latest listing.
+} DepotListingEntry;
+
+static DepotListingEntry *DepotListings = 0;
+static int                DepotListingsCount = 0;
+static int                DepotListingsSize = 0;
+
+// The parser buffers, grown to fit the largest scan response.
+//
+static ParserToken *DepotTokens = 0;
+static int          DepotTokensSize = 0;
+static int         *DepotInnerList = 0;
+static int          DepotInnerListSize = 0;
 
 
 void housedepositor_default (const char *arg) {
     if (echttp_option_match("-group=", arg, &DepotGroup)) return;
+    if (echttp_option_match("-depot-cache=", arg, &DepotStorePath)) {
+        DepotStoreReady = 0;
+        return;
+    }
     // FUTURE: handle other future options.
     return;
 }
@@ -154,14 +253,176 @@ void housedepositor_initialize (int argc, const char **argv) {
     for (i = 1; i < argc; i++) {
         housedepositor_default (argv[i]);
     }
+    MetricScanLatency = houselog_metrics_latency ("depot.scan");
+    MetricCheckLatency = houselog_metrics_latency ("depot.check");
+    MetricDownloads = houselog_metrics_counter ("depot.downloads");
+    MetricUploads = houselog_metrics_counter ("depot.uploads");
+    MetricFailures = houselog_metrics_counter ("depot.failures");
 }
 
-static int housedepositor_search (const char *name) {
+static DepotCacheEntry *housedepositor_search (const char *name) {
     int i;
-    for (i = 0; i < DepotCacheCount; i++) {
-        if (!strcmp(DepotCache[i].uri, name)) return i;
+    unsigned int signature = echttp_hash_signature (name);
+    for (i = DepotCacheIndex[signature % DEPOT_HASH];
+         i > 0; i = DepotCache[i-1]->next) {
+        DepotCacheEntry *cache = DepotCache[i-1];
+        if (cache->signature != signature) continue;
+        if (!strcmp(cache->uri, name)) return cache;
+    }
+    return 0;
+}
+
+static void housedepositor_dirty (DepotCacheEntry *cache) {
+
+    if (cache->dirty) return;
+    if (DepotDirtyCount >= DepotDirtySize) {
+        DepotDirtySize = DepotDirtyCount + 16;
+        DepotDirty = realloc (DepotDirty,
+                              DepotDirtySize*sizeof(DepotCacheEntry *));
+    }
+    DepotDirty[DepotDirtyCount++] = cache;
+    cache->dirty = 1;
+}
+
+// The disk cache: one file per URI, holding a one line header (revision
+// timestamp, length and FNV-1a hash of the content), then the content,
+// then a null character so that the mapped content is a valid string.
+//
+#define DEPOT_STORE_MAGIC "HOUSEDEPOT1"
+
+static int housedepositor_store_ready (void) {
+
+    if (DepotStoreReady) return DepotStoreReady > 0;
+
+    DepotStoreReady = -1;
+    if (!DepotStorePath || !DepotStorePath[0]) return 0;
+
+    // Create the parent directories, if needed.
+    char path[1024];
+    snprintf (path, sizeof(path), "%s", DepotStorePath);
+    char *slash;
+    for (slash = strchr (path+1, '/'); slash; slash = strchr (slash+1, '/')) {
+        *slash = 0;
+        mkdir (path, 0755);
+        *slash = '/';
+    }
+    if (mkdir (path, 0755) && errno != EEXIST) {
+        houselog_trace (HOUSE_FAILURE, DepotStorePath,
+                        "cannot create the cache: %s", strerror(errno));
+        return 0;
+    }
+    if (access (path, W_OK)) {
+        houselog_trace (HOUSE_FAILURE, DepotStorePath,
+                        "cannot write to the cache: %s", strerror(errno));
+        return 0;
+    }
+    DepotStoreReady = 1;
+    return 1;
+}
+
+// The file name is the URI without the "/depot/" prefix, with the '/'
+// and '%' characters escaped.
+//
+static void housedepositor_store_name (char *name, int size, const char *uri) {
+
+    int length = snprintf (name, size, "%s/", DepotStorePath);
+    uri += strlen(DEPOT_URI_PREFIX);
+
+    for (; *uri && length < size - 4; ++uri) {
+        if (*uri == '/' || *uri == '%') {
+            length += snprintf (name+length, size-length, "%%%02X", *uri);
+        } else {
+            name[length++] = *uri;
+        }
+    }
+    name[length] = 0;
+}
+
+static uint64_t housedepositor_store_hash (const char *data, int length) {
+    int i;
+    uint64_t hash = 14695981039346656037ULL;
+    for (i = 0; i < length; ++i) {
+        hash ^= (unsigned char)(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void housedepositor_store (const char *uri, time_t timestamp,
+                                  const char *data, int length) {
+
+    if (!housedepositor_store_ready ()) return;
+
+    char name[1024];
+    char temporary[1100];
+    housedepositor_store_name (name, sizeof(name), uri);
+    snprintf (temporary, sizeof(temporary), "%s.tmp", name);
+
+    FILE *file = fopen (temporary, "w");
+    if (!file) return;
+    fprintf (file, DEPOT_STORE_MAGIC " %lld %d %016llx\n",
+             (long long)timestamp, length,
+             (unsigned long long)housedepositor_store_hash (data, length));
+    int ok = (fwrite (data, 1, length, file) == length);
+    if (fputc (0, file) == EOF) ok = 0;
+    if (fclose (file)) ok = 0;
+
+    // Replace the previous copy only once the new one is complete.
+    if (!ok || rename (temporary, name)) {
+        houselog_trace (HOUSE_FAILURE, uri, "cannot save to %s", name);
+        unlink (temporary);
+        return;
     }
-    return -1;
+    DEBUG ("saved %s revision %lld to %s\n", uri, (long long)timestamp, name);
+}
+
+static void housedepositor_store_load (DepotCacheEntry *cache) {
+
+    if (!cache->listener) return;
+    if (!housedepositor_store_ready ()) return;
+
+    char name[1024];
+    housedepositor_store_name (name, sizeof(name), cache->uri);
+
+    int fd = open (name, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat fileinfo;
+    if (fstat (fd, &fileinfo) || fileinfo.st_size <= 0) {
+        close (fd);
+        return;
+    }
+    int size = (int)(fileinfo.st_size);
+    const char *map = mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) return;
+
+    long long timestamp;
+    int length;
+    unsigned long long hash;
+    int header = 0;
+    const char *data = 0;
+
+    const char *eol = memchr (map, '\n', size);
+    if (eol && map[size-1] == 0 &&
+        sscanf (map, DEPOT_STORE_MAGIC " %lld %d %llx%n",
+                &timestamp, &length, &hash, &header) == 3 &&
+        map + header == eol) {
+        data = eol + 1;
+        if (data + length + 1 != map + size ||
+            housedepositor_store_hash (data, length) != hash) data = 0;
+    }
+
+    if (data) {
+        DEBUG ("loaded %s revision %lld from %s\n", cache->uri, timestamp, name);
+        cache->listener (cache->uri, (time_t)timestamp, data, length);
+        cache->active = (time_t)timestamp;
+    } else {
+        houselog_trace (HOUSE_FAILURE, cache->uri,
+                        "invalid cached copy %s, removed", name);
+        unlink (name);
+    }
+    munmap ((void *)map, size);
 }
 
 static void housedepositor_uri (char *uri, int size,
@@ -180,49 +441,125 @@ void housedepositor_subscribe (const char *repository,
                                const char *name,
                                housedepositor_listener *listener) {
     
-    if (DepotCacheCount >= MAX_CACHE) {
-        houselog_trace (HOUSE_FAILURE, name,
-                        "Registration cache full (file %s)", name);
-        return;
-    }
-    
     char uri[1024];
     housedepositor_uri (uri, sizeof(uri), repository, name);
     DEBUG ("subscribe to %s\n", uri);
 
-    int i = housedepositor_search(uri);
-    if (i >= 0) {
-        if (listener != DepotCache[i].listener) {
+    DepotCacheEntry *cache = housedepositor_search(uri);
+    if (cache) {
+        if (listener != cache->listener) {
            houselog_trace (HOUSE_FAILURE, name,
                            "Registration conflict (repository %s)", repository);
         }
         return;
     }
-    i = DepotCacheCount++;
-    DepotCache[i].uri = strdup(uri);
-    DepotCache[i].listener = listener;
-    DepotCache[i].active = 0;
-    DepotCache[i].detected = 0;
-    DepotCache[i].refreshing = 0;
-
-    for (i = 0; i < MAX_SOURCE; i++) {
-        if (!(DepotRepositories[i])) {
-            DepotRepositories[i] = strdup(repository);
-            DEBUG ("Added repository %s\n", repository);
-            break; // Just added.
+    if (DepotCacheCount >= DepotCacheSize) {
+        DepotCacheSize = DepotCacheCount + 16;
+        DepotCache = realloc (DepotCache,
+                              DepotCacheSize*sizeof(DepotCacheEntry *));
+    }
+    cache = calloc (1, sizeof(DepotCacheEntry));
+    cache->uri = strdup(uri);
+    cache->listener = listener;
+    cache->signature = echttp_hash_signature (cache->uri);
+    cache->next = DepotCacheIndex[cache->signature % DEPOT_HASH];
+    DepotCache[DepotCacheCount++] = cache;
+    DepotCacheIndex[cache->signature % DEPOT_HASH] = DepotCacheCount;
+
+    housedepositor_store_load (cache);
+
+    int i;
+    for (i = 0; i < DepotRepositoriesCount; i++) {
+        if (!strcmp (DepotRepositories[i].name, repository))
+            return; // Already present.
+    }
+    if (DepotRepositoriesCount >= DepotRepositoriesSize) {
+        DepotRepositoriesSize = DepotRepositoriesCount + 16;
+        DepotRepositories =
+            realloc (DepotRepositories,
+                     DepotRepositoriesSize*sizeof(DepotRepositoryEntry));
+    }
+    i = DepotRepositoriesCount++;
+    DepotRepositories[i].name = strdup(repository);
+    DepotRepositories[i].needscan = 1;
+    DepotNeedScan = 1;
+    DEBUG ("Added repository %s\n", repository);
+}
+
+static void housedepositor_rescan (int repository) {
+    DepotRepositories[repository].needscan = 1;
+    DepotNeedScan = 1;
+}
+
+static void housedepositor_rescan_all (void) {
+    int i;
+    for (i = 0; i < DepotRepositoriesCount; i++) housedepositor_rescan (i);
+}
+
+static void housedepositor_rescan_name (const char *repository) {
+    int i;
+    for (i = 0; i < DepotRepositoriesCount; i++) {
+        if (!strcmp (DepotRepositories[i].name, repository)) {
+            housedepositor_rescan (i);
+            return;
         }
-        if (!strcmp (DepotRepositories[i], repository))
-            break; // Already present.
+    }
+}
+
+static int housedepositor_listing (const char *url) {
+
+    int i;
+    for (i = 0; i < DepotListingsCount; i++) {
+        if (!strcmp (DepotListings[i].url, url)) return i;
+    }
+    if (DepotListingsCount >= DepotListingsSize) {
+        DepotListingsSize = DepotListingsCount + 16;
+        DepotListings = realloc (DepotListings,
+                                 DepotListingsSize*sizeof(DepotListingEntry));
+    }
+    i = DepotListingsCount++;
+    DepotListings[i].url = strdup(url);
+    DepotListings[i].modified = 0;
+    DepotListings[i].host[0] = 0;
+    return i;
+}
+
+static void housedepositor_conditional (int listing) {
+    if (DepotListings[listing].modified)
+        echttp_attribute_set ("If-Modified-Since",
+                              DepotListings[listing].modified);
+}
+
+// The listing did not change: the files listed are still there, so
+// the depot service that listed them is still alive.
+//
+static void housedepositor_unchanged (int listing,
+                                      const char *repository, time_t now) {
+
+    int i;
+    char prefix[256];
+    const char *host = DepotListings[listing].host;
+
+    if (!host[0]) return;
+    int length = snprintf (prefix, sizeof(prefix),
+                           DEPOT_URI_PREFIX "%s/%s/", repository, DepotGroup);
+
+    for (i = 0; i < DepotCacheCount; i++) {
+        DepotCacheEntry *cache = DepotCache[i];
+        if (strncmp (cache->uri, prefix, length)) continue;
+        if (strcmp (cache->host, host)) continue;
+        cache->hostalive = now;
     }
 }
 
 
+static housedepositor_put_listener *DepotPutListener = 0;
+
 typedef struct {
+    char *uri;
     char *path;
     int pending;
-    char *data;     // For data in memory upload
-    int fd;         // For file upload.
-    char *filename; // For file upload (redirected).
+    char *data;     // The same data is sent to all HouseDepot services.
     int length;
     time_t timestamp;
 } HouseDepositorPutContext;
@@ -230,10 +567,20 @@ typedef struct {
 static void housedepositor_put_free (HouseDepositorPutContext *request) {
     if (request->data) free (request->data);
     if (request->path) free (request->path);
-    if (request->filename) free (request->filename);
+    if (request->uri) free (request->uri);
     free (request);
 }
 
+void housedepositor_put_listen (housedepositor_put_listener *listener) {
+    DepotPutListener = listener;
+}
+
+typedef struct {
+    HouseDepositorPutContext *request;
+    char *provider;
+    housediscover_probe probe;
+} HouseDepositorPutProbe;
+
 static void housedepositor_put_release (HouseDepositorPutContext *request) {
     if ((--request->pending) <= 0) { // Last response.
         housedepositor_put_free (request);
@@ -243,35 +590,38 @@ static void housedepositor_put_release (HouseDepositorPutContext *request) {
 static void housedepositor_put_response
                (void *context, int status, char *data, int length) {
 
-    HouseDepositorPutContext *request =
-        (HouseDepositorPutContext *)context;
+    HouseDepositorPutProbe *probe = (HouseDepositorPutProbe *)context;
+    HouseDepositorPutContext *request = probe->request;
 
-   status = echttp_redirected("PUT");
+   status = houseportalredirect_redirected ("PUT", probe->provider);
    if (!status){
-       if (request->data) {
-           echttp_submit (request->data, request->length,
-                          housedepositor_put_response, context);
-       } else {
-           // Since the current request has been closed, request->fd was
-           // closed as well. Must reopen.
-           request->fd = open (request->filename, O_RDONLY);
-           echttp_transfer (request->fd, request->length);
-           echttp_submit (0, 0, housedepositor_put_response, context);
-       }
+       echttp_submit (request->data, request->length,
+                      housedepositor_put_response, context);
        return;
    }
    
+   housediscover_probe_end (&(probe->probe), status);
+
    DEBUG ("response to put of %s: %s\n", request->path, (length > 0)?data:"");
 
    if (status != 200) {
+       houselog_metrics_count (MetricFailures, 1);
        houselog_trace (HOUSE_FAILURE, request->path, "HTTP code %d", status);
+   } else {
+       houselog_metrics_count (MetricUploads, 1);
    }
 
+   if (DepotPutListener)
+       DepotPutListener (request->uri, probe->provider,
+                         status, request->pending - 1);
+   free (probe->provider);
+   free (probe);
+
    housedepositor_put_release (request);
 }
 
-static void housedepositor_put_iterator
-               (const char *service, void *context, const char *provider) {
+static void housedepositor_put_iterator (const char *service, void *context,
+                                         const char *provider, int rank) {
 
     HouseDepositorPutContext *request =
         (HouseDepositorPutContext *)context;
@@ -280,21 +630,20 @@ static void housedepositor_put_iterator
     
     snprintf (url, sizeof(url), "%s/%s?time=%lld",
               provider, request->path, (long long)(request->timestamp));
-    const char *error = echttp_client ("PUT", url);
+    const char *error = houseportalredirect_client ("PUT", provider, url);
     if (error) {
         houselog_trace (HOUSE_FAILURE, service,
                         "cannot create socket for %s, %s", url, error);
         return;
     }
-    DEBUG ("PUT %s : %s\n", url, request->data);
+    DEBUG ("PUT %s (%d bytes)\n", url, request->length);
+    HouseDepositorPutProbe *probe = malloc (sizeof(HouseDepositorPutProbe));
+    probe->request = request;
+    probe->provider = strdup (provider);
+    housediscover_probe_start (&(probe->probe), provider);
     request->pending += 1;
-    if (request->data) {
-        echttp_submit (request->data, request->length,
-                       housedepositor_put_response, context);
-    } else {
-        echttp_transfer (request->fd, request->length);
-        echttp_submit (0, 0, housedepositor_put_response, context);
-    }
+    echttp_submit (request->data, request->length,
+                   housedepositor_put_response, probe);
 }
 
 static void housedepositor_put_submit (const char *repository,
@@ -309,14 +658,17 @@ static void housedepositor_put_submit (const char *repository,
     // The request path is not the full URI because the "/depot/" prefix
     // is already part of the service's address returned by the portal.
     //
+    request->uri = strdup(uri);
     request->path = strdup(housedepositor_extract_path(uri));
     request->pending = 0;
 
-    housediscovered ("depot", request, housedepositor_put_iterator);
+    housediscover_select ("depot", HOUSEDISCOVER_HEALTHY, 0,
+                          request, housedepositor_put_iterator);
 
     // There might have been no depot service running at this time.
     // In that case, nothing has happened: just get out.
     if (request->pending <= 0) {
+        if (DepotPutListener) DepotPutListener (uri, 0, 0, 0);
         housedepositor_put_free (request);
         return;
     }
@@ -324,10 +676,11 @@ static void housedepositor_put_submit (const char *repository,
     // Update the cache to reflect the revision that was just checked in.
     // This is to avoid reloading the same configuration data.
     //
-    int cached = housedepositor_search(uri);
-    if (cached >= 0) {
-        DepotCache[cached].detected = now;
-        DepotCache[cached].active = now;
+    DepotCacheEntry *cached = housedepositor_search(uri);
+    if (cached) {
+        cached->detected = now;
+        cached->active = now;
+        housedepositor_store (uri, now, request->data, request->length);
     }
 }
 
@@ -344,8 +697,6 @@ void housedepositor_put (const char *repository,
      * caller's data. By making a copy, we control that copy's lifespan
      * until all DEPOT requests have completed (or failed).
      */
-    request->fd = 0;
-    request->filename = 0;
     request->data = malloc (size);
     request->length = size;
     memcpy (request->data, data, size);
@@ -357,27 +708,52 @@ void housedepositor_put_file (const char *repository,
                               const char *name,
                               const char *filename) {
 
-    HouseDepositorPutContext *request =
-        (HouseDepositorPutContext *) malloc (sizeof(HouseDepositorPutContext));
-
-    request->fd = open (filename, O_RDONLY);
-    if (request->fd < 0) goto abort;
+    int fd = open (filename, O_RDONLY);
+    if (fd < 0) return;
 
     struct stat fileinfo;
-    if (fstat(request->fd, &fileinfo) < 0) goto abort;
+    if (fstat(fd, &fileinfo) < 0) goto abort;
     if ((fileinfo.st_mode & S_IFMT) != S_IFREG) goto abort;
 
-    request->data = 0;
-    request->filename = strdup(filename);
+    HouseDepositorPutContext *request =
+        (HouseDepositorPutContext *) malloc (sizeof(HouseDepositorPutContext));
+
     request->length = fileinfo.st_size;
     request->timestamp = fileinfo.st_mtim.tv_sec;
 
+    // The file is read only once, whatever the count of HouseDepot services.
+    // The data is copied, so that the application may change the file while
+    // the requests are pending: the file is never accessed again.
+    //
+    request->data = malloc (request->length + 1);
+    if (!request->data) {
+        houselog_trace (HOUSE_FAILURE, filename,
+                        "cannot allocate %d bytes", request->length);
+        free (request);
+        goto abort;
+    }
+    int done = 0;
+    while (done < request->length) {
+        int chunk = request->length - done;
+        if (chunk > DEPOT_READ_CHUNK) chunk = DEPOT_READ_CHUNK;
+        int count = pread (fd, request->data + done, chunk, done);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) continue;
+            houselog_trace (HOUSE_FAILURE, filename, "cannot read: %s",
+                            count ? strerror(errno) : "truncated");
+            free (request->data);
+            free (request);
+            goto abort;
+        }
+        done += count;
+    }
+    close (fd);
+
     housedepositor_put_submit (repository, name, request);
     return;
 
 abort:
-    free (request);
-    return;
+    close (fd);
 }
 
 static void housedepositor_get_response
@@ -392,16 +768,20 @@ static void housedepositor_get_response
     DepotCacheEntry *cache = (DepotCacheEntry *)context;
     cache->refreshing = 0;
     if (status != 200) {
+        houselog_metrics_count (MetricFailures, 1);
         houselog_trace (HOUSE_FAILURE, cache->uri, "HTTP code %d", status);
+        housedepositor_dirty (cache); // Try again on the next refresh.
         return;
     }
     
     DEBUG ("response to get %s: %s\n", cache->uri, data);
+    houselog_metrics_count (MetricDownloads, 1);
 
     if (cache->listener) {
         cache->listener(cache->uri, cache->detected, data, length);
         cache->active = cache->detected;
     }
+    housedepositor_store (cache->uri, cache->detected, data, length);
 }
 
 static void housedepositor_get (DepotCacheEntry *cache) {
@@ -413,55 +793,107 @@ static void housedepositor_get (DepotCacheEntry *cache) {
     if (error) {
         houselog_trace (HOUSE_FAILURE, cache->uri,
                         "cannot create socket for %s: %s", url, error);
+        housedepositor_dirty (cache); // Try again on the next refresh.
         return;
     }
     DEBUG ("GET %s\n", url);
+    cache->refreshing = 1;
     echttp_submit (0, 0, housedepositor_get_response, (void *)cache);
 }
 
+// Only the entries which detected revision changed are considered.
+// An entry that is still being refreshed is kept for the next time.
+//
 static void housedepositor_refresh (void) {
     
     int i;
-    for (i = 0; i < MAX_CACHE; i++) {
-        if (!DepotCache[i].detected) continue;
-        if (DepotCache[i].refreshing) continue;
-        if (DepotCache[i].detected != DepotCache[i].active) {
+    int count = DepotDirtyCount;
+    DepotCacheEntry **dirty = DepotDirty;
+
+    // The list may grow while refreshing (on errors): start a new one.
+    DepotDirty = 0;
+    DepotDirtyCount = DepotDirtySize = 0;
+
+    for (i = 0; i < count; i++) {
+        DepotCacheEntry *cache = dirty[i];
+        cache->dirty = 0;
+        if (cache->refreshing) {
+            housedepositor_dirty (cache);
+            continue;
+        }
+        if (!cache->detected) continue;
+        if (cache->detected != cache->active) {
             DEBUG ("Need to refresh %s (%d != %d)\n",
-                   DepotCache[i].uri,
-                   (int)(DepotCache[i].detected), (int)(DepotCache[i].active));
-            housedepositor_get(&(DepotCache[i]));
-            DepotCache[i].refreshing = 1;
+                   cache->uri, (int)(cache->detected), (int)(cache->active));
+            housedepositor_get(cache);
         }
     }
+    free (dirty);
 }
 
 
+typedef struct {
+    const char *repository;
+    char *provider;
+    int listing;
+    housediscover_probe probe;
+} HouseDepositorScanProbe;
+
+typedef struct {
+    char *provider;
+    housediscover_probe probe;
+} HouseDepositorCheckProbe;
+
 static void housedepositor_scan_response
                (void *context, int status, char *data, int length) {
 
     time_t now = time(0);
-    const char *repository = (char *)context;
+    HouseDepositorScanProbe *probe = (HouseDepositorScanProbe *)context;
+    const char *repository = probe->repository;
+    int listing = probe->listing;
 
-    status = echttp_redirected("GET");
+    status = houseportalredirect_redirected ("GET", probe->provider);
     if (!status){
+        housedepositor_conditional (listing);
         echttp_submit (0, 0, housedepositor_scan_response, context);
         return;
     }
+    housediscover_probe_end (&(probe->probe), status);
+    free (probe->provider);
+    free (probe);
+
     DepotScanPending -= 1;
     if (DepotScanPending <= 0) {
         DEBUG ("Scan of HouseDepot services completed\n");
+        houselog_metrics_elapsed (MetricScanLatency, DepotScanStarted);
         DepotNextRefresh = now + 1;
     }
     
+    if (status == 304) {
+        DEBUG ("%s not modified\n", DepotListings[listing].url);
+        housedepositor_unchanged (listing, repository, now);
+        return;
+    }
     if (status != 200) {
         houselog_trace (HOUSE_FAILURE, repository, "HTTP code %d", status);
+        housedepositor_rescan_name (repository);
         return;
     }
     DEBUG ("response to scan of %s: %s\n", repository, data);
 
-    ParserToken tokens[MAX_CACHE*4];
-    int count = MAX_CACHE*4;
-   
+    const char *modified = echttp_attribute_get ("Last-Modified");
+    if (DepotListings[listing].modified) free (DepotListings[listing].modified);
+    DepotListings[listing].modified = modified ? strdup(modified) : 0;
+
+    int count = echttp_json_estimate (data);
+    if (count > DepotTokensSize) {
+        DepotTokensSize = count + 64;
+        DepotTokens = realloc (DepotTokens,
+                               DepotTokensSize*sizeof(ParserToken));
+    }
+    ParserToken *tokens = DepotTokens;
+    count = DepotTokensSize;
+
     const char *error = echttp_json_parse (data, tokens, &count);
     if (error) {
         houselog_trace
@@ -478,6 +910,9 @@ static void housedepositor_scan_response
         houselog_trace (HOUSE_FAILURE, repository, "no host");
         return;
     }
+    snprintf (DepotListings[listing].host, sizeof(DepotListings[0].host),
+              "%s", tokens[host].value.string);
+
     int files = echttp_json_search (tokens, ".files");
     if (files <= 0) {
         houselog_trace (HOUSE_FAILURE, repository, "no file");
@@ -486,7 +921,11 @@ static void housedepositor_scan_response
     int n = tokens[files].length;
     if (n <= 0) return;
 
-    int innerlist[256];
+    if (n > DepotInnerListSize) {
+        DepotInnerListSize = n + 16;
+        DepotInnerList = realloc (DepotInnerList, DepotInnerListSize*sizeof(int));
+    }
+    int *innerlist = DepotInnerList;
     error = echttp_json_enumerate (tokens+files, innerlist);
     if (error) {
         houselog_trace (HOUSE_FAILURE, repository, "bad file list");
@@ -500,43 +939,47 @@ static void housedepositor_scan_response
         int filename = echttp_json_search (inner, ".name");
         int filetime = echttp_json_search (inner, ".time");
         if (filename <= 0 || filetime <= 0) continue;
-        int cached = housedepositor_search (inner[filename].value.string);
-        if (cached < 0) continue;
+        DepotCacheEntry *cached =
+            housedepositor_search (inner[filename].value.string);
+        if (!cached) continue;
         DEBUG ("Found %s at %s\n", inner[filename].value.string,
                                    tokens[host].value.string);
         time_t timestamp = (time_t) (inner[filetime].value.integer);
 
-        if (! DepotCache[cached].active) {
+        time_t previous = cached->detected;
+
+        if (! cached->active) {
             // We keep searching for the most recent revision as long as
             // the configuration item has not been activated yet.
             //
-            if (DepotCache[cached].detected < timestamp) {
-                snprintf(DepotCache[cached].host, sizeof(DepotCache[0].host),
+            if (cached->detected < timestamp) {
+                snprintf(cached->host, sizeof(cached->host),
                          "%s", tokens[host].value.string);
-                DepotCache[cached].detected = timestamp;
-                DepotCache[cached].hostalive = now;
+                cached->detected = timestamp;
+                cached->hostalive = now;
             }
 
-        } else if (!strcmp(DepotCache[cached].host, tokens[host].value.string)) {
+        } else if (!strcmp(cached->host, tokens[host].value.string)) {
             // If the configuration was already activated, follow the chosen
             // server.
             //
-            DepotCache[cached].detected = timestamp;
-            DepotCache[cached].hostalive = now;
+            cached->detected = timestamp;
+            cached->hostalive = now;
 
-        } else if (DepotCache[cached].hostalive < now - 180) {
+        } else if (cached->hostalive < now - 180) {
             // If the chosen server is no longer responding, replace it.
             //
-            snprintf(DepotCache[cached].host, sizeof(DepotCache[0].host),
+            snprintf(cached->host, sizeof(cached->host),
                      "%s", tokens[host].value.string);
-            DepotCache[cached].detected = timestamp;
-            DepotCache[cached].hostalive = now;
+            cached->detected = timestamp;
+            cached->hostalive = now;
         }
+        if (cached->detected != previous) housedepositor_dirty (cached);
     }
 }
 
-static void housedepositor_scan_iterator
-                (const char *service, void *context, const char *provider) {
+static void housedepositor_scan_iterator (const char *service, void *context,
+                                          const char *provider, int rank) {
 
     const char *repository = (const char *)context;
     
@@ -544,30 +987,43 @@ static void housedepositor_scan_iterator
     snprintf (url, sizeof(url),
               "%s/%s/%s/all", provider, repository, DepotGroup);
 
-    const char *error = echttp_client ("GET", url);
+    const char *error = houseportalredirect_client ("GET", provider, url);
     if (error) {
         houselog_trace (HOUSE_FAILURE, repository,
                         "cannot create socket for %s, %s", url, error);
         return;
     }
     DEBUG ("GET %s\n", url);
+    HouseDepositorScanProbe *probe = malloc (sizeof(HouseDepositorScanProbe));
+    probe->listing = housedepositor_listing (url);
+    housedepositor_conditional (probe->listing);
+    probe->repository = repository;
+    probe->provider = strdup (provider);
+    housediscover_probe_start (&(probe->probe), provider);
     DepotScanPending += 1;
-    echttp_submit (0, 0, housedepositor_scan_response, context);
+    echttp_submit (0, 0, housedepositor_scan_response, probe);
 }
 
 static void housedepositor_check_response
                (void *context, int status, char *data, int length) {
 
-    status = echttp_redirected("GET");
+    HouseDepositorCheckProbe *probe = (HouseDepositorCheckProbe *)context;
+
+    status = houseportalredirect_redirected ("GET", probe->provider);
     if (!status){
         echttp_submit (0, 0, housedepositor_check_response, context);
         return;
     }
+    housediscover_probe_end (&(probe->probe), status);
+    free (probe->provider);
+    free (probe);
+
     time_t now = time(0);
 
     DepotCheckPending -= 1;
     if (DepotCheckPending <= 0) {
         DEBUG ("Check of HouseDepot services completed\n");
+        houselog_metrics_elapsed (MetricCheckLatency, DepotCheckStarted);
         // Check if we need to scan now, as this response might be an error.
         if (DepotNeedScan) {
             DepotNextScan = now + 1;
@@ -580,9 +1036,15 @@ static void housedepositor_check_response
     }
     DEBUG ("response to check: %s\n", data);
 
-    ParserToken tokens[16];
-    int count = 16;
-   
+    int count = echttp_json_estimate (data);
+    if (count > DepotTokensSize) {
+        DepotTokensSize = count + 64;
+        DepotTokens = realloc (DepotTokens,
+                               DepotTokensSize*sizeof(ParserToken));
+    }
+    ParserToken *tokens = DepotTokens;
+    count = DepotTokensSize;
+
     const char *error = echttp_json_parse (data, tokens, &count);
     if (error) {
         houselog_trace
@@ -608,24 +1070,54 @@ static void housedepositor_check_response
     }
 
     int i;
+    DepotServiceEntry *service = 0;
     for (i = 0; i < DepotServicesCount; i++) {
         if (strcmp (hostname, DepotServices[i].host)) continue;
-        if (DepotServices[i].timestamp != tokens[updated].value.integer) {
-            DepotServices[i].timestamp = tokens[updated].value.integer;
-            DepotNeedScan = 1;
-        }
+        service = DepotServices + i;
         break;
     }
-    if (i >= DepotServicesCount) {
+    if (!service) {
         if (DepotServicesCount >= DepotServicesSize) {
             DepotServicesSize = DepotServicesCount + 16;
             DepotServices = realloc (DepotServices,
                                      DepotServicesSize*sizeof(DepotServiceEntry));
         }
-        i = DepotServicesCount++;
-        DepotServices[i].host = strdup (hostname);
-        DepotServices[i].timestamp = tokens[updated].value.integer;
-        DepotNeedScan = 1;
+        service = DepotServices + DepotServicesCount++;
+        service->host = strdup (hostname);
+        service->timestamp = 0;
+        service->stamps = 0;
+        service->stampscount = 0;
+        housedepositor_rescan_all (); // A new depot service: scan it all.
+    }
+
+    // A depot service may provide a change stamp for each repository:
+    // if it does, only the repositories that changed are scanned again.
+    //
+    int repositories = echttp_json_search (tokens, ".repositories");
+    if (repositories > 0 && tokens[repositories].type == PARSER_OBJECT) {
+        if (service->stampscount < DepotRepositoriesCount) {
+            service->stamps = realloc (service->stamps,
+                                       DepotRepositoriesCount*sizeof(long long));
+            for (i = service->stampscount; i < DepotRepositoriesCount; i++)
+                service->stamps[i] = 0;
+            service->stampscount = DepotRepositoriesCount;
+        }
+        for (i = 0; i < DepotRepositoriesCount; i++) {
+            char path[256];
+            snprintf (path, sizeof(path),
+                      ".%s", DepotRepositories[i].name);
+            int stamp = echttp_json_search (tokens+repositories, path);
+            long long value = 0;
+            if (stamp > 0) value = tokens[repositories+stamp].value.integer;
+            if (service->stamps[i] != value) {
+                service->stamps[i] = value;
+                housedepositor_rescan (i);
+            }
+        }
+        service->timestamp = tokens[updated].value.integer;
+    } else if (service->timestamp != tokens[updated].value.integer) {
+        service->timestamp = tokens[updated].value.integer;
+        housedepositor_rescan_all ();
     }
 
     if (DepotCheckPending <= 0) {
@@ -636,21 +1128,24 @@ static void housedepositor_check_response
     }
 }
 
-static void housedepositor_check_iterator
-                (const char *service, void *context, const char *provider) {
+static void housedepositor_check_iterator (const char *service, void *context,
+                                           const char *provider, int rank) {
 
     char url[1024];
     snprintf (url, sizeof(url), "%s/check", provider);
 
-    const char *error = echttp_client ("GET", url);
+    const char *error = houseportalredirect_client ("GET", provider, url);
     if (error) {
         houselog_trace (HOUSE_FAILURE, "check",
                         "cannot create socket for %s, %s", url, error);
         return;
     }
     DEBUG ("GET %s \n", url);
+    HouseDepositorCheckProbe *probe = malloc (sizeof(HouseDepositorCheckProbe));
+    probe->provider = strdup (provider);
+    housediscover_probe_start (&(probe->probe), provider);
     DepotCheckPending += 1;
-    echttp_submit (0, 0, housedepositor_check_response, context);
+    echttp_submit (0, 0, housedepositor_check_response, probe);
 }
 
 
@@ -661,6 +1156,7 @@ void housedepositor_periodic (time_t now) {
     
     if ((now > DepotLastScan + 10) && (DepotScanPending > 0)) {
         DEBUG ("Scan timed out, refresh forced\n");
+        housedepositor_rescan_all (); // Some responses might have been lost.
         DepotScanPending = 0;
         DepotNextScan = 0;
         DepotNextRefresh = now - 1; // Do it now.
@@ -682,15 +1178,16 @@ void housedepositor_periodic (time_t now) {
     if ((DepotNextScan > 0) && (now > DepotNextScan)) {
         DEBUG ("Starting to scan all depot services\n");
         int i;
-        for (i = 0; i < MAX_CACHE; i++) {
-            DepotCache[i].detected = 0;
-        }
         DepotScanPending = 0;
-
-        for (i = 0; i < MAX_SOURCE; i++) {
-            if (!DepotRepositories[i]) break;
-            housediscovered
-                ("depot", (void *)(DepotRepositories[i]), housedepositor_scan_iterator);
+        DepotScanStarted = houselog_metrics_clock ();
+
+        for (i = 0; i < DepotRepositoriesCount; i++) {
+            if (!DepotRepositories[i].needscan) continue;
+            DepotRepositories[i].needscan = 0;
+            DEBUG ("Scanning repository %s\n", DepotRepositories[i].name);
+            housediscover_select ("depot", HOUSEDISCOVER_HEALTHY, 0,
+                                  (void *)(DepotRepositories[i].name),
+                                  housedepositor_scan_iterator);
         }
         DepotNextScan = 0;
         DepotLastScan = now;
@@ -700,9 +1197,16 @@ void housedepositor_periodic (time_t now) {
     if (now < DepotLastCheck + 5) return; // Don't check too often.
     DepotLastCheck = now;
 
+    // Repositories that could not be scanned are still pending.
+    int i;
     DepotCheckPending = 0;
     DepotNeedScan = 0;
+    for (i = 0; i < DepotRepositoriesCount; i++) {
+        if (DepotRepositories[i].needscan) DepotNeedScan = 1;
+    }
     DepotNextScan = 0;
-    housediscovered ("depot", 0, housedepositor_check_iterator);
+    DepotCheckStarted = houselog_metrics_clock ();
+    housediscover_select ("depot", HOUSEDISCOVER_HEALTHY, 0,
+                          0, housedepositor_check_iterator);
 }
 
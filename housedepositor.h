@@ -38,5 +38,11 @@ void housedepositor_put_file (const char *repository,
                               const char *name,
                               const char *filename);
 
+typedef void housedepositor_put_listener (const char *name,
+                                          const char *provider,
+                                          int status, int remaining);
+
+void housedepositor_put_listen (housedepositor_put_listener *listener);
+
 void housedepositor_periodic (time_t now);
 
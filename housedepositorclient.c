@@ -96,6 +96,10 @@ int main (int argc, const char **argv) {
 
     option[0] = argv[0];
 
+    // Always fetch the current revision, unless told otherwise: this tool
+    // has no use for the disk cache.
+    option[optioncount++] = "-depot-cache=";
+
     Deadline = time(0) + 5;
 
     for (i = 1; i < argc; ++i) {
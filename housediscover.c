@@ -40,60 +40,223 @@
  *    Doing it this way reduces network traffic (local query does not take
  *    network bandwidth, while still reacting to newly detected portals.
  *
+ *    Both phases use conditional requests: the ETag returned by each portal
+ *    is sent back as If-None-Match, and a 304 (Not Modified) response
+ *    simply confirms all entries previously obtained from that portal.
+ *
+ *    The client also subscribes to change notifications from the local
+ *    portal, by sending a WATCH UDP message every 60s. The portal answers
+ *    with a CHANGED message, and sends a new CHANGED message whenever its
+ *    own registry, or the registry of another portal, changed. A CHANGED
+ *    message triggers an immediate query of the portal that changed only
+ *    (or of the local portal, if that portal is not known yet). While notifications are
+ *    received, the periodic query of the local portal is slowed down to
+ *    every 60s, as a fallback only. Only the CHANGED messages that come
+ *    from the local portal's address are accepted.
+ *
+ *    When the portal runs on the same host, its list of peers and its own
+ *    services are read from the registry that it publishes in /dev/shm
+ *    (see houseportalregistry.c) instead of being queried using HTTP.
+ *    The registry is checked on every call, which costs no system call
+ *    when nothing changed: a change is detected within one call. Only the
+ *    other portals are queried using HTTP. If the registry is missing or
+ *    stale, the local portal is queried using HTTP, as described above.
+ *    When the local portal restarts, all portals are queried right away.
+ *
  * int housediscover_changed (const char *service, time_t since);
  *
  *    Return true if something new was discovered since the specified time,
  *    false otherwise.
  *
+ * long housediscover_generation (void);
+ *
+ *    Return a number that changes each time the result of the discovery
+ *    changes (new provider, lost provider). A caller can compare it with
+ *    the value it saw before to skip work when nothing changed.
+ *
+ * const char **housediscover_providers (const char *service, int *count);
+ *
+ *    Return the list of URLs for all the live providers of the specified
+ *    service. The list is valid until the next call to housediscover():
+ *    the caller must not keep it.
+ *
+ * void housediscover_select (const char *service, int mode, int count,
+ *                            void *context, housediscover_ranked *consumer);
+ *
+ *    Retrieve a subset of the providers, based on their health:
+ *    HOUSEDISCOVER_HEALTHY: all healthy providers (rank is always 0).
+ *    HOUSEDISCOVER_FASTEST: the count healthy providers that respond the
+ *                           fastest, ranked from the fastest (rank 0).
+ *    HOUSEDISCOVER_PRIMARY: all healthy providers: the fastest one is the
+ *                           primary (rank 0), the others are replicas.
+ *
+ * void housediscover_probe_start (housediscover_probe *probe,
+ *                                 const char *provider);
+ * void housediscover_probe_end (housediscover_probe *probe, int status);
+ *
+ *    Measure a request to a provider, to maintain the provider's health:
+ *    an average response time (EWMA) and a count of consecutive errors.
+ *    After a few consecutive errors, the provider is excluded for a while
+ *    (circuit breaker open), then it is selected again for one request
+ *    (half open); the provider is healthy again if that request succeeds,
+ *    otherwise it is excluded again for a longer time.
+ *
  * void housediscovered (const char *service, void *context,
  *                       housediscover_consumer *consumer);
  *
  *    Retrieve the result of the latest discovery. This is a classic iterator
  *    design: the consumer function is called for each matching item found.
  *
- * LIMITATIONS:
- *
- * The current implementation never forget a service instance. That is
- * a problem when moving service instances from server to server.
+ * A service instance that was not confirmed for 120 seconds is presumed
+ * dead and not listed anymore. It is forgotten after 360 seconds. The list
+ * of providers for each service is built again only when something changed.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
 
 #include "echttp.h"
 #include "echttp_json.h"
 #include "echttp_hash.h"
 
 #include "houselog.h"
+#include "houselog_metrics.h"
 #include "housediscover.h"
+#include "houseportalresolve.h"
+#include "houseportalregistry.h"
 
 static const char *LocalPortalServer = "localhost";
+static const char *LocalPortalPort = "70";
+
+// Each service instance is identified by its URL. Slots are reused after
+// an instance was forgotten: an instance is referenced from the outside
+// using its unique identifier, never with its slot index.
+//
+typedef struct {
+    char  *service;
+    char  *url;
+    long   id;
+    long   origin;    // Identifier of the portal that reported it, 0: local.
+    time_t seen;      // Last time this instance was confirmed.
+    time_t detected;  // First detected (or detected again after a lapse).
+    char  *tag;       // ETag, for portals only.
+    int    lapsed;
+    int    next;      // Next instance with the same URL hash (index + 1).
+    int    latency;   // Average response time (ms), 0 if unknown.
+    int    errors;    // Consecutive errors.
+    int    backoff;   // Current circuit breaker delay.
+    time_t probing;   // Half open: when the test request was sent.
+    time_t open;      // Circuit open (provider excluded) until then.
+    long   failures;
+    long long queried; // When the last service request was sent (metrics).
+} DiscoveryInstance;
+
+#define DISCOVERY_ERRORS_MAX 3
+#define DISCOVERY_BACKOFF_MIN 10
+#define DISCOVERY_BACKOFF_MAX 300
 
-static echttp_hash DiscoveryByUrl; // URL is a unique key.
-static time_t DiscoveryTime[ECHTTP_MAX_SYMBOL];
+#define DISCOVERY_HASH 256
 
-static echttp_hash DiscoveryByService; // Service name is not unique.
-static const char *DiscoveryUrl[ECHTTP_MAX_SYMBOL];
-static time_t      DiscoveryDetected[ECHTTP_MAX_SYMBOL];
+static DiscoveryInstance *DiscoveryInstances = 0;
+static int DiscoveryInstancesCount = 0;
+static int DiscoveryInstancesSize = 0;
+static int DiscoveryByUrl[DISCOVERY_HASH]; // Index + 1, 0: empty.
+static long DiscoveryNextId = 0;
+
+static char *DiscoveryPeersTag = 0;
+
+// The materialized list of providers for each service. It is built again
+// only when the generation changed.
+//
+typedef struct {
+    char  *name;
+    const char **urls;
+    int   *slots;
+    int    count;
+    int    size;
+    time_t detected;   // Most recent detection for this service.
+    long   generation; // Generation of the discovery when built.
+} DiscoveryService;
+
+static DiscoveryService *DiscoveryServices = 0;
+static int DiscoveryServicesCount = 0;
+static int DiscoveryServicesSize = 0;
+
+static long DiscoveryGeneration = 1;
 
 static time_t DiscoveryRequest = 0;
+static time_t DiscoveryDetail = 0;
 
 #define DISCOVERY_PORTAL_INTERVAL 10
 #define DISCOVERY_SERVICE_INTERVAL 120
+#define DISCOVERY_FORGET_DELAY (3 * DISCOVERY_SERVICE_INTERVAL)
+
+// The subscription to the local portal's change notifications.
+//
+#define DISCOVERY_WATCH_INTERVAL 60
+#define DISCOVERY_WATCH_HOSTS 32
+
+static int    DiscoveryWatchSocket[2] = {-1, -1}; // IPv4, IPv6.
+static time_t DiscoveryWatchSent = 0;
+static time_t DiscoveryWatchConfirmed = 0;
+
+static struct {
+    char *host;
+    long generation;
+} DiscoveryWatchKnown[DISCOVERY_WATCH_HOSTS];
+static int DiscoveryWatchKnownCount = 0;
+
+// The registry of the local portal, when available.
+//
+static int DiscoveryRegistryEnabled = 0;
+static houseportalregistry *DiscoveryRegistry = 0; // Private copy.
+static uint32_t DiscoveryRegistryImported = 0;
+static long DiscoveryRegistryOrigin = 0; // The local portal's instance.
+static time_t DiscoveryRegistryStarted = 0; // When the local portal started.
 
 #define DEBUG if (echttp_isdebug()) printf
 
+static int MetricPeersLatency = -1;
+static int MetricServiceLatency = -1;
+static int MetricDiscoveryErrors = -1;
+static int MetricProviderLatency = -1;
+static int MetricProviderErrors = -1;
+static int MetricRegistryImports = -1;
+
+static long long DiscoveryPeersQueried = 0;
+
 void housediscover_initialize (int argc, const char **argv) {
 
     int i;
 
+    MetricPeersLatency = houselog_metrics_latency ("discovery.peers");
+    MetricServiceLatency = houselog_metrics_latency ("discovery.service");
+    MetricDiscoveryErrors = houselog_metrics_counter ("discovery.errors");
+    MetricProviderLatency = houselog_metrics_latency ("provider.latency");
+    MetricProviderErrors = houselog_metrics_counter ("provider.errors");
+    MetricRegistryImports = houselog_metrics_counter ("discovery.registry");
+
     for (i = 1; i < argc; ++i) {
         if (echttp_option_match("-portal-server=", argv[i], &LocalPortalServer))
             continue;
+        if (echttp_option_match("-portal-port=", argv[i], &LocalPortalPort))
+            continue;
     }
     DEBUG ("local portal server: %s\n", LocalPortalServer);
+
+    // The registry can only be used if the portal runs on this host.
+    //
+    char hostname[256] = {0};
+    gethostname (hostname, sizeof(hostname));
+    if (!strcmp (LocalPortalServer, "localhost") ||
+        !strcmp (LocalPortalServer, hostname)) DiscoveryRegistryEnabled = 1;
 }
 
 
@@ -103,43 +266,171 @@ static int housediscover_lapsed (time_t timestamp) {
     return (timestamp + DISCOVERY_SERVICE_INTERVAL < DiscoveryRequest);
 }
 
-static int housediscover_register (const char *name, const char *url) {
+// When change notifications are received, the periodic query is only
+// a fallback, in case a notification was lost.
+//
+static int housediscover_interval (time_t now) {
+    if (DiscoveryWatchConfirmed + (2 * DISCOVERY_WATCH_INTERVAL) > now)
+        return DISCOVERY_WATCH_INTERVAL;
+    return DISCOVERY_PORTAL_INTERVAL;
+}
+
+static void housediscover_tag (char **tag) {
+
+    const char *etag = echttp_attribute_get ("ETag");
+
+    if (*tag) {
+        if (etag && !strcmp (*tag, etag)) return;
+        free (*tag);
+        *tag = 0;
+    }
+    if (etag) *tag = strdup (etag);
+}
+
+static void housediscover_conditional (const char *tag) {
+    if (tag) echttp_attribute_set ("If-None-Match", tag);
+}
+
+static DiscoveryInstance *housediscover_search (const char *url) {
+
+    int i;
+    unsigned int hash = echttp_hash_signature (url) % DISCOVERY_HASH;
+
+    for (i = DiscoveryByUrl[hash]; i > 0; i = DiscoveryInstances[i-1].next) {
+        if (!strcmp (DiscoveryInstances[i-1].url, url))
+            return DiscoveryInstances + i - 1;
+    }
+    return 0;
+}
+
+static DiscoveryInstance *housediscover_origin (long id) {
+
+    int i;
+    for (i = 0; i < DiscoveryInstancesCount; ++i) {
+        if (DiscoveryInstances[i].id == id && DiscoveryInstances[i].url)
+            return DiscoveryInstances + i;
+    }
+    return 0;
+}
+
+static void housediscover_forget (int i) {
+
+    DiscoveryInstance *instance = DiscoveryInstances + i;
+    unsigned int hash = echttp_hash_signature (instance->url) % DISCOVERY_HASH;
+    int *link = DiscoveryByUrl + hash;
+
+    while (*link > 0) {
+        if (*link == i + 1) {
+            *link = instance->next;
+            break;
+        }
+        link = &(DiscoveryInstances[*link-1].next);
+    }
+    DEBUG ("forget service %s at %s\n", instance->service, instance->url);
+    houselog_event_local ("DISCOVERY", instance->service,
+                          "LOST", "AT %s", instance->url);
+    free (instance->service);
+    free (instance->url);
+    if (instance->tag) free (instance->tag);
+    memset (instance, 0, sizeof(*instance));
+    DiscoveryGeneration += 1;
+}
 
-    int byurl = echttp_hash_find (&DiscoveryByUrl, url);
-    int isnew = 0;
+static void housediscover_refresh (DiscoveryInstance *instance, time_t now) {
+
+    if (instance->lapsed || housediscover_lapsed (instance->seen)) {
+        instance->detected = now; // Re-detected after lapse
+        instance->lapsed = 0;
+        DiscoveryGeneration += 1;
+    }
+    instance->seen = now;
+}
+
+// Confirm all entries that were reported by the specified origin, after
+// it responded that nothing has changed. The origin of portals is 0.
+//
+static void housediscover_unchanged (long origin) {
+
+    int i;
+    time_t now = time(0);
+
+    for (i = 0; i < DiscoveryInstancesCount; ++i) {
+        DiscoveryInstance *instance = DiscoveryInstances + i;
+        if (instance->url && instance->seen && instance->origin == origin)
+            housediscover_refresh (instance, now);
+    }
+}
+
+static int housediscover_register (const char *name,
+                                   const char *url, long origin) {
+
+    DiscoveryInstance *instance = housediscover_search (url);
     time_t now = time(0);
 
-    if (byurl <= 0) {
-        char *urlsaved = strdup(url);
-        byurl = echttp_hash_add (&DiscoveryByUrl, urlsaved);
-        if (byurl <= 0) {
-            houselog_trace (HOUSE_FAILURE,
-                            "cannot register service %s at %s\n", name, url);
-            free(urlsaved);
+    if (instance) {
+        if (strcmp (instance->service, name)) {
+            // The same URL is now used for a different service.
+            housediscover_forget (instance - DiscoveryInstances);
+        } else {
+            housediscover_refresh (instance, now);
+            instance->origin = origin;
             return 0;
         }
-        DEBUG ("registered new service %s at %s\n", name, url);
-        houselog_event_local ("DISCOVERY", name, "DETECTED", "AT %s", url);
-        isnew = 1;
-    } else {
-        if (housediscover_lapsed (DiscoveryTime[byurl])) {
-            int byservice = echttp_hash_find (&DiscoveryByService, name);
-            if (byservice > 0) {
-                DiscoveryDetected[byservice] = now; // Re-detected after lapse
-            }
+    }
+
+    int i;
+    for (i = 0; i < DiscoveryInstancesCount; ++i) {
+        if (!DiscoveryInstances[i].url) break; // Reuse this slot.
+    }
+    if (i >= DiscoveryInstancesCount) {
+        if (DiscoveryInstancesCount >= DiscoveryInstancesSize) {
+            DiscoveryInstancesSize += 64;
+            DiscoveryInstances =
+                realloc (DiscoveryInstances,
+                         DiscoveryInstancesSize * sizeof(DiscoveryInstance));
         }
+        i = DiscoveryInstancesCount++;
     }
-    DiscoveryTime[byurl] = now;
+    instance = DiscoveryInstances + i;
+    memset (instance, 0, sizeof(*instance));
+    instance->service = strdup(name);
+    instance->url = strdup(url);
+    instance->id = ++DiscoveryNextId;
+    instance->origin = origin;
+    instance->seen = now;
+    instance->detected = now;
+
+    unsigned int hash = echttp_hash_signature (url) % DISCOVERY_HASH;
+    instance->next = DiscoveryByUrl[hash];
+    DiscoveryByUrl[hash] = i + 1;
+
+    DEBUG ("registered new service %s at %s\n", name, url);
+    houselog_event_local ("DISCOVERY", name, "DETECTED", "AT %s", url);
+    DiscoveryGeneration += 1;
+    return 1;
+}
 
-    if (isnew) {
-        // Record one more instance of this service.
-        int byservice = echttp_hash_add (&DiscoveryByService, strdup(name));
-        if (byservice > 0) {
-            DiscoveryUrl[byservice] = strdup(url);
-            DiscoveryDetected[byservice] = now;
+// Detect the instances that lapsed (not listed anymore) and forget
+// those that have been dead for a long time.
+//
+static void housediscover_evict (void) {
+
+    int i;
+
+    for (i = 0; i < DiscoveryInstancesCount; ++i) {
+        DiscoveryInstance *instance = DiscoveryInstances + i;
+        if (!instance->url) continue;
+        if (instance->seen + DISCOVERY_FORGET_DELAY < DiscoveryRequest) {
+            housediscover_forget (i);
+        } else if (!instance->lapsed && housediscover_lapsed (instance->seen)) {
+            instance->lapsed = 1;
+            DiscoveryGeneration += 1;
         }
     }
-    return isnew;
+    while (DiscoveryInstancesCount > 0 &&
+           !DiscoveryInstances[DiscoveryInstancesCount-1].url) {
+        DiscoveryInstancesCount -= 1;
+    }
 }
 
 static void housediscover_service_response
@@ -149,11 +440,24 @@ static void housediscover_service_response
     int count = 100;
     int innerlist[100];
     int i;
+    long portal = (long)origin;
+    DiscoveryInstance *instance = housediscover_origin (portal);
 
+    if (instance) {
+        houselog_metrics_elapsed (MetricServiceLatency, instance->queried);
+        instance->queried = 0;
+    }
+    if (status == 304) {
+        DEBUG ("no change on portal %ld\n", portal);
+        housediscover_unchanged (portal);
+        return;
+    }
     if (status != 200) {
+        houselog_metrics_count (MetricDiscoveryErrors, 1);
         houselog_trace (HOUSE_FAILURE, "service", "HTTP error %d", status);
         return;
     }
+    if (instance) housediscover_tag (&(instance->tag));
 
     const char *error = echttp_json_parse (data, tokens, &count);
     if (error) {
@@ -213,41 +517,72 @@ static void housediscover_service_response
 
         const char *name = inner[service].value.string;
 
-        housediscover_register (name, fullurl);
+        housediscover_register (name, fullurl, portal);
     }
 }
 
-static int housediscover_peers_iterator (int i, const char *name) {
+static void housediscover_query_one (DiscoveryInstance *instance) {
 
-    if (DiscoveryTime[i]) {
-        const char *url = DiscoveryUrl[i];
-        const char *error = echttp_client ("GET", url);
-        if (error) {
-            DEBUG ("error on %s: %s.\n", url, error);
-            houselog_trace (HOUSE_FAILURE, "peers", "%s: %s", url, error);
-            DiscoveryTime[i] = 0;
-            return 0;
+    const char *url = instance->url;
+    const char *error = echttp_client ("GET", url);
+    if (error) {
+        DEBUG ("error on %s: %s.\n", url, error);
+        houselog_trace (HOUSE_FAILURE, "peers", "%s: %s", url, error);
+        instance->seen = 0; // Presumed dead.
+        return;
+    }
+    housediscover_conditional (instance->tag);
+    instance->queried = houselog_metrics_clock ();
+    echttp_submit (0, 0, housediscover_service_response,
+                   (void *)(instance->id));
+    DEBUG ("service request %s submitted.\n", url);
+}
+
+// Now that we have updated our list of portal servers, query them.
+// Actually, do not query a new portal right away: give the services
+// a few seconds to declare themselves.
+//
+static void housediscover_query_portals (int newportal) {
+
+    time_t now = time(0);
+
+    if (newportal) {
+        // Not yet, force one new discovery 3 seconds from now.
+        DiscoveryDetail = 0;
+        DiscoveryRequest = now - housediscover_interval (now) + 2;
+    } else if (now >= DiscoveryDetail + DISCOVERY_SERVICE_INTERVAL) {
+        int i;
+        for (i = 0; i < DiscoveryInstancesCount; ++i) {
+            DiscoveryInstance *instance = DiscoveryInstances + i;
+            if (!instance->url || !instance->seen) continue;
+            if (strcmp (instance->service, "portal")) continue;
+            if (instance->id == DiscoveryRegistryOrigin) continue;
+            housediscover_query_one (instance);
         }
-        echttp_submit (0, 0, housediscover_service_response, 0);
-        DEBUG ("service request %s submitted.\n", url);
+        DiscoveryDetail = now;
     }
-    return 0;
 }
 
 static void housediscover_peers_response (void *origin,
                                           int status, char *data, int length) {
 
-    static time_t DiscoveryDetail = 0;
-
     ParserToken tokens[100];
     int innerlist[100];
     int count = 100;
     int newportal = 0;
     int i;
 
-    time_t now = time(0);
+    houselog_metrics_elapsed (MetricPeersLatency, DiscoveryPeersQueried);
+    DiscoveryPeersQueried = 0;
 
+    if (status == 304) {
+        DEBUG ("no change on /portal/peers\n");
+        housediscover_unchanged (0);
+        housediscover_query_portals (0);
+        return;
+    }
     if (status != 200) {
+        houselog_metrics_count (MetricDiscoveryErrors, 1);
         DEBUG ("HTTP error %d on /portal/peers request\n", status);
         houselog_trace (HOUSE_FAILURE, "peers", "HTTP error %d", status);
         return;
@@ -278,6 +613,7 @@ static void housediscover_peers_response (void *origin,
         houselog_trace (HOUSE_FAILURE, "peers", "%s", error);
         return;
     }
+    housediscover_tag (&DiscoveryPeersTag);
 
     DEBUG ("processing portals result.\n");
 
@@ -291,25 +627,205 @@ static void housediscover_peers_response (void *origin,
         char buffer[256];
         snprintf (buffer, sizeof(buffer),
                   "http://%s/portal/list", inner->value.string);
-        if (housediscover_register ("portal", buffer)) {
+        if (housediscover_register ("portal", buffer, 0)) {
              DEBUG ("new portal %s found.\n", inner->value.string);
              newportal = 1;
         }
     }
+    housediscover_query_portals (newportal);
+}
+
+// Return true if the generation reported is new for this portal.
+//
+static int housediscover_watch_changed (const char *host, long generation) {
+
+    int i;
+
+    for (i = 0; i < DiscoveryWatchKnownCount; ++i) {
+        if (!strcmp (DiscoveryWatchKnown[i].host, host)) {
+            if (DiscoveryWatchKnown[i].generation == generation) return 0;
+            DiscoveryWatchKnown[i].generation = generation;
+            return 1;
+        }
+    }
+    if (DiscoveryWatchKnownCount < DISCOVERY_WATCH_HOSTS) {
+        DiscoveryWatchKnown[i].host = strdup (host);
+        DiscoveryWatchKnown[i].generation = generation;
+        DiscoveryWatchKnownCount += 1;
+    }
+    return 1;
+}
+
+static void housediscover_watch_receive (int fd, int mode) {
+
+    char buffer[1500];
+    char host[256];
+    long timestamp;
+    long generation;
+
+    int length = recv (fd, buffer, sizeof(buffer)-1, 0);
+    if (length <= 0) return;
+    buffer[length] = 0;
+
+    if (sscanf (buffer, "CHANGED %ld %255s %ld",
+                &timestamp, host, &generation) != 3) return;
 
-    // Now that we have updated our list of portal servers, query them.
-    // Actually, do not query a new portal right away: give the services
-    // a few seconds to declare themselves.
+    DiscoveryWatchConfirmed = time(0);
+    if (!housediscover_watch_changed (host, generation)) return;
+
+    DEBUG ("portal %s changed (generation %ld)\n", host, generation);
+
+    // Only query the portal that changed. The local portal is queried on
+    // the next tick instead, in case its list of peers changed as well:
+    // this is also the way an unknown portal gets discovered.
     //
-    if (newportal) {
-        // Not yet, force one new discovery 3 seconds from now.
-        DiscoveryDetail = 0;
-        DiscoveryRequest = now - 8;
-    } else if (now >= DiscoveryDetail + DISCOVERY_SERVICE_INTERVAL) {
-        echttp_hash_iterate (&DiscoveryByService,
-                             "portal", housediscover_peers_iterator);
-        DiscoveryDetail = now;
+    char url[sizeof(host)+32];
+    snprintf (url, sizeof(url), "http://%s/portal/list", host);
+    DiscoveryInstance *portal = housediscover_search (url);
+    if (portal && portal->seen && portal->id != DiscoveryRegistryOrigin &&
+        !strcmp (portal->service, "portal")) {
+        housediscover_query_one (portal);
+    } else {
+        DiscoveryRequest = 0;
+    }
+}
+
+static void housediscover_watch (time_t now) {
+
+    const struct addrinfo *cursor;
+    char buffer[64];
+
+    if (now < DiscoveryWatchSent + DISCOVERY_WATCH_INTERVAL) return;
+
+    cursor = houseportalresolve (LocalPortalServer, LocalPortalPort);
+    if (!cursor) return; // Not resolved yet, try again on the next tick.
+
+    int length = snprintf (buffer, sizeof(buffer), "WATCH %ld", (long)now);
+    int sent[2] = {0, 0};
+
+    // The sockets are connected to the local portal: the kernel then drops
+    // the datagrams coming from any other source, so that no other host
+    // can force a re-query, or hold off the fallback poll. The connection
+    // is renewed on each WATCH in case the portal address changed.
+    //
+    for (; cursor; cursor = cursor->ai_next) {
+        int family = (cursor->ai_family == AF_INET6) ? 1 : 0;
+        if (sent[family]) continue; // One portal address per family.
+        if (DiscoveryWatchSocket[family] < 0) {
+            int fd = socket (cursor->ai_family, SOCK_DGRAM, 0);
+            if (fd < 0) continue;
+            DiscoveryWatchSocket[family] = fd;
+            echttp_listen (fd, 1, housediscover_watch_receive, 0);
+        }
+        if (connect (DiscoveryWatchSocket[family],
+                     cursor->ai_addr, cursor->ai_addrlen) < 0) continue;
+        send (DiscoveryWatchSocket[family], buffer, length, 0);
+        sent[family] = 1;
     }
+    DiscoveryWatchSent = now;
+}
+
+// Use the registry as if it was the response to /portal/peers, followed
+// by the response to the local portal's /portal/list.
+//
+static void housediscover_registry_import (time_t now) {
+
+    int i;
+    int newportal = 0;
+    char url[256];
+    const houseportalregistry *table = DiscoveryRegistry;
+    const houseportalregistry_route *routes =
+        houseportalregistry_routes (table);
+    const houseportalregistry_peer *peers = houseportalregistry_peers (table);
+
+    houselog_metrics_count (MetricRegistryImports, 1);
+    DEBUG ("importing registry generation %ld\n", table->generation);
+
+    // The local portal restarted: its peers may have been lost meanwhile,
+    // do not wait for the next periodic query of the other portals.
+    if (table->started != DiscoveryRegistryStarted) {
+        if (DiscoveryRegistryStarted) DiscoveryDetail = 0;
+        DiscoveryRegistryStarted = table->started;
+    }
+
+    for (i = 0; i < table->peers; ++i) {
+        const houseportalregistry_peer *peer = peers + i;
+        if (peer->expiration && peer->expiration <= now) continue;
+        snprintf (url, sizeof(url), "http://%s/portal/list",
+                  houseportalregistry_string (table, peer->name));
+        if (housediscover_register ("portal", url, 0)) newportal = 1;
+    }
+
+    // The portal always lists itself as a peer.
+    snprintf (url, sizeof(url), "http://%s/portal/list", table->host);
+    DiscoveryInstance *local = housediscover_search (url);
+    if (local) {
+        long origin = local->id;
+        DiscoveryRegistryOrigin = origin;
+
+        for (i = 0; i < table->routes; ++i) {
+            const houseportalregistry_route *route = routes + i;
+            const char *service =
+                houseportalregistry_string (table, route->service);
+            if (!service[0]) continue;
+            if (route->expiration && route->expiration <= now) continue;
+            snprintf (url, sizeof(url), "http://%s%s", table->host,
+                      houseportalregistry_string (table, route->path));
+            housediscover_register (service, url, origin);
+        }
+
+        // The registry is complete: the services that are not listed
+        // anymore are presumed dead right away.
+        for (i = 0; i < DiscoveryInstancesCount; ++i) {
+            DiscoveryInstance *instance = DiscoveryInstances + i;
+            if (!instance->url || instance->origin != origin) continue;
+            if (instance->seen >= now) continue;
+            instance->seen = 0;
+            if (!instance->lapsed) {
+                instance->lapsed = 1;
+                DiscoveryGeneration += 1;
+            }
+        }
+    }
+    housediscover_query_portals (newportal);
+}
+
+// Return true if the registry was used, false if the local portal must
+// be queried using HTTP.
+//
+static int housediscover_registry (time_t now) {
+
+    if (!DiscoveryRegistryEnabled) return 0;
+
+    const houseportalregistry *table =
+        houseportalregistry_attach (LocalPortalPort, now);
+    if (!table) {
+        if (DiscoveryRegistryOrigin) {
+            DEBUG ("registry not available anymore\n");
+            DiscoveryRegistryOrigin = 0;
+            DiscoveryRegistryImported = 0;
+            DiscoveryDetail = 0; // Query all portals, including local.
+        }
+        return 0;
+    }
+    if (houseportalregistry_copy (table,
+                                  &DiscoveryRegistry,
+                                  &DiscoveryRegistryImported)) {
+        DiscoveryRequest = now;
+        housediscover_registry_import (now);
+        return 1;
+    }
+
+    // Nothing changed: confirm what was imported, and query the other
+    // portals, on the same schedule as the HTTP queries.
+    //
+    if (now < DiscoveryRequest + housediscover_interval (now)) return 1;
+    housediscover_unchanged (0);
+    if (DiscoveryRegistryOrigin)
+        housediscover_unchanged (DiscoveryRegistryOrigin);
+    housediscover_query_portals (0);
+    DiscoveryRequest = now;
+    return 1;
 }
 
 void housediscover (time_t now) {
@@ -318,7 +834,12 @@ void housediscover (time_t now) {
         DiscoveryRequest = 0;
         return;
     }
-    if (now < DiscoveryRequest + DISCOVERY_PORTAL_INTERVAL) return;
+    housediscover_watch (now);
+    housediscover_evict ();
+
+    if (housediscover_registry (now)) return;
+
+    if (now < DiscoveryRequest + housediscover_interval (now)) return;
 
     char url[100];
     snprintf (url, sizeof(url), "http://%s/portal/peers", LocalPortalServer);
@@ -329,49 +850,194 @@ void housediscover (time_t now) {
                         "cannot access %s: %s", url, error);
         return;
     }
+    housediscover_conditional (DiscoveryPeersTag);
+    DiscoveryPeersQueried = houselog_metrics_clock ();
     echttp_submit (0, 0, housediscover_peers_response, 0);
     DEBUG ("request %s submitted\n", url);
 
     DiscoveryRequest = now;
 }
 
-static time_t DiscoveryMostRecent = 0;
+static DiscoveryService *housediscover_service (const char *name) {
 
-static int housediscover_changed_iterator (int i, const char *service) {
-    if (DiscoveryDetected[i] > DiscoveryMostRecent)
-        DiscoveryMostRecent = DiscoveryDetected[i];
-    return 0;
-}
+    int i;
 
-int housediscover_changed (const char *service, time_t since) {
-    DiscoveryMostRecent = 0;
-    echttp_hash_iterate (&DiscoveryByService,
-                         service, housediscover_changed_iterator);
-    return DiscoveryMostRecent >= since;
+    for (i = 0; i < DiscoveryServicesCount; ++i) {
+        if (!strcmp (DiscoveryServices[i].name, name))
+            return DiscoveryServices + i;
+    }
+    if (DiscoveryServicesCount >= DiscoveryServicesSize) {
+        DiscoveryServicesSize += 16;
+        DiscoveryServices =
+            realloc (DiscoveryServices,
+                     DiscoveryServicesSize * sizeof(DiscoveryService));
+    }
+    DiscoveryService *service = DiscoveryServices + (DiscoveryServicesCount++);
+    memset (service, 0, sizeof(*service));
+    service->name = strdup (name);
+    return service;
 }
 
-static housediscover_consumer *DiscoveryConsumer = 0;
-static void *DiscoveryConsumerContext = 0;
+static DiscoveryService *housediscover_build (const char *name) {
+
+    int i;
+    DiscoveryService *service = housediscover_service (name);
 
-static int housediscovered_iterator (int i, const char *service) {
+    if (service->generation == DiscoveryGeneration) return service;
 
-    if (housediscover_lapsed (DiscoveryTime[i])) {
-        return 0; // Too old, presumed dead.
+    service->count = 0;
+    service->detected = 0;
+    for (i = 0; i < DiscoveryInstancesCount; ++i) {
+        DiscoveryInstance *instance = DiscoveryInstances + i;
+        if (!instance->url || instance->lapsed) continue;
+        if (strcmp (instance->service, name)) continue;
+        if (service->count >= service->size) {
+            service->size += 8;
+            service->urls =
+                realloc (service->urls, service->size * sizeof(char *));
+            service->slots =
+                realloc (service->slots, service->size * sizeof(int));
+        }
+        service->slots[service->count] = i;
+        service->urls[service->count++] = instance->url;
+        if (instance->detected > service->detected)
+            service->detected = instance->detected;
     }
+    service->generation = DiscoveryGeneration;
+    return service;
+}
 
-    if (DiscoveryConsumer)
-        DiscoveryConsumer (service, DiscoveryConsumerContext, DiscoveryUrl[i]);
-    return 0;
+int housediscover_changed (const char *service, time_t since) {
+    return housediscover_build (service)->detected >= since;
+}
+
+long housediscover_generation (void) {
+    return DiscoveryGeneration;
+}
+
+const char **housediscover_providers (const char *name, int *count) {
+
+    DiscoveryService *service = housediscover_build (name);
+    *count = service->count;
+    return service->urls;
 }
 
 void housediscovered (const char *service,
                       void *context, housediscover_consumer *consumer) {
 
-    DiscoveryConsumer = consumer;
-    DiscoveryConsumerContext = context;
-    echttp_hash_iterate (&DiscoveryByService,
-                         service, housediscovered_iterator);
-    DiscoveryConsumer = 0;
-    DiscoveryConsumerContext = 0;
+    int i;
+    int index = housediscover_build (service) - DiscoveryServices;
+
+    // The consumer might query another service, which could move the
+    // list of services: do not keep a pointer to it.
+    //
+    for (i = 0; i < DiscoveryServices[index].count; ++i) {
+        consumer (service, context, DiscoveryServices[index].urls[i]);
+    }
+}
+
+static int housediscover_healthy (DiscoveryInstance *instance, time_t now) {
+
+    if (!instance->open) return 1;
+    if (now < instance->open) return 0;
+    // Half open: only one request at a time, unless it got lost.
+    return (instance->probing + DISCOVERY_BACKOFF_MIN < now);
+}
+
+void housediscover_select (const char *service, int mode, int count,
+                           void *context, housediscover_ranked *consumer) {
+
+    int selected[64];
+    int n = 0;
+    int i, j;
+    time_t now = time(0);
+    DiscoveryService *cursor = housediscover_build (service);
+
+    for (i = 0; i < cursor->count && n < 64; ++i) {
+        int slot = cursor->slots[i];
+        if (!housediscover_healthy (DiscoveryInstances + slot, now)) continue;
+        if (mode != HOUSEDISCOVER_HEALTHY) {
+            // Keep the list sorted by response time. An unknown response
+            // time comes first, so that it gets measured.
+            int latency = DiscoveryInstances[slot].latency;
+            for (j = n; j > 0; --j) {
+                if (DiscoveryInstances[selected[j-1]].latency <= latency) break;
+                selected[j] = selected[j-1];
+            }
+            selected[j] = slot;
+        } else {
+            selected[n] = slot;
+        }
+        n += 1;
+    }
+    if (mode == HOUSEDISCOVER_FASTEST && n > count) n = count;
+
+    // Copy the URLs first: the consumer might call the discovery again.
+    //
+    const char *urls[64];
+    for (i = 0; i < n; ++i) {
+        DiscoveryInstance *instance = DiscoveryInstances + selected[i];
+        if (instance->open) instance->probing = now;
+        urls[i] = instance->url;
+    }
+    for (i = 0; i < n; ++i) {
+        consumer (service, context, urls[i],
+                  (mode == HOUSEDISCOVER_HEALTHY) ? 0 : i);
+    }
 }
 
+static long long housediscover_clock (void) {
+    struct timeval now;
+    gettimeofday (&now, 0);
+    return (long long)(now.tv_sec) * 1000 + (now.tv_usec / 1000);
+}
+
+void housediscover_probe_start (housediscover_probe *probe,
+                                const char *provider) {
+
+    DiscoveryInstance *instance = housediscover_search (provider);
+
+    probe->provider = instance ? instance->id : 0;
+    probe->started = housediscover_clock ();
+}
+
+void housediscover_probe_end (housediscover_probe *probe, int status) {
+
+    if (!probe->provider) return;
+    DiscoveryInstance *instance = housediscover_origin (probe->provider);
+    probe->provider = 0;
+    if (!instance) return; // Forgotten since.
+
+    instance->probing = 0;
+
+    if (status <= 0 || status >= 500) {
+        houselog_metrics_count (MetricProviderErrors, 1);
+        instance->failures += 1;
+        instance->errors += 1;
+        if (instance->open || instance->errors >= DISCOVERY_ERRORS_MAX) {
+            instance->backoff = instance->backoff ?
+                                    instance->backoff * 2 : DISCOVERY_BACKOFF_MIN;
+            if (instance->backoff > DISCOVERY_BACKOFF_MAX)
+                instance->backoff = DISCOVERY_BACKOFF_MAX;
+            instance->open = time(0) + instance->backoff;
+            DEBUG ("provider %s excluded for %d seconds\n",
+                   instance->url, instance->backoff);
+        }
+        return;
+    }
+
+    int latency = (int)(housediscover_clock () - probe->started);
+    houselog_metrics_record (MetricProviderLatency, latency * 1000LL);
+    if (latency < 1) latency = 1;
+    if (instance->latency)
+        instance->latency = (3 * instance->latency + latency) / 4;
+    else
+        instance->latency = latency;
+
+    if (instance->open) {
+        DEBUG ("provider %s is healthy again\n", instance->url);
+    }
+    instance->errors = 0;
+    instance->backoff = 0;
+    instance->open = 0;
+}
@@ -27,6 +27,30 @@ void housediscover (time_t now);
 
 int housediscover_changed (const char *service, time_t since);
 
+long housediscover_generation (void);
+
+const char **housediscover_providers (const char *service, int *count);
+
+#define HOUSEDISCOVER_HEALTHY 1
+#define HOUSEDISCOVER_FASTEST 2
+#define HOUSEDISCOVER_PRIMARY 3
+
+typedef void housediscover_ranked
+                 (const char *service, void *context,
+                  const char *url, int rank);
+
+void housediscover_select (const char *service, int mode, int count,
+                           void *context, housediscover_ranked *consumer);
+
+typedef struct {
+    long provider;
+    long long started;
+} housediscover_probe;
+
+void housediscover_probe_start (housediscover_probe *probe,
+                                const char *provider);
+void housediscover_probe_end (housediscover_probe *probe, int status);
+
 typedef void housediscover_consumer
                  (const char *service, void *context, const char *url);
 
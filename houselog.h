@@ -45,6 +45,8 @@ void houselog_event_local (const char *category,
                            const char *action,
                            const char *format, ...);
 
+void houselog_threadsafe (void);
+
 void houselog_background (time_t now);
 
 const char *houselog_host (void);
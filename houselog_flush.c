@@ -0,0 +1,215 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselog_flush.c - A scheduler for flushing log data to storage.
+ *
+ * SYNOPSYS:
+ *
+ * int houselog_flush_register (const char *name,
+ *                              int low, int high, int latency);
+ *
+ *    Declare a new stream of log records (events, traces, sensor data..)
+ *    and return its stream identifier.
+ *
+ *    A stream is flushed immediately when the number of pending records
+ *    reaches the high watermark; at most once per second when it reaches
+ *    the low watermark; or when the oldest pending record has waited for
+ *    the maximum latency (in seconds), whatever the number of records.
+ *
+ * int houselog_flush_due (int stream, long pending, time_t now);
+ *
+ *    Return true if the stream should be flushed now, given the number
+ *    of records currently pending.
+ *
+ * void houselog_flush_done (int stream, int records, int bytes, int ok,
+ *                           time_t now);
+ *
+ *    Report the result of a flush, with the number of records and bytes
+ *    involved. A failure starts an exponential backoff, during which
+ *    the stream is not flushed unless its high watermark is reached
+ *    (and even then at most once per second). A success only means that
+ *    the data was queued: the backoff ends when the storage reports that
+ *    the data was accepted (see houselog_flush_outcome()).
+ *
+ * int houselog_flush_stream (const char *logtype);
+ *
+ *    Return the stream that a log type belongs to, or -1 if none. The
+ *    stream is the one whose name is the log type, up to the first '/'
+ *    (e.g. stream "sensor" for log type "sensor/data").
+ *
+ * void houselog_flush_outcome (int stream, int ok, time_t now);
+ *
+ *    Report whether data queued by a previous flush was eventually
+ *    accepted by the storage. A failure is counted, and extends the
+ *    exponential backoff; a success ends it.
+ *
+ * int houselog_flush_status (char *buffer, int size);
+ *
+ *    Format the statistics of all streams as JSON items, to be inserted
+ *    in a JSON object. Return the length of the text.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "houselog_flush.h"
+
+#define FLUSH_MAX_STREAMS 8
+#define FLUSH_MAX_BACKOFF 64
+
+struct FlushStream {
+    const char *name;
+    int    low;
+    int    high;
+    int    latency;
+    time_t oldest;   // When the pending records started to accumulate.
+    time_t last;     // Last flush attempt.
+    time_t retry;    // End of the backoff period.
+    int    backoff;
+    long   flushes;
+    long   records;
+    long   bytes;
+    long   failures;
+    long   pending;
+};
+
+static struct FlushStream FlushStreams[FLUSH_MAX_STREAMS];
+static int FlushStreamsCount = 0;
+
+int houselog_flush_register (const char *name,
+                             int low, int high, int latency) {
+
+    int i;
+
+    for (i = 0; i < FlushStreamsCount; ++i) {
+        if (!strcmp (FlushStreams[i].name, name)) return i;
+    }
+    if (FlushStreamsCount >= FLUSH_MAX_STREAMS) return -1;
+
+    struct FlushStream *stream = FlushStreams + (FlushStreamsCount++);
+    memset (stream, 0, sizeof(*stream));
+    stream->name = name;
+    stream->low = low;
+    stream->high = high;
+    stream->latency = latency;
+    return i;
+}
+
+int houselog_flush_due (int stream, long pending, time_t now) {
+
+    if (pending <= 0) {
+        if (stream >= 0 && stream < FlushStreamsCount) {
+            FlushStreams[stream].oldest = 0;
+            FlushStreams[stream].pending = 0;
+        }
+        return 0;
+    }
+    if (stream < 0 || stream >= FlushStreamsCount) return 1; // No schedule.
+
+    struct FlushStream *cursor = FlushStreams + stream;
+
+    cursor->pending = pending;
+    if (!cursor->oldest) cursor->oldest = now;
+
+    if (now < cursor->retry) {
+        // During backoff, retry at most once per second, and only if the
+        // stream is at risk of losing data.
+        return (pending >= cursor->high) && (now > cursor->last);
+    }
+    if (pending >= cursor->high) return 1;
+
+    if (pending >= cursor->low && now > cursor->last) return 1;
+    return (now >= cursor->oldest + cursor->latency);
+}
+
+void houselog_flush_done (int stream, int records, int bytes, int ok,
+                          time_t now) {
+
+    if (stream < 0 || stream >= FlushStreamsCount) return;
+
+    struct FlushStream *cursor = FlushStreams + stream;
+
+    cursor->last = now;
+    if (ok) {
+        cursor->flushes += 1;
+        cursor->records += records;
+        cursor->bytes += bytes;
+        cursor->oldest = 0;
+        cursor->pending = 0;
+    } else {
+        houselog_flush_outcome (stream, 0, now);
+    }
+}
+
+int houselog_flush_stream (const char *logtype) {
+
+    int i;
+    int length = strcspn (logtype, "/");
+
+    for (i = 0; i < FlushStreamsCount; ++i) {
+        const char *name = FlushStreams[i].name;
+        if (!strncmp (name, logtype, length) && !name[length]) return i;
+    }
+    return -1;
+}
+
+void houselog_flush_outcome (int stream, int ok, time_t now) {
+
+    if (stream < 0 || stream >= FlushStreamsCount) return;
+
+    struct FlushStream *cursor = FlushStreams + stream;
+
+    if (ok) {
+        cursor->backoff = 0;
+        cursor->retry = 0;
+    } else {
+        cursor->failures += 1;
+        cursor->backoff = cursor->backoff ? cursor->backoff * 2 : 1;
+        if (cursor->backoff > FLUSH_MAX_BACKOFF)
+            cursor->backoff = FLUSH_MAX_BACKOFF;
+        cursor->retry = now + cursor->backoff;
+    }
+}
+
+int houselog_flush_status (char *buffer, int size) {
+
+    int length = 0;
+    int i;
+
+    for (i = 0; i < FlushStreamsCount; ++i) {
+        struct FlushStream *cursor = FlushStreams + i;
+        long average = cursor->flushes ? cursor->records / cursor->flushes : 0;
+        length += snprintf (buffer+length, size-length,
+                            "%s\"%s\":{\"flushes\":%ld,\"records\":%ld,"
+                                "\"average\":%ld,\"bytes\":%ld,"
+                                "\"failures\":%ld,\"pending\":%ld,"
+                                "\"backoff\":%d}",
+                            i?",":"", cursor->name,
+                            cursor->flushes, cursor->records, average,
+                            cursor->bytes, cursor->failures,
+                            cursor->pending, cursor->backoff);
+        if (length >= size) {
+            buffer[size-1] = 0;
+            return size - 1;
+        }
+    }
+    return length;
+}
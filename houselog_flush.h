@@ -0,0 +1,32 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselog_flush.h - A scheduler for flushing log data to storage.
+ */
+
+int  houselog_flush_register (const char *name,
+                              int low, int high, int latency);
+int  houselog_flush_due (int stream, long pending, time_t now);
+void houselog_flush_done (int stream, int records, int bytes, int ok,
+                          time_t now);
+int  houselog_flush_stream (const char *logtype);
+void houselog_flush_outcome (int stream, int ok, time_t now);
+int  houselog_flush_status (char *buffer, int size);
+
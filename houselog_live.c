@@ -53,6 +53,15 @@
  *    This is typically used with events that are only useful when
  *    troubleshooting that specific service.
  *
+ * void houselog_threadsafe (void);
+ *
+ *    Allow the application to record events and traces from any thread.
+ *    In this mode, the records are queued in a lock-free ring and then
+ *    moved to the history by the echttp thread, when calling
+ *    houselog_background() or when serving a log request. A record is
+ *    dropped, and counted, if the ring is full. This must be called after
+ *    houselog_initialize() and before any other thread starts logging.
+ *
  * void houselog_background (time_t now);
  *
  *    This function must be called a regular intervals for background
@@ -74,12 +83,15 @@
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <stdatomic.h>
 
 #include "echttp.h"
 #include "echttp_static.h"
 
 #include "houselog.h"
 #include "houselog_storage.h"
+#include "houselog_flush.h"
+#include "houselog_metrics.h"
 #include "housediscover.h"
 
 static const char *LogName = "portal";
@@ -92,7 +104,7 @@ static char LocalHost[256] = {0};
 //
 struct EventRecord {
     struct timeval timestamp;
-    int    unsaved;
+    int    propagate;
     char   category[32];
     char   object[32];
     char   action[16];
@@ -106,6 +118,18 @@ static int EventCursor = 0;
 static long EventLatestId = 0;
 static long EventLastFlushed = 0;
 
+// Each event is converted to JSON once, when it is stored. A response
+// is then built by concatenating these. The event ID tells where an event
+// is stored: the IDs are consecutive, in the order of the history.
+//
+struct EventJson {
+    long id;
+    int  length;
+    char text[sizeof(struct EventRecord)+32];
+};
+
+static struct EventJson EventRendered[EVENT_DEPTH];
+
 // Keep the most recent traces. This is a short history
 // because it is only used to buffer before sending to storage.
 //
@@ -126,6 +150,35 @@ static int TraceCursor = 0;
 static long TraceLatestId = 0;
 static long TraceLastFlushed = 0;
 
+// The flush schedule: the events are flushed quickly, because they are
+// meant for users. The traces are buffered more, since these are for debug.
+//
+static int EventStream = -1;
+static int TraceStream = -1;
+
+// The queue of records produced by other threads, when in thread safe
+// mode. This is a bounded multiple producers, single consumer, ring.
+// Each slot has a sequence number that tells if it is free for the
+// producer (sequence == position) or ready for the consumer (sequence ==
+// position + 1). Producers only compete when reserving a position.
+//
+#define LOG_RING_DEPTH 512 // Must be a power of 2.
+
+struct LogSlot {
+    atomic_long sequence;
+    int is_event;
+    union {
+        struct EventRecord event;
+        struct TraceRecord trace;
+    } record;
+};
+
+static struct LogSlot *LogRing = 0;
+static atomic_long LogRingHead;
+static long LogRingTail = 0;
+static atomic_long LogRingDropped;
+static long LogRingReported = 0;
+
 static void safecpy (char *t, const char *s, int size) {
     if (s) {
         strncpy (t, s, size);
@@ -194,45 +247,60 @@ static const char *houselog_trace_json (time_t now) {
     return buffer;
 }
 
-static const char *houselog_event_json (time_t now, int filtered) {
+// Return the slot for the specified event ID, or -1 if that event is not
+// in the history anymore (or not yet).
+//
+static int houselog_event_slot (long id) {
+
+    long age = EventLatestId - id; // 0 is the most recent event.
+
+    if (age < 0 || age >= EVENT_DEPTH) return -1;
+
+    int slot = EventCursor - 1 - (int)age;
+    if (slot < 0) slot += EVENT_DEPTH;
+    if (EventRendered[slot].id != id) return -1;
+    return slot;
+}
+
+// Build the list of events more recent than the "since" ID. If filtered
+// is set, only the events to propagate are listed, and null is returned if
+// there is no such event.
+//
+static long EventJsonLastId = 0;
+
+static const char *houselog_event_json (time_t now, long since, int filtered) {
 
-    static char buffer[128+EVENT_DEPTH*(sizeof(struct EventRecord)+24)] = {0};
+    static char buffer[128+EVENT_DEPTH*(sizeof(struct EventJson)+2)] = {0};
 
-    const char *prefix = "";
     int length;
-    int i;
+    int count = 0;
+    long id;
 
     length = houselog_getheader (now, buffer, sizeof(buffer));
     length += snprintf (buffer+length, sizeof(buffer)-length, ",\"events\":[");
 
-    for (i = EventCursor + 1; i != EventCursor; ++i) {
-        if (i >= EVENT_DEPTH) {
-            i = 0;
-            if (!EventCursor) break;
-        }
-        struct EventRecord *cursor = EventHistory + i;
+    if (since > EventLatestId) since = 0; // IDs were reset by a restart.
+    if (since < EventLatestId - EVENT_DEPTH) since = EventLatestId - EVENT_DEPTH;
 
-        if (!(cursor->timestamp.tv_sec)) continue;
-        if (filtered && !(cursor->unsaved)) continue;
+    EventJsonLastId = since;
+    for (id = since + 1; id <= EventLatestId; ++id) {
 
-        int wrote = snprintf (buffer+length, sizeof(buffer)-length,
-                              "%s[%lld%03d,\"%s\",\"%s\",\"%s\",\"%s\"]",
-                              prefix,
-                              (long long)(cursor->timestamp.tv_sec),
-                              (int)(cursor->timestamp.tv_usec/1000),
-                              cursor->category,
-                              cursor->object,
-                              cursor->action,
-                              cursor->description);
-        if (wrote >= sizeof(buffer)-length) {
-            buffer[length] = 0;
-            break;
+        int slot = houselog_event_slot (id);
+        if (slot < 0) continue;
+        if (filtered && !(EventHistory[slot].propagate)) {
+            EventJsonLastId = id; // Nothing to do for that one.
+            continue;
         }
-        length += wrote;
-        prefix = ",";
-        if (filtered) cursor->unsaved = 2;
+
+        struct EventJson *json = EventRendered + slot;
+        if (length + json->length + 4 >= sizeof(buffer)) break;
+
+        if (count++) buffer[length++] = ',';
+        memcpy (buffer+length, json->text, json->length);
+        length += json->length;
+        EventJsonLastId = id;
     }
-    if (prefix[0] == 0) return 0; // We did not include any event.
+    if (filtered && count == 0) return 0; // We did not include any event.
 
     snprintf (buffer+length, sizeof(buffer)-length, "]}}");
     return buffer;
@@ -240,69 +308,50 @@ static const char *houselog_event_json (time_t now, int filtered) {
 
 static void houselog_event_flush (void) {
 
+    time_t now = time(0);
+
     // We may not have anything to propagate if the new events were all local.
     //
-    const char *data = houselog_event_json (time(0), 1);
-    if (!data) return; // Nothing to propagate.
-
-    int newunsaved = 1;
-    if (houselog_storage_flush ("events", data)) {
-        EventLastFlushed = EventLatestId;
-        newunsaved = 0;
-    }
-    int i;
-    for (i = EVENT_DEPTH-1; i >= 0; --i) {
-        if (EventHistory[i].unsaved == 2) EventHistory[i].unsaved = newunsaved;
+    const char *data = houselog_event_json (now, EventLastFlushed, 1);
+    if (!data) {
+        EventLastFlushed = EventLatestId; // Nothing to propagate.
+        houselog_flush_due (EventStream, 0, now);
+        return;
     }
+    int ok = houselog_storage_flush ("events", data);
+    houselog_flush_done (EventStream,
+                         (int)(EventJsonLastId - EventLastFlushed),
+                         strlen(data), ok, now);
+    if (ok) EventLastFlushed = EventJsonLastId;
 }
 
 static void houselog_trace_flush (void) {
 
+    time_t now = time(0);
+    const char *data = houselog_trace_json (now);
+
     int newunsaved = 1;
-    if (houselog_storage_flush ("traces", houselog_trace_json (time(0)))) {
+    int ok = houselog_storage_flush ("traces", data);
+    if (ok) {
         TraceLastFlushed = TraceLatestId;
         newunsaved = 0;
     }
     int i;
+    int records = 0;
     for (i = TRACE_DEPTH-1; i >= 0; --i) {
-        if (TraceHistory[i].unsaved == 2) TraceHistory[i].unsaved = newunsaved;
+        if (TraceHistory[i].unsaved == 2) {
+            TraceHistory[i].unsaved = newunsaved;
+            records += 1;
+        }
     }
+    houselog_flush_done (TraceStream, records, strlen(data), ok, now);
 }
 
-static const char *houselog_weblatest (const char *method, const char *uri,
-                                       const char *data, int length) {
-
-    static char buffer[256];
-    int written = houselog_getheader (time(0), buffer, sizeof(buffer));
-    snprintf (buffer+written, sizeof(buffer)-written, "}}");
-    return buffer;
-}
-
-static const char *houselog_webget (const char *method, const char *uri,
-                                    const char *data, int length) {
-
-    echttp_content_type_json ();
-    return houselog_event_json (time(0), 0); // Show the most recent data.
-}
+static void houselog_trace_store (const struct TraceRecord *record) {
 
-void houselog_trace (const char *file, int line, const char *level,
-                     const char *object,
-                     const char *format, ...) {
-
-    va_list ap;
     struct TraceRecord *cursor = TraceHistory + TraceCursor;
 
-    gettimeofday (&(cursor->timestamp), 0);
-
-    va_start (ap, format);
-    vsnprintf (cursor->description, sizeof(cursor->description), format, ap);
-    va_end (ap);
-
-    safecpy (cursor->file, file, sizeof(cursor->file));
-    cursor->line = line;
-    safecpy (cursor->level, level, sizeof(cursor->level));
-    safecpy (cursor->object, object, sizeof(cursor->object));
-    cursor->unsaved = 1;
+    *cursor = *record;
 
     TraceCursor += 1;
     if (TraceCursor >= TRACE_DEPTH) TraceCursor = 0;
@@ -318,44 +367,217 @@ void houselog_trace (const char *file, int line, const char *level,
         // This makes it random enough to make its value change after
         // a restart.
         TraceLatestId = (long) (time(0) & 0xffff);
+        TraceLastFlushed = TraceLatestId;
     }
     TraceLatestId += 1;
 
-    if (echttp_isdebug())
-        printf ("%s %s, %d: %s %s\n", level, file, line, object, cursor->description);
+    if (houselog_flush_due (TraceStream,
+                            TraceLatestId - TraceLastFlushed, time(0)))
+        houselog_trace_flush ();
 }
 
-static void houselog_event_new (const char *category,
-                                const char *object,
-                                const char *action,
-                                const char *text, int propagate) {
+static void houselog_event_store (const struct EventRecord *record) {
 
     struct EventRecord *cursor = EventHistory + EventCursor;
+    struct EventJson *json = EventRendered + EventCursor;
 
-    gettimeofday (&(cursor->timestamp), 0);
+    if (EventLatestId == 0) {
+        // Seed the latest event ID based on the first event's time.
+        // This makes it random enough to make its value change after
+        // a restart.
+        EventLatestId = (long) (time(0) & 0xffff);
+        EventLastFlushed = EventLatestId;
+    }
+    EventLatestId += 1;
+
+    *cursor = *record;
 
-    safecpy (cursor->category, category, sizeof(cursor->category));
-    safecpy (cursor->object, object, sizeof(cursor->object));
-    safecpy (cursor->action, action, sizeof(cursor->action));
-    safecpy (cursor->description, text, sizeof(cursor->description));
-    cursor->unsaved = propagate;
+    json->id = EventLatestId;
+    json->length = snprintf (json->text, sizeof(json->text),
+                             "[%lld%03d,\"%s\",\"%s\",\"%s\",\"%s\"]",
+                             (long long)(cursor->timestamp.tv_sec),
+                             (int)(cursor->timestamp.tv_usec/1000),
+                             cursor->category,
+                             cursor->object,
+                             cursor->action,
+                             cursor->description);
+    if (json->length >= sizeof(json->text)) // Should never happen.
+        json->length = sizeof(json->text) - 1;
 
     EventCursor += 1;
     if (EventCursor >= EVENT_DEPTH) EventCursor = 0;
     cursor = EventHistory + EventCursor;
-    if ((cursor->timestamp.tv_sec) && (cursor->unsaved)) {
+    json = EventRendered + EventCursor;
+    if ((cursor->timestamp.tv_sec) &&
+        (cursor->propagate) && json->id > EventLastFlushed) {
         houselog_event_flush (); // Send for storage before deleting.
     }
     cursor->timestamp.tv_sec = 0;
-    cursor->unsaved = 0;
+    cursor->propagate = 0;
+    json->id = 0;
 
-    if (EventLatestId == 0) {
-        // Seed the latest event ID based on the first event's time.
-        // This makes it random enough to make its value change after
-        // a restart.
-        EventLatestId = (long) (time(0) & 0xffff);
+    if (houselog_flush_due (EventStream,
+                            EventLatestId - EventLastFlushed, time(0)))
+        houselog_event_flush ();
+}
+
+// Reserve a slot in the ring, or return 0 if the ring is full.
+// The caller must then fill the slot and call houselog_ring_commit().
+//
+static struct LogSlot *houselog_ring_reserve (long *position) {
+
+    long pos = atomic_load_explicit (&LogRingHead, memory_order_relaxed);
+
+    for (;;) {
+        struct LogSlot *slot = LogRing + (pos & (LOG_RING_DEPTH-1));
+        long sequence =
+            atomic_load_explicit (&(slot->sequence), memory_order_acquire);
+        long diff = sequence - pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit
+                    (&LogRingHead, &pos, pos+1,
+                     memory_order_relaxed, memory_order_relaxed)) {
+                *position = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit (&LogRingDropped, 1, memory_order_relaxed);
+            return 0; // Full.
+        } else {
+            pos = atomic_load_explicit (&LogRingHead, memory_order_relaxed);
+        }
     }
-    EventLatestId += 1;
+}
+
+static void houselog_ring_commit (struct LogSlot *slot, long position) {
+    atomic_store_explicit (&(slot->sequence), position+1, memory_order_release);
+}
+
+// Move all the queued records to the history. This must only be called
+// from the echttp thread.
+//
+static void houselog_ring_drain (void) {
+
+    if (!LogRing) return;
+
+    for (;;) {
+        struct LogSlot *slot = LogRing + (LogRingTail & (LOG_RING_DEPTH-1));
+        long sequence =
+            atomic_load_explicit (&(slot->sequence), memory_order_acquire);
+        if (sequence != LogRingTail + 1) break; // Empty, or not filled yet.
+
+        if (slot->is_event)
+            houselog_event_store (&(slot->record.event));
+        else
+            houselog_trace_store (&(slot->record.trace));
+
+        atomic_store_explicit (&(slot->sequence),
+                               LogRingTail + LOG_RING_DEPTH,
+                               memory_order_release);
+        LogRingTail += 1;
+    }
+
+    long dropped = atomic_load_explicit (&LogRingDropped, memory_order_relaxed);
+    if (dropped != LogRingReported) {
+        struct TraceRecord record;
+        gettimeofday (&(record.timestamp), 0);
+        snprintf (record.description, sizeof(record.description),
+                  "%ld log records dropped (queue full)",
+                  dropped - LogRingReported);
+        safecpy (record.file, __FILE__, sizeof(record.file));
+        record.line = __LINE__;
+        safecpy (record.level, "WARN", sizeof(record.level));
+        safecpy (record.object, LogName, sizeof(record.object));
+        record.unsaved = 1;
+        houselog_trace_store (&record);
+        LogRingReported = dropped;
+    }
+}
+
+void houselog_threadsafe (void) {
+
+    int i;
+
+    if (LogRing) return; // Already enabled.
+
+    struct LogSlot *ring = calloc (LOG_RING_DEPTH, sizeof(struct LogSlot));
+    for (i = 0; i < LOG_RING_DEPTH; ++i) {
+        atomic_init (&(ring[i].sequence), i);
+    }
+    atomic_init (&LogRingHead, 0);
+    atomic_init (&LogRingDropped, 0);
+    LogRingTail = 0;
+    LogRing = ring;
+}
+
+void houselog_trace (const char *file, int line, const char *level,
+                     const char *object,
+                     const char *format, ...) {
+
+    va_list ap;
+    long position;
+    struct LogSlot *slot = 0;
+    struct TraceRecord local;
+    struct TraceRecord *record = &local;
+
+    if (LogRing) {
+        slot = houselog_ring_reserve (&position);
+        if (!slot) return;
+        slot->is_event = 0;
+        record = &(slot->record.trace);
+    }
+
+    gettimeofday (&(record->timestamp), 0);
+
+    va_start (ap, format);
+    vsnprintf (record->description, sizeof(record->description), format, ap);
+    va_end (ap);
+
+    safecpy (record->file, file, sizeof(record->file));
+    record->line = line;
+    safecpy (record->level, level, sizeof(record->level));
+    safecpy (record->object, object, sizeof(record->object));
+    record->unsaved = 1;
+
+    if (echttp_isdebug())
+        printf ("%s %s, %d: %s %s\n", level, file, line, object, record->description);
+
+    if (slot)
+        houselog_ring_commit (slot, position);
+    else
+        houselog_trace_store (record);
+}
+
+static void houselog_event_new (const char *category,
+                                const char *object,
+                                const char *action,
+                                const char *text, int propagate) {
+
+    long position;
+    struct LogSlot *slot = 0;
+    struct EventRecord local;
+    struct EventRecord *record = &local;
+
+    if (LogRing) {
+        slot = houselog_ring_reserve (&position);
+        if (!slot) return;
+        slot->is_event = 1;
+        record = &(slot->record.event);
+    }
+
+    gettimeofday (&(record->timestamp), 0);
+
+    safecpy (record->category, category, sizeof(record->category));
+    safecpy (record->object, object, sizeof(record->object));
+    safecpy (record->action, action, sizeof(record->action));
+    safecpy (record->description, text, sizeof(record->description));
+    record->propagate = propagate;
+
+    if (slot)
+        houselog_ring_commit (slot, position);
+    else
+        houselog_event_store (record);
 }
 
 void houselog_event (const char *category,
@@ -388,6 +610,75 @@ void houselog_event_local (const char *category,
     houselog_event_new (category, object, action, text, 0); // Not propagated
 }
 
+static const char *houselog_weblatest (const char *method, const char *uri,
+                                       const char *data, int length) {
+
+    static char buffer[512];
+    houselog_ring_drain ();
+    int written = houselog_getheader (time(0), buffer, sizeof(buffer));
+    written += houselog_storage_status (buffer+written, sizeof(buffer)-written);
+    snprintf (buffer+written, sizeof(buffer)-written, "}}");
+    return buffer;
+}
+
+static const char *houselog_webstats (const char *method, const char *uri,
+                                      const char *data, int length) {
+
+    static char buffer[2048];
+    houselog_ring_drain ();
+    int written = houselog_getheader (time(0), buffer, sizeof(buffer));
+    written += snprintf (buffer+written, sizeof(buffer)-written, ",\"flush\":{");
+    written += houselog_flush_status (buffer+written, sizeof(buffer)-written);
+    snprintf (buffer+written, sizeof(buffer)-written, "}}}");
+    echttp_content_type_json ();
+    return buffer;
+}
+
+// The metrics are returned in the Prometheus text format if requested
+// explicitly (format=prometheus), or if the client does not accept JSON.
+//
+static int houselog_webmetrics_text (void) {
+
+    const char *format = echttp_parameter_get ("format");
+    if (format) return !strcmp (format, "prometheus");
+
+    const char *accept = echttp_attribute_get ("Accept");
+    if (!accept || strstr (accept, "json")) return 0;
+    return strstr (accept, "text/plain") || strstr (accept, "openmetrics");
+}
+
+static const char *houselog_webmetrics (const char *method, const char *uri,
+                                        const char *data, int length) {
+
+    static char buffer[65536];
+
+    if (houselog_webmetrics_text ()) {
+        houselog_metrics_prometheus (LogName, buffer, sizeof(buffer));
+        echttp_content_type_set ("text/plain; version=0.0.4");
+        return buffer;
+    }
+    int written = houselog_getheader (time(0), buffer, sizeof(buffer));
+    written += snprintf (buffer+written, sizeof(buffer)-written,
+                         ",\"pid\":%d,\"metrics\":{", (int)getpid());
+    written += houselog_metrics_json (buffer+written, sizeof(buffer)-written);
+    snprintf (buffer+written, sizeof(buffer)-written, "}}}");
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static const char *houselog_webget (const char *method, const char *uri,
+                                    const char *data, int length) {
+
+    long since = 0;
+    const char *known = echttp_parameter_get ("since");
+
+    if (known) since = atol (known);
+
+    houselog_ring_drain ();
+    echttp_content_type_json ();
+    return houselog_event_json (time(0), since, 0); // Most recent data.
+}
+
 void houselog_initialize (const char *name, int argc, const char **argv) {
     int i;
     char uri[256];
@@ -399,6 +690,11 @@ void houselog_initialize (const char *name, int argc, const char **argv) {
     if (name) LogName = strdup(name);
     gethostname (LocalHost, sizeof(LocalHost));
     PortalHost = portal ? portal : LocalHost;
+    houselog_storage_initialize (LogName, argc, argv);
+
+    EventStream = houselog_flush_register ("events", 16, 128, 2);
+    TraceStream = houselog_flush_register ("traces", TRACE_DEPTH / 4,
+                                           (TRACE_DEPTH * 3) / 4, 10);
 
     snprintf (uri, sizeof(uri), "/%s/log/events", LogName);
     echttp_route_uri (strdup(uri), houselog_webget);
@@ -406,11 +702,18 @@ void houselog_initialize (const char *name, int argc, const char **argv) {
     snprintf (uri, sizeof(uri), "/%s/log/latest", LogName);
     echttp_route_uri (strdup(uri), houselog_weblatest);
 
+    snprintf (uri, sizeof(uri), "/%s/log/stats", LogName);
+    echttp_route_uri (strdup(uri), houselog_webstats);
+
+    snprintf (uri, sizeof(uri), "/%s/metrics", LogName);
+    echttp_route_uri (strdup(uri), houselog_webmetrics);
+
     // Alternate paths for application-independent web pages.
     // (The log files are stored at the same place for all applications.)
     //
     echttp_route_uri ("/log/events", houselog_webget);
     echttp_route_uri ("/log/latest", houselog_weblatest);
+    echttp_route_uri ("/log/stats", houselog_webstats);
 
     houselog_background (time(0)); // Initial state (with nothing to flush).
 
@@ -421,20 +724,14 @@ void houselog_initialize (const char *name, int argc, const char **argv) {
 
 void houselog_background (time_t now) {
 
-    static time_t EventLastFlushTime = 0;
-
+    houselog_ring_drain ();
     houselog_storage_background (now);
 
-    if (EventLastFlushed != EventLatestId) {
-        if (now < EventLastFlushTime + 2) return;
+    if (houselog_flush_due (EventStream, EventLatestId - EventLastFlushed, now))
         houselog_event_flush ();
-        EventLastFlushTime = now;
-    }
 
-    // We buffer the traces less because these are for debug.
-    if (TraceLastFlushed != TraceLatestId) {
+    if (houselog_flush_due (TraceStream, TraceLatestId - TraceLastFlushed, now))
         houselog_trace_flush ();
-    }
 }
 
 const char *houselog_host (void) {
@@ -0,0 +1,346 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselog_metrics.c - Lightweight counters and latency histograms.
+ *
+ * SYNOPSYS:
+ *
+ * int houselog_metrics_counter (const char *name);
+ * int houselog_metrics_latency (const char *name);
+ *
+ *    Declare a new counter, or a new latency histogram, and return its
+ *    identifier. Declaring the same name again returns the same metric.
+ *    The name must be a static string. An identifier of -1 (too many
+ *    metrics) is accepted by all the functions below, and ignored.
+ *
+ * void houselog_metrics_count (int metric, long long increment);
+ * void houselog_metrics_set   (int metric, long long value);
+ *
+ *    Increment a counter, or set its value (for a count maintained
+ *    elsewhere).
+ *
+ * long long houselog_metrics_clock (void);
+ * void houselog_metrics_elapsed (int metric, long long start);
+ * void houselog_metrics_record  (int metric, long long microseconds);
+ *
+ *    Measure a latency: houselog_metrics_clock() returns the current
+ *    monotonic time in microseconds, and houselog_metrics_elapsed()
+ *    records the time elapsed since the specified start.
+ *
+ * int houselog_metrics_json (char *buffer, int size);
+ * int houselog_metrics_prometheus (const char *application,
+ *                                  char *buffer, int size);
+ *
+ *    Format all metrics, either as JSON items to be inserted in a JSON
+ *    object, or in the Prometheus text format (with the application name
+ *    as the metric name prefix). Return the length of the text.
+ *
+ * int  houselog_metrics_share (int processes);
+ * void houselog_metrics_process (int index);
+ *
+ *    Share the metrics declared so far between the specified number of
+ *    processes, before these processes are forked. Each process updates
+ *    its own copy, selected by houselog_metrics_process() in the new
+ *    process (0 is the original process), and the metrics are reported
+ *    as the total of all copies (the maximum for the latency maximum).
+ *    A process that replaces another one with the same index continues
+ *    from the values left by the previous process, so that the totals
+ *    never go back. Metrics declared after sharing are local to the
+ *    process that declared them. Return 0 if the metrics could not be
+ *    shared.
+ *
+ * The metrics are kept in static memory, and each process has its own
+ * metrics, unless shared. The values are updated using relaxed atomic operations, with
+ * no locking, so that a metric may be updated from any thread. The metrics
+ * must be declared before other threads start. A latency histogram uses
+ * fixed buckets, from 10 microseconds to 1 second.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "houselog_metrics.h"
+
+#define METRICS_MAX 64
+
+#define METRICS_COUNTER 0
+#define METRICS_LATENCY 1
+
+static const long long MetricsBuckets[] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000,
+    10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+#define METRICS_BUCKETS (sizeof(MetricsBuckets)/sizeof(MetricsBuckets[0]))
+
+struct MetricsEntry {
+    const char *name;
+    int type;
+    atomic_llong value; // Counter value, or count of latency samples.
+    atomic_llong sum;
+    atomic_llong max;
+    atomic_llong histogram[METRICS_BUCKETS+1]; // The last one is overflow.
+};
+
+static struct MetricsEntry Metrics[METRICS_MAX];
+static int MetricsCount = 0;
+
+// When shared, the values of the first MetricsSharedCount metrics are kept
+// in a shared memory area, one array per process. The name and type are
+// still taken from Metrics[].
+//
+static struct MetricsEntry *MetricsShared = 0;
+static int MetricsSharedCount = 0;
+static int MetricsProcesses = 0;
+static struct MetricsEntry *MetricsLocal = 0; // This process's array.
+
+// The values of one metric, after adding all the shared copies.
+//
+struct MetricsTotal {
+    long long value;
+    long long sum;
+    long long max;
+    long long histogram[METRICS_BUCKETS+1];
+};
+
+static struct MetricsEntry *houselog_metrics_entry (int metric) {
+    if (metric < MetricsSharedCount) return MetricsLocal + metric;
+    return Metrics + metric;
+}
+
+static void houselog_metrics_total (int metric, struct MetricsTotal *total) {
+
+    int i, j;
+    int copies = (metric < MetricsSharedCount) ? MetricsProcesses : 1;
+
+    memset (total, 0, sizeof(*total));
+    for (i = 0; i < copies; ++i) {
+        struct MetricsEntry *cursor = (metric < MetricsSharedCount) ?
+            MetricsShared + (i * MetricsSharedCount) + metric : Metrics + metric;
+        long long max = atomic_load (&(cursor->max));
+        total->value += atomic_load (&(cursor->value));
+        total->sum += atomic_load (&(cursor->sum));
+        if (max > total->max) total->max = max;
+        for (j = 0; j <= METRICS_BUCKETS; ++j)
+            total->histogram[j] += atomic_load (cursor->histogram+j);
+    }
+}
+
+static int houselog_metrics_declare (const char *name, int type) {
+
+    int i;
+
+    for (i = 0; i < MetricsCount; ++i) {
+        if (!strcmp (Metrics[i].name, name)) return i;
+    }
+    if (MetricsCount >= METRICS_MAX) return -1;
+
+    struct MetricsEntry *metric = Metrics + (MetricsCount++);
+    memset (metric, 0, sizeof(*metric));
+    metric->name = name;
+    metric->type = type;
+    return i;
+}
+
+int houselog_metrics_counter (const char *name) {
+    return houselog_metrics_declare (name, METRICS_COUNTER);
+}
+
+int houselog_metrics_latency (const char *name) {
+    return houselog_metrics_declare (name, METRICS_LATENCY);
+}
+
+void houselog_metrics_count (int metric, long long increment) {
+    if (metric < 0 || metric >= MetricsCount) return;
+    atomic_fetch_add_explicit (&(houselog_metrics_entry(metric)->value),
+                               increment, memory_order_relaxed);
+}
+
+void houselog_metrics_set (int metric, long long value) {
+    if (metric < 0 || metric >= MetricsCount) return;
+    atomic_store_explicit (&(houselog_metrics_entry(metric)->value),
+                           value, memory_order_relaxed);
+}
+
+long long houselog_metrics_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)(now.tv_sec) * 1000000 + (now.tv_nsec / 1000);
+}
+
+void houselog_metrics_record (int metric, long long microseconds) {
+
+    if (metric < 0 || metric >= MetricsCount) return;
+
+    if (Metrics[metric].type != METRICS_LATENCY) return;
+    struct MetricsEntry *cursor = houselog_metrics_entry (metric);
+    if (microseconds < 0) microseconds = 0;
+
+    int i;
+    for (i = 0; i < METRICS_BUCKETS; ++i) {
+        if (microseconds <= MetricsBuckets[i]) break;
+    }
+    atomic_fetch_add_explicit (cursor->histogram+i, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&(cursor->value), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&(cursor->sum),
+                               microseconds, memory_order_relaxed);
+
+    // The maximum is approximate if two threads race: this is acceptable.
+    if (microseconds > atomic_load_explicit (&(cursor->max),
+                                             memory_order_relaxed))
+        atomic_store_explicit (&(cursor->max),
+                               microseconds, memory_order_relaxed);
+}
+
+void houselog_metrics_elapsed (int metric, long long start) {
+    if (metric < 0 || start <= 0) return;
+    houselog_metrics_record (metric, houselog_metrics_clock() - start);
+}
+
+int houselog_metrics_json (char *buffer, int size) {
+
+    int length = 0;
+    int i, j;
+
+    for (i = 0; i < MetricsCount; ++i) {
+        struct MetricsEntry *cursor = Metrics + i;
+        struct MetricsTotal total;
+        houselog_metrics_total (i, &total);
+        long long value = total.value;
+        if (cursor->type == METRICS_COUNTER) {
+            length += snprintf (buffer+length, size-length, "%s\"%s\":%lld",
+                                i?",":"", cursor->name, value);
+        } else {
+            long long average = value ? total.sum / value : 0;
+            length += snprintf (buffer+length, size-length,
+                                "%s\"%s\":{\"count\":%lld,\"average\":%lld,"
+                                    "\"max\":%lld,\"buckets\":[",
+                                i?",":"", cursor->name,
+                                value, average, total.max);
+            for (j = 0; j <= METRICS_BUCKETS && length < size; ++j) {
+                length += snprintf (buffer+length, size-length, "%s%lld",
+                                    j?",":"", total.histogram[j]);
+            }
+            if (length < size)
+                length += snprintf (buffer+length, size-length, "]}");
+        }
+        if (length >= size) {
+            buffer[size-1] = 0;
+            return size - 1;
+        }
+    }
+    return length;
+}
+
+// Prometheus metric names use only letters, digits and underscores.
+//
+static void houselog_metrics_name (char *name, int size,
+                                   const char *application, const char *metric) {
+    int i;
+    snprintf (name, size, "%s_%s", application, metric);
+    for (i = 0; name[i]; ++i) {
+        char c = name[i];
+        if ((c < 'a' || c > 'z') && (c < 'A' || c > 'Z') &&
+            (c < '0' || c > '9')) name[i] = '_';
+    }
+}
+
+int houselog_metrics_prometheus (const char *application,
+                                 char *buffer, int size) {
+
+    int length = 0;
+    int i, j;
+    char name[128];
+
+    for (i = 0; i < MetricsCount; ++i) {
+        struct MetricsEntry *cursor = Metrics + i;
+        struct MetricsTotal total;
+        houselog_metrics_total (i, &total);
+        long long value = total.value;
+        houselog_metrics_name (name, sizeof(name), application, cursor->name);
+        if (cursor->type == METRICS_COUNTER) {
+            length += snprintf (buffer+length, size-length,
+                                "# TYPE %s_total counter\n%s_total %lld\n",
+                                name, name, value);
+        } else {
+            long long cumulative = 0;
+            length += snprintf (buffer+length, size-length,
+                                "# TYPE %s_seconds histogram\n", name);
+            for (j = 0; j < METRICS_BUCKETS && length < size; ++j) {
+                cumulative += total.histogram[j];
+                length += snprintf (buffer+length, size-length,
+                                    "%s_seconds_bucket{le=\"%g\"} %lld\n",
+                                    name, MetricsBuckets[j] / 1000000.0,
+                                    cumulative);
+            }
+            cumulative += total.histogram[METRICS_BUCKETS];
+            double sum = total.sum / 1000000.0;
+            if (length < size)
+                length += snprintf (buffer+length, size-length,
+                                    "%s_seconds_bucket{le=\"+Inf\"} %lld\n"
+                                    "%s_seconds_sum %g\n"
+                                    "%s_seconds_count %lld\n",
+                                    name, cumulative, name, sum, name, value);
+        }
+        if (length >= size) {
+            buffer[size-1] = 0;
+            return size - 1;
+        }
+    }
+    return length;
+}
+
+int houselog_metrics_share (int processes) {
+
+    int i;
+
+    if (MetricsShared || processes <= 1 || MetricsCount <= 0) return 0;
+
+    size_t size = sizeof(struct MetricsEntry) * processes * MetricsCount;
+    void *map = mmap (0, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return 0;
+
+    // The values accumulated so far belong to the original process.
+    // (The mapping is initialized to zero for all other processes.)
+    //
+    MetricsShared = (struct MetricsEntry *)map;
+    for (i = 0; i < MetricsCount; ++i) {
+        struct MetricsEntry *cursor = MetricsShared + i;
+        int j;
+        atomic_store (&(cursor->value), atomic_load (&(Metrics[i].value)));
+        atomic_store (&(cursor->sum), atomic_load (&(Metrics[i].sum)));
+        atomic_store (&(cursor->max), atomic_load (&(Metrics[i].max)));
+        for (j = 0; j <= METRICS_BUCKETS; ++j)
+            atomic_store (cursor->histogram+j,
+                          atomic_load (Metrics[i].histogram+j));
+    }
+    MetricsProcesses = processes;
+    MetricsLocal = MetricsShared;
+    MetricsSharedCount = MetricsCount;
+    return 1;
+}
+
+void houselog_metrics_process (int index) {
+    if (!MetricsShared || index < 0 || index >= MetricsProcesses) return;
+    MetricsLocal = MetricsShared + (index * MetricsSharedCount);
+}
@@ -0,0 +1,39 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselog_metrics.h - Lightweight counters and latency histograms.
+ */
+
+int  houselog_metrics_counter (const char *name);
+int  houselog_metrics_latency (const char *name);
+
+void houselog_metrics_count (int metric, long long increment);
+void houselog_metrics_set   (int metric, long long value);
+
+long long houselog_metrics_clock (void);
+void houselog_metrics_elapsed (int metric, long long start);
+void houselog_metrics_record  (int metric, long long microseconds);
+
+int  houselog_metrics_json (char *buffer, int size);
+int  houselog_metrics_prometheus (const char *application,
+                                  char *buffer, int size);
+
+int  houselog_metrics_share (int processes);
+void houselog_metrics_process (int index);
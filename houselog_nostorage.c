@@ -23,10 +23,18 @@
 
 #include <time.h>
 
+void houselog_storage_initialize (const char *name,
+                                  int argc, const char **argv) {
+}
+
 int houselog_storage_flush (const char *logtype, const char *data) {
     return 1;
 }
 
+int houselog_storage_status (char *buffer, int size) {
+    return 0;
+}
+
 void houselog_storage_background (time_t now) {
 }
 
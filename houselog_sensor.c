@@ -26,20 +26,26 @@
  *                                  int argc, const char **argv);
  *
  *    Initialize the environment required to record sensor data. This must be
- *    the first function that the application calls.
+ *    the first function that the application calls. The command line option
+ *    -log-sensor-compact selects the compact upload format (see below).
  *
  * void houselog_sensor_data (const struct timeval *timestamp,
  *                            const char *location, const char *name,
  *                            const char *value, const char *unit);
  *
  *    Submit a new sensor data record. The timestamp parameter is used as
- *    a one millisecond precision time (microseconds are ignored).
+ *    a one millisecond precision time (microseconds are ignored). A value
+ *    that is a valid number is stored as a number.
  *
  * void houselog_sensor_numeric (const struct timeval *timestamp,
  *                               const char *location, const char *name,
  *                               long long value, const char *unit);
  *
- *    Submit a new sensor data record. This is a numeric variant of
+ * void houselog_sensor_real (const struct timeval *timestamp,
+ *                            const char *location, const char *name,
+ *                            double value, const char *unit);
+ *
+ *    Submit a new sensor data record. These are numeric variants of
  *    houselog_sensor_data().
  *
  * void houselog_sensor_flush (void);
@@ -56,6 +62,26 @@
  *
  * There is no mechanism for web access to the local sensor data: web access
  * is provided by the historical service.
+ *
+ * The sensor data is stored in columns: the location, name and unit
+ * strings are interned in a dictionary, the values are stored as native
+ * integer or floating point numbers (or as a dictionary reference for
+ * text values) and the timestamps are stored as millisecond deltas from
+ * the previous sample.
+ *
+ * By default the data is sent using the original "sensor/data" format,
+ * limited to SENSOR_LEGACY_DEPTH samples per document. The compact format
+ * is sent as "sensor/compact" and can hold the whole buffer:
+ *
+ *    "sensor":{"dictionary":["kitchen","temperature","F",..],
+ *              "start":1700000000123,
+ *              "time":[0,1000,..],
+ *              "location":[0,0,..], "name":[1,1,..], "unit":[2,2,..],
+ *              "value":[71,71.5,..]}
+ *
+ * Each time item is the delta in milliseconds with the previous sample.
+ * The location, name and unit items are indexes in the dictionary. Text
+ * values are stored as JSON strings.
  */
 
 #include <unistd.h>
@@ -64,6 +90,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 
@@ -72,6 +99,7 @@
 
 #include "houselog.h"
 #include "houselog_storage.h"
+#include "houselog_flush.h"
 #include "houselog_sensor.h"
 
 static const char *LogName = "portal";
@@ -79,137 +107,280 @@ static const char *PortalHost = 0;
 
 static char LocalHost[256] = {0};
 
-// Keep the most recent events. This is a relatively long
-// history because it is used to feed the web event pages.
+static int SensorCompact = 0;
+
+// The default flush schedule is slow because the application is
+// responsible for calling the flush when appropriate.
+//
+static int SensorStream = -1;
+
+// The columnar sensor buffer. The dictionary is reset after each flush,
+// so that each document only lists the strings it actually uses.
 //
-struct SensorRecord {
-    struct timeval timestamp;
-    int    unsaved;
-    char   location[32];
-    char   name[32];
-    char   value[16];
-    char   unit[16];
-};
-
-#define SENSOR_DEPTH 256
-
-static struct SensorRecord SensorHistory[SENSOR_DEPTH];
-static int SensorCursor = 0;
+#define SENSOR_CAPACITY      4096
+#define SENSOR_LEGACY_DEPTH  256
+#define SENSOR_DICTIONARY    256
+#define SENSOR_HASH          512 // Must be a power of 2.
+
+#define SENSOR_INTEGER 0
+#define SENSOR_REAL    1
+#define SENSOR_TEXT    2
+
+static char     SensorDictionary[SENSOR_DICTIONARY][32];
+static int      SensorDictionaryCount = 0;
+static int16_t  SensorDictionaryHash[SENSOR_HASH]; // Index + 1, 0: empty.
+
+static long long SensorStart = 0;    // Time of the first sample (ms).
+static long long SensorPrevious = 0; // Time of the latest sample (ms).
+
+static int32_t  SensorTime[SENSOR_CAPACITY];
+static uint8_t  SensorLocation[SENSOR_CAPACITY];
+static uint8_t  SensorName[SENSOR_CAPACITY];
+static uint8_t  SensorUnit[SENSOR_CAPACITY];
+static uint8_t  SensorType[SENSOR_CAPACITY];
+static union {
+    int64_t integer;
+    double  real;
+    int     text;
+} SensorValue[SENSOR_CAPACITY];
+static int SensorCount = 0;
+static int SensorSent = 0; // Legacy samples already accepted for storage.
+
 static long SensorLatestId = 0;
-static long SensorLastFlushed = 0;
 
-static time_t SensorLastFlushTime = 0;
+static char *SensorJson = 0;
+static int   SensorJsonSize = 0;
+static int   SensorJsonLength = 0;
 
-static void safecpy (char *t, const char *s, int size) {
-    if (s) {
-        strncpy (t, s, size);
-        t[size-1] = 0;
-    } else {
-        t[0] = 0;
+static void houselog_sensor_reset (void) {
+    SensorCount = 0;
+    SensorSent = 0;
+    SensorDictionaryCount = 0;
+    memset (SensorDictionaryHash, 0, sizeof(SensorDictionaryHash));
+}
+
+static int houselog_sensor_intern (const char *text) {
+
+    char value[sizeof(SensorDictionary[0])];
+    unsigned int hash = 2166136261u;
+    const char *c;
+
+    if (!text) text = "";
+    snprintf (value, sizeof(value), "%s", text);
+    for (c = value; *c; ++c) hash = (hash ^ (unsigned char)(*c)) * 16777619u;
+
+    int i;
+    for (i = hash & (SENSOR_HASH-1);
+         SensorDictionaryHash[i] > 0; i = (i+1) & (SENSOR_HASH-1)) {
+        int index = SensorDictionaryHash[i] - 1;
+        if (!strcmp (SensorDictionary[index], value)) return index;
+    }
+    if (SensorDictionaryCount >= SENSOR_DICTIONARY) return -1;
+
+    strcpy (SensorDictionary[SensorDictionaryCount], value);
+    SensorDictionaryHash[i] = ++SensorDictionaryCount;
+    return SensorDictionaryCount - 1;
+}
+
+static void houselog_sensor_add (const char *format, ...) {
+
+    va_list ap;
+
+    for (;;) {
+        int room = SensorJsonSize - SensorJsonLength;
+        if (room > 0) {
+            va_start (ap, format);
+            int wrote = vsnprintf (SensorJson + SensorJsonLength,
+                                   room, format, ap);
+            va_end (ap);
+            if (wrote < room) {
+                SensorJsonLength += wrote;
+                return;
+            }
+        }
+        SensorJsonSize += 16384;
+        SensorJson = realloc (SensorJson, SensorJsonSize);
     }
 }
 
-static int houselog_sensor_getheader (time_t now, char *buffer, int size) {
+static void houselog_sensor_header (time_t now) {
 
+    SensorJsonLength = 0;
     if (PortalHost) {
-        return snprintf (buffer, size,
-                        "{\"host\":\"%s\",\"proxy\":\"%s\",\"apps\":[\"%s\"],"
-                            "\"timestamp\":%ld,\"%s\":{\"latest\":%ld",
-                        LocalHost, PortalHost, LogName,
-                            (long)now, LogName, SensorLatestId);
+        houselog_sensor_add ("{\"host\":\"%s\",\"proxy\":\"%s\",\"apps\":[\"%s\"],"
+                                 "\"timestamp\":%ld,\"%s\":{\"latest\":%ld",
+                             LocalHost, PortalHost, LogName,
+                                 (long)now, LogName, SensorLatestId);
+    } else {
+        houselog_sensor_add ("{\"host\":\"%s\",\"apps\":[\"%s\"],"
+                                 "\"timestamp\":%ld,\"%s\":{\"latest\":%ld",
+                             LocalHost, LogName,
+                                 (long)now, LogName, SensorLatestId);
     }
-    return snprintf (buffer, size,
-                    "{\"host\":\"%s\",\"apps\":[\"%s\"],"
-                        "\"timestamp\":%ld,\"%s\":{\"latest\":%ld",
-                    LocalHost, LogName,
-                        (long)now, LogName, SensorLatestId);
 }
 
-static const char *houselog_sensor_json (time_t now) {
+static void houselog_sensor_value (int i) {
+
+    switch (SensorType[i]) {
+        case SENSOR_INTEGER:
+            houselog_sensor_add ("%lld", (long long)(SensorValue[i].integer));
+            break;
+        case SENSOR_REAL:
+            houselog_sensor_add ("%.15g", SensorValue[i].real);
+            break;
+        default:
+            houselog_sensor_add ("\"%s\"",
+                                 SensorDictionary[SensorValue[i].text]);
+    }
+}
 
-    static char buffer[128+SENSOR_DEPTH*(sizeof(struct SensorRecord)+24)] = {0};
+static void houselog_sensor_column (const char *name, const uint8_t *column) {
 
-    const char *prefix = "";
-    int length;
     int i;
+    houselog_sensor_add (",\"%s\":[", name);
+    for (i = 0; i < SensorCount; ++i) {
+        houselog_sensor_add (i?",%d":"%d", column[i]);
+    }
+    houselog_sensor_add ("]");
+}
 
-    length = houselog_sensor_getheader (now, buffer, sizeof(buffer));
-    length += snprintf (buffer+length, sizeof(buffer)-length, ",\"sensor\":[");
+static const char *houselog_sensor_compact_json (time_t now) {
 
-    for (i = SensorCursor + 1; i != SensorCursor; ++i) {
-        if (i >= SENSOR_DEPTH) {
-            i = 0;
-            if (!SensorCursor) break;
-        }
-        struct SensorRecord *cursor = SensorHistory + i;
-
-        if (!(cursor->timestamp.tv_sec)) continue;
-        if (!(cursor->unsaved)) continue;
-
-        int wrote = snprintf (buffer+length, sizeof(buffer)-length,
-                              "%s[%lld%03d,\"%s\",\"%s\",\"%s\",\"%s\"]",
-                              prefix,
-                              (long long)(cursor->timestamp.tv_sec),
-                              (int)(cursor->timestamp.tv_usec/1000),
-                              cursor->location,
-                              cursor->name,
-                              cursor->value,
-                              cursor->unit);
-        if (wrote >= sizeof(buffer)-length) {
-            buffer[length] = 0;
-            break;
-        }
-        length += wrote;
-        prefix = ",";
-        cursor->unsaved = 2;
+    int i;
+
+    houselog_sensor_header (now);
+    houselog_sensor_add (",\"sensor\":{\"dictionary\":[");
+    for (i = 0; i < SensorDictionaryCount; ++i) {
+        houselog_sensor_add (i?",\"%s\"":"\"%s\"", SensorDictionary[i]);
+    }
+    houselog_sensor_add ("],\"start\":%lld,\"time\":[", SensorStart);
+    for (i = 0; i < SensorCount; ++i) {
+        houselog_sensor_add (i?",%d":"%d", SensorTime[i]);
     }
-    if (prefix[0] == 0) return 0; // We did not include any data.
+    houselog_sensor_add ("]");
+    houselog_sensor_column ("location", SensorLocation);
+    houselog_sensor_column ("name", SensorName);
+    houselog_sensor_column ("unit", SensorUnit);
+    houselog_sensor_add (",\"value\":[");
+    for (i = 0; i < SensorCount; ++i) {
+        if (i) houselog_sensor_add (",");
+        houselog_sensor_value (i);
+    }
+    houselog_sensor_add ("]}}}");
+    return SensorJson;
+}
 
-    snprintf (buffer+length, sizeof(buffer)-length, "]}}");
-    return buffer;
+static const char *houselog_sensor_json (time_t now, int first, int last) {
+
+    long long timestamp = SensorStart;
+    int i;
+
+    houselog_sensor_header (now);
+    houselog_sensor_add (",\"sensor\":[");
+
+    for (i = 0; i < first; ++i) timestamp += SensorTime[i];
+
+    for (i = first; i < last; ++i) {
+        timestamp += SensorTime[i];
+        houselog_sensor_add ("%s[%lld,\"%s\",\"%s\",\"",
+                             (i > first)?",":"",
+                             timestamp,
+                             SensorDictionary[SensorLocation[i]],
+                             SensorDictionary[SensorName[i]]);
+        if (SensorType[i] == SENSOR_TEXT)
+            houselog_sensor_add ("%s", SensorDictionary[SensorValue[i].text]);
+        else
+            houselog_sensor_value (i);
+        houselog_sensor_add ("\",\"%s\"]", SensorDictionary[SensorUnit[i]]);
+    }
+    houselog_sensor_add ("]}}");
+    return SensorJson;
 }
 
 void houselog_sensor_flush (void) {
 
-    const char *data = houselog_sensor_json (time(0));
-    if (!data) return; // Nothing to propagate.
+    if (SensorCount <= 0) return; // Nothing to propagate.
+
+    time_t now = time(0);
+    int bytes = 0;
+    int records = SensorCount;
+    int ok = 1;
 
-    int newunsaved = 1;
-    if (houselog_storage_flush ("sensor/data", data)) {
-        SensorLastFlushed = SensorLatestId;
-        SensorLastFlushTime = time(0);
-        newunsaved = 0;
+    if (SensorCompact) {
+        ok = houselog_storage_flush ("sensor/compact",
+                                     houselog_sensor_compact_json (now));
+        bytes = SensorJsonLength;
+    } else {
+        // Resume after the documents that were already accepted, so that
+        // no sample is sent twice if a previous flush failed midway.
+        //
+        int first = SensorSent;
+        while (ok && SensorSent < SensorCount) {
+            int last = SensorSent + SENSOR_LEGACY_DEPTH;
+            if (last > SensorCount) last = SensorCount;
+            ok = houselog_storage_flush
+                    ("sensor/data", houselog_sensor_json (now, SensorSent, last));
+            bytes += SensorJsonLength;
+            if (ok) SensorSent = last;
+        }
+        records = SensorSent - first;
     }
-    int i;
-    for (i = SENSOR_DEPTH-1; i >= 0; --i) {
-        if (SensorHistory[i].unsaved == 2) SensorHistory[i].unsaved = newunsaved;
+    houselog_flush_done (SensorStream, records, bytes, ok, now);
+    if (ok) {
+        houselog_sensor_reset ();
     }
 }
 
-void houselog_sensor_data (const struct timeval *timestamp,
-                           const char *location,
-                           const char *name,
-                           const char *value,
-                           const char *unit) {
+static int houselog_sensor_next (const struct timeval *timestamp,
+                                 const char *location,
+                                 const char *name,
+                                 const char *unit) {
 
-    struct SensorRecord *cursor = SensorHistory + SensorCursor;
+    long long ms = (long long)(timestamp->tv_sec) * 1000
+                       + (timestamp->tv_usec / 1000);
+    int retry;
 
-    cursor->timestamp = *timestamp;
+    for (retry = 0; retry < 2; ++retry) {
 
-    safecpy (cursor->location, location, sizeof(cursor->location));
-    safecpy (cursor->name, name, sizeof(cursor->name));
-    safecpy (cursor->value, value, sizeof(cursor->value));
-    safecpy (cursor->unit, unit, sizeof(cursor->unit));
-    cursor->unsaved = 1;
+        if (SensorCount >= SENSOR_CAPACITY) {
+            houselog_sensor_flush (); // Send for storage before deleting.
+            if (SensorCount >= SENSOR_CAPACITY) houselog_sensor_reset ();
+        }
+        if (SensorCount > 0) {
+            long long delta = ms - SensorPrevious;
+            if (delta > INT32_MAX || delta < INT32_MIN) {
+                houselog_sensor_flush ();
+                if (SensorCount > 0) houselog_sensor_reset ();
+            }
+        }
 
-    SensorCursor += 1;
-    if (SensorCursor >= SENSOR_DEPTH) SensorCursor = 0;
-    cursor = SensorHistory + SensorCursor;
-    if ((cursor->timestamp.tv_sec) && (cursor->unsaved)) {
-        houselog_sensor_flush (); // Send for storage before deleting.
+        int l = houselog_sensor_intern (location);
+        int n = houselog_sensor_intern (name);
+        int u = houselog_sensor_intern (unit);
+        if (l < 0 || n < 0 || u < 0) {
+            // The dictionary is full: send the current data and start anew.
+            houselog_sensor_flush ();
+            if (SensorCount > 0) houselog_sensor_reset ();
+            continue;
+        }
+
+        int i = SensorCount;
+        if (i == 0) SensorStart = SensorPrevious = ms;
+        SensorTime[i] = (int32_t)(ms - SensorPrevious);
+        SensorPrevious = ms;
+        SensorLocation[i] = l;
+        SensorName[i] = n;
+        SensorUnit[i] = u;
+        return i;
     }
-    cursor->timestamp.tv_sec = 0;
-    cursor->unsaved = 0;
+    return -1; // Cannot happen.
+}
+
+static void houselog_sensor_commit (void) {
+
+    SensorCount += 1;
+    if (houselog_flush_due (SensorStream, SensorCount - SensorSent, time(0)))
+        houselog_sensor_flush ();
 
     if (SensorLatestId == 0) {
         // Seed the latest event ID based on the first event's time.
@@ -220,12 +391,71 @@ void houselog_sensor_data (const struct timeval *timestamp,
     SensorLatestId += 1;
 }
 
+void houselog_sensor_data (const struct timeval *timestamp,
+                           const char *location,
+                           const char *name,
+                           const char *value,
+                           const char *unit) {
+
+    char ascii[32];
+    char *end;
+
+    if (!value) value = "";
+
+    // Store the value as a number if this does not change its text.
+    //
+    long long integer = strtoll (value, &end, 10);
+    if (value[0] && *end == 0) {
+        snprintf (ascii, sizeof(ascii), "%lld", integer);
+        if (!strcmp (ascii, value)) {
+            houselog_sensor_numeric (timestamp, location, name, integer, unit);
+            return;
+        }
+    }
+    double real = strtod (value, &end);
+    if (value[0] && *end == 0) {
+        snprintf (ascii, sizeof(ascii), "%.15g", real);
+        if (!strcmp (ascii, value)) {
+            houselog_sensor_real (timestamp, location, name, real, unit);
+            return;
+        }
+    }
+
+    int i = houselog_sensor_next (timestamp, location, name, unit);
+    if (i < 0) return;
+    int t = houselog_sensor_intern (value);
+    if (t < 0) {
+        houselog_sensor_flush ();
+        if (SensorCount > 0) houselog_sensor_reset ();
+        i = houselog_sensor_next (timestamp, location, name, unit);
+        if (i < 0) return;
+        t = houselog_sensor_intern (value);
+    }
+    SensorType[i] = SENSOR_TEXT;
+    SensorValue[i].text = t;
+    houselog_sensor_commit ();
+}
+
 void houselog_sensor_numeric (const struct timeval *timestamp,
                               const char *location, const char *name,
                               long long value, const char *unit) {
-    char ascii[32];
-    snprintf (ascii, sizeof(ascii), "%lld", value);
-    houselog_sensor_data (timestamp, location, name, ascii, unit);
+
+    int i = houselog_sensor_next (timestamp, location, name, unit);
+    if (i < 0) return;
+    SensorType[i] = SENSOR_INTEGER;
+    SensorValue[i].integer = value;
+    houselog_sensor_commit ();
+}
+
+void houselog_sensor_real (const struct timeval *timestamp,
+                           const char *location, const char *name,
+                           double value, const char *unit) {
+
+    int i = houselog_sensor_next (timestamp, location, name, unit);
+    if (i < 0) return;
+    SensorType[i] = SENSOR_REAL;
+    SensorValue[i].real = value;
+    houselog_sensor_commit ();
 }
 
 
@@ -235,23 +465,23 @@ void houselog_sensor_initialize (const char *name, int argc, const char **argv)
 
     for (i = 1; i < argc; ++i) {
         if (echttp_option_match("-portal-server=", argv[i], &portal)) continue;
+        if (echttp_option_present("-log-sensor-compact", argv[i])) {
+            SensorCompact = 1;
+        }
     }
     if (name) LogName = strdup(name);
     gethostname (LocalHost, sizeof(LocalHost));
     PortalHost = portal ? portal : LocalHost;
+    houselog_storage_initialize (LogName, argc, argv);
+
+    SensorStream = houselog_flush_register ("sensor", 1024, 2048, 10);
 }
 
 void houselog_sensor_background (time_t now) {
 
     houselog_storage_background (now);
 
-    if (SensorLastFlushed != SensorLatestId) {
-        // The default flush timer is slow because the application is
-        // responsible for calling the flush when appropriate.
-        //
-        if (now < SensorLastFlushTime + 10) return;
+    if (houselog_flush_due (SensorStream, SensorCount - SensorSent, now))
         houselog_sensor_flush ();
-        SensorLastFlushTime = now;
-    }
 }
 
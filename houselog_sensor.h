@@ -31,6 +31,10 @@ void houselog_sensor_numeric (const struct timeval *timestamp,
                               const char *location, const char *name,
                               long long value, const char *unit);
 
+void houselog_sensor_real (const struct timeval *timestamp,
+                           const char *location, const char *name,
+                           double value, const char *unit);
+
 void houselog_sensor_flush (void);
 
 void houselog_sensor_background (time_t now);
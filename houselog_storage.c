@@ -22,91 +22,728 @@
  *
  * SYNOPSYS:
  *
+ * void houselog_storage_initialize (const char *name,
+ *                                   int argc, const char **argv);
+ *
+ *    Initialize the storage pipeline from the command line options:
+ *    -log-batch-size=N   Send the batch when it reaches N bytes.
+ *    -log-batch-delay=N  Send the batch at least every N seconds.
+ *    -log-compress       Send the batches with deflate content encoding.
+ *    -log-spill-size=N   Size of the spill file in bytes (0: no spill).
+ *    -log-spill-backup=PATH  Keep a copy of the spill file in PATH.
+ *    -log-storage=MODE   Which history services to send to: healthy (all
+ *                        healthy services), fastest (the fastest ones) or
+ *                        primary (fastest first, others as replicas).
+ *    -log-storage-count=N  The number of services used in fastest mode.
+ *
  * int houselog_storage_flush (const char *logtype, const char *data);
  *
- *    Send the log data to all known history services.
+ *    Queue the log data for all known history services. The data is copied
+ *    to the current batch, which is sent when it is large enough or old
+ *    enough. If no history service is available, the data is appended
+ *    to the spill file. Returns 0 if the data could not be queued. Whether
+ *    the history services accepted the batch is reported later to the
+ *    flush scheduler (see houselog_flush_outcome()), for the streams of
+ *    all the documents in the batch.
+ *
+ * int houselog_storage_status (char *buffer, int size);
+ *
+ *    Format the status of the spill file as JSON items, to be inserted
+ *    in a JSON object. Return the length of the text.
  *
  * void houselog_storage_background (time_t now);
  *
  *    This function must be called a regular intervals for background
  *    processing, e.g. cleanup of expired resources, file backup, etc.
+ *
+ * A batch combines all pending log documents (events, traces, sensor data)
+ * into one single request per history service:
+ *
+ *    POST /log/batch
+ *    [{"log":"events","data":{..}},{"log":"sensor/data","data":{..}},..]
+ *
+ * The batch is built once and shared by all the requests: it is freed when
+ * the last request completes. The batch is only sent to history services
+ * that are healthy, as measured by the discovery module. In primary mode,
+ * the outcome of the batch (accepted or spilled) is decided as soon as the
+ * primary service responded: the replicas do not delay it. A history service that does not support
+ * /log/batch (HTTP status 404) gets each document separately, using the
+ * original /log/{logtype} URI.
+ *
+ * When no history service is available, or if no history service accepted
+ * a batch, the documents are appended to a spill file in /dev/shm. This
+ * file is memory mapped and used as a ring buffer: when full, the oldest
+ * documents are dropped. Each record is tagged with the time it was spilled.
+ * Once a history service is available again, the spill file is replayed in
+ * order: one batch at a time, the next batch being sent only after the
+ * previous one was accepted. While the spill file is not empty, new documents
+ * are appended to it, so that the history services get the data in order.
+ *
+ * If a backup path is provided, the spill file is copied there every
+ * hour, and it is restored from there on startup if there is no spill
+ * file in /dev/shm, the same way houselog.c does for its own files.
+ *
+ * The spill file is used only by the process that opened it. A process
+ * forked after initialization (e.g. a worker) shares the same mapping, but
+ * the ring is not protected by any lock: the child process releases the
+ * mapping, and then sends its documents without a spill file.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
 
 #include "echttp.h"
 
 #include "houselog_storage.h"
+#include "houselog_flush.h"
+#include "houselog_metrics.h"
 #include "housediscover.h"
+#include "houseportalredirect.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
+#define STORAGE_MAX_ITEMS 32
+
+struct StorageItem {
+    char logtype[24];
+    int offset;
+    int length;
+};
+
+struct StoragePayload {
+    int   refcount;
+    char *data;
+    int   length;
+    int   size;
+    char *compressed;
+    int   compressedlength;
+    struct StorageItem items[STORAGE_MAX_ITEMS];
+    int   count;
+    int   accepted;
+    int   completed;
+    int   replay;
+    uint64_t spillend; // Spill position after the last replayed record.
+};
+
 struct PendingRequest {
-    const char *logtype;
-    char       *data;
-    int         length;
-    int         count;
+    struct StoragePayload *payload;
+    char *provider;
+    int item; // -1 for the complete batch.
+    int primary;
+    long long started;
+    housediscover_probe probe;
 };
 
+static struct StoragePayload *StorageBatch = 0;
+static time_t StorageBatchTime = 0;
+
+static int StorageBatchLimit = 32768;
+static int StorageBatchDelay = 1;
+static int StorageCompress = 0;
+
+static int StorageMode = HOUSEDISCOVER_HEALTHY;
+static int StorageFastest = 1;
+
+static int MetricStorageLatency = -1;
+static int MetricStorageRejected = -1;
+static int MetricStorageSpilled = -1;
+
+// The history services that do not support batches.
+//
+static const char *StorageLegacy[32];
+static int StorageLegacyCount = 0;
+
+// The spill file. The head and tail are positions that only grow: the
+// offset in the data area is the position modulo the data size. A record
+// never wraps around: if there is not enough room left before the end of
+// the data area, a padding marker is written and the record starts at the
+// beginning of the data area.
+//
+#define SPILL_MAGIC "HLSPILL1"
+#define SPILL_PAD   0xffffffff
+
+struct SpillHeader {
+    char     magic[8];
+    uint32_t size;
+    uint32_t count;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+};
+
+struct SpillRecord {
+    uint32_t length; // Length of the data, or SPILL_PAD.
+    uint32_t timestamp;
+    char     logtype[24];
+};
+
+#define SPILL_ALIGN(x) (((x) + 7) & ~7)
+
+static int StorageSpillSize = 1024 * 1024;
+static const char *StorageSpillBackup = 0;
+static char StorageSpillName[256];
+static struct SpillHeader *StorageSpill = 0;
+static char *StorageSpillData = 0;
+static int StorageReplayPending = 0;
+static time_t StorageSpillSaved = 0;
+static pid_t  StorageSpillOwner = 0;
+
+// Release the spill file if this process was forked after it was opened.
+//
+static void houselog_storage_spill_owned (void) {
+
+    if (!StorageSpill || StorageSpillOwner == getpid()) return;
+
+    munmap (StorageSpill, sizeof(struct SpillHeader) + StorageSpill->size);
+    StorageSpill = 0;
+    StorageSpillData = 0;
+    StorageReplayPending = 0;
+    DEBUG ("Spill file %s released by PID %d\n",
+           StorageSpillName, (int)getpid());
+}
+
+static void houselog_storage_spill_backup (void) {
+
+    char command[1024];
+
+    if (!StorageSpillBackup || !StorageSpill) return;
+
+    msync (StorageSpill, sizeof(struct SpillHeader) + StorageSpill->size,
+           MS_SYNC);
+    snprintf (command, sizeof(command),
+              "/bin/cp -f -u %s %s", StorageSpillName, StorageSpillBackup);
+    system (command);
+}
+
+static void houselog_storage_spill_restore (void) {
+
+    struct stat buffer;
+
+    if (!StorageSpillBackup) return;
+    if (stat (StorageSpillName, &buffer) == 0) return; // Keep the latest.
+
+    char backup[1024];
+    if (snprintf (backup, sizeof(backup), "%s/%s",
+                  StorageSpillBackup, strrchr(StorageSpillName, '/') + 1)
+            >= sizeof(backup)) return; // Path too long.
+    if (stat (backup, &buffer) == 0) {
+        char command[sizeof(backup)+sizeof(StorageSpillName)+16];
+        snprintf (command, sizeof(command),
+                  "/bin/cp -u %s %s", backup, StorageSpillName);
+        system (command);
+    }
+}
+
+static void houselog_storage_spill_open (const char *name) {
+
+    int size = SPILL_ALIGN(StorageSpillSize);
+    int total = sizeof(struct SpillHeader) + size;
+
+    if (StorageSpill || size <= 0) return;
+
+    snprintf (StorageSpillName, sizeof(StorageSpillName),
+              "/dev/shm/house%s_spill.dat", name);
+    houselog_storage_spill_restore ();
+
+    int fd = open (StorageSpillName, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return;
+
+    struct stat status;
+    int fresh = (fstat (fd, &status) != 0) || (status.st_size != total);
+    if (fresh) {
+        if (ftruncate (fd, 0) || ftruncate (fd, total)) {
+            close (fd);
+            return;
+        }
+    }
+    void *map = mmap (0, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) return;
+
+    StorageSpill = (struct SpillHeader *)map;
+    StorageSpillData = (char *)(StorageSpill + 1);
+    StorageSpillOwner = getpid();
+
+    if (fresh ||
+        memcmp (StorageSpill->magic, SPILL_MAGIC, 8) ||
+        StorageSpill->size != size ||
+        StorageSpill->head < StorageSpill->tail ||
+        StorageSpill->head - StorageSpill->tail > size) {
+        memset (StorageSpill, 0, sizeof(struct SpillHeader));
+        memcpy (StorageSpill->magic, SPILL_MAGIC, 8);
+        StorageSpill->size = size;
+    }
+    DEBUG ("Spill file %s: %d records pending\n",
+           StorageSpillName, StorageSpill->count);
+}
+
+static struct SpillRecord *houselog_storage_spill_oldest (void) {
+
+    struct SpillHeader *spill = StorageSpill;
+
+    while (spill->tail < spill->head) {
+        struct SpillRecord *record =
+            (struct SpillRecord *)(StorageSpillData + (spill->tail % spill->size));
+        if (record->length != SPILL_PAD) return record;
+        spill->tail += spill->size - (spill->tail % spill->size);
+    }
+    spill->count = 0;
+    return 0;
+}
+
+static void houselog_storage_spill_pop (struct SpillRecord *record) {
+
+    StorageSpill->tail += SPILL_ALIGN(sizeof(*record) + record->length);
+    if (StorageSpill->count > 0) StorageSpill->count -= 1;
+}
+
+static int houselog_storage_spill (const char *logtype,
+                                   const char *data, int length) {
+
+    struct SpillHeader *spill = StorageSpill;
+
+    if (!spill) return 0;
+
+    uint32_t needed = SPILL_ALIGN(sizeof(struct SpillRecord) + length);
+    if (needed > spill->size / 4) return 0; // Unreasonable.
+
+    uint32_t extra;
+    for (;;) {
+        uint32_t room = spill->size - (spill->head % spill->size);
+        extra = (room < needed) ? room : 0;
+        if (spill->size - (spill->head - spill->tail) >= needed + extra) break;
+
+        struct SpillRecord *oldest = houselog_storage_spill_oldest ();
+        if (!oldest) break; // Cannot happen: all remaining data is free.
+        houselog_storage_spill_pop (oldest);
+        spill->dropped += 1;
+    }
+
+    if (extra) {
+        struct SpillRecord *pad =
+            (struct SpillRecord *)(StorageSpillData + (spill->head % spill->size));
+        pad->length = SPILL_PAD;
+        spill->head += extra;
+    }
+
+    struct SpillRecord *record =
+        (struct SpillRecord *)(StorageSpillData + (spill->head % spill->size));
+    record->timestamp = (uint32_t)time(0);
+    snprintf (record->logtype, sizeof(record->logtype), "%s", logtype);
+    memcpy ((char *)(record + 1), data, length);
+    record->length = length; // Set last, to mark the record as complete.
+
+    spill->head += needed;
+    spill->count += 1;
+    return 1;
+}
+
+int houselog_storage_status (char *buffer, int size) {
+
+    houselog_storage_spill_owned ();
+    struct SpillHeader *spill = StorageSpill;
+
+    if (!spill) return 0;
+
+    long lag = 0;
+    struct SpillRecord *oldest = houselog_storage_spill_oldest ();
+    if (oldest) lag = (long)(time(0) - oldest->timestamp);
+
+    return snprintf (buffer, size,
+                     ",\"spill\":{\"depth\":%u,\"bytes\":%lld,"
+                         "\"lag\":%ld,\"dropped\":%lld}",
+                     spill->count,
+                     (long long)(spill->head - spill->tail),
+                     lag, (long long)(spill->dropped));
+}
+
+void houselog_storage_initialize (const char *name,
+                                  int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-log-batch-size=", argv[i], &value)) {
+            StorageBatchLimit = atoi(value);
+            if (StorageBatchLimit < 1024) StorageBatchLimit = 1024;
+        } else if (echttp_option_match ("-log-batch-delay=", argv[i], &value)) {
+            StorageBatchDelay = atoi(value);
+            if (StorageBatchDelay < 0) StorageBatchDelay = 0;
+        } else if (echttp_option_present ("-log-compress", argv[i])) {
+            StorageCompress = 1;
+        } else if (echttp_option_match ("-log-spill-size=", argv[i], &value)) {
+            StorageSpillSize = atoi(value);
+        } else if (echttp_option_match ("-log-spill-backup=", argv[i], &value)) {
+            StorageSpillBackup = value;
+        } else if (echttp_option_match ("-log-storage=", argv[i], &value)) {
+            if (!strcmp (value, "fastest"))
+                StorageMode = HOUSEDISCOVER_FASTEST;
+            else if (!strcmp (value, "primary"))
+                StorageMode = HOUSEDISCOVER_PRIMARY;
+            else
+                StorageMode = HOUSEDISCOVER_HEALTHY;
+        } else if (echttp_option_match ("-log-storage-count=", argv[i], &value)) {
+            StorageFastest = atoi(value);
+            if (StorageFastest < 1) StorageFastest = 1;
+        }
+    }
+    houselog_storage_spill_open (name ? name : "portal");
+
+    MetricStorageLatency = houselog_metrics_latency ("storage.post");
+    MetricStorageRejected = houselog_metrics_counter ("storage.rejected");
+    MetricStorageSpilled = houselog_metrics_counter ("storage.spilled");
+}
+
+static int houselog_storage_is_legacy (const char *provider) {
+
+    int i;
+
+    for (i = 0; i < StorageLegacyCount; ++i) {
+        if (!strcmp (StorageLegacy[i], provider)) return 1;
+    }
+    return 0;
+}
+
+static void houselog_storage_replay (void);
+
+// Decide what to do with the batch: this happens when the primary service
+// responded, or else when the last response was received.
+//
+static void houselog_storage_complete (struct StoragePayload *payload) {
+
+    int i;
+    unsigned int reported = 0;
+    time_t now = time(0);
+
+    if (payload->completed) return;
+    payload->completed = 1;
+
+    // Report the outcome once for each stream present in the batch.
+    //
+    for (i = 0; i < payload->count; ++i) {
+        int stream = houselog_flush_stream (payload->items[i].logtype);
+        if (stream < 0 || stream >= 32) continue;
+        if (reported & (1u << stream)) continue;
+        reported |= (1u << stream);
+        houselog_flush_outcome (stream, payload->accepted, now);
+    }
+
+    if (payload->replay) {
+        StorageReplayPending = 0;
+        if (payload->accepted && StorageSpill) {
+            // Forget about the records that were replayed successfully.
+            struct SpillRecord *record;
+            while (StorageSpill->tail < payload->spillend) {
+                record = houselog_storage_spill_oldest ();
+                if (!record) break;
+                houselog_storage_spill_pop (record);
+            }
+            houselog_storage_replay (); // Next batch, if any.
+        }
+    } else if (!payload->accepted) {
+        DEBUG ("Batch of %d documents was not accepted\n", payload->count);
+        houselog_metrics_count (MetricStorageSpilled, payload->count);
+        for (i = 0; i < payload->count; ++i) {
+            struct StorageItem *item = payload->items + i;
+            houselog_storage_spill (item->logtype,
+                                    payload->data + item->offset, item->length);
+        }
+    }
+}
+
+static void houselog_storage_release (struct StoragePayload *payload) {
+
+    if ((--payload->refcount) > 0) return;
+
+    houselog_storage_complete (payload);
+    free (payload->data);
+    if (payload->compressed) free (payload->compressed);
+    free (payload);
+}
+
+static void houselog_storage_submit (struct PendingRequest *request);
+
+static void houselog_storage_post (struct StoragePayload *payload,
+                                   const char *provider, int item, int primary) {
+
+    char url[1024];
+
+    if (item < 0)
+        snprintf (url, sizeof(url), "%s/log/batch", provider);
+    else
+        snprintf (url, sizeof(url),
+                  "%s/log/%s", provider, payload->items[item].logtype);
+
+    const char *error = houseportalredirect_client ("POST", provider, url);
+    if (error) return;
+
+    struct PendingRequest *request = malloc (sizeof(struct PendingRequest));
+    request->payload = payload;
+    request->provider = strdup(provider);
+    request->item = item;
+    request->primary = primary;
+    request->started = houselog_metrics_clock ();
+    housediscover_probe_start (&(request->probe), provider);
+    payload->refcount += 1;
+
+    houselog_storage_submit (request);
+}
+
+static void houselog_storage_post_items (struct StoragePayload *payload,
+                                         const char *provider) {
+    int i;
+    for (i = 0; i < payload->count; ++i) {
+        houselog_storage_post (payload, provider, i, 0);
+    }
+}
+
 static void houselog_storage_response
                 (void *context, int status, char *data, int length) {
 
    struct PendingRequest *request = (struct PendingRequest *)context;
+   struct StoragePayload *payload = request->payload;
 
-   status = echttp_redirected("POST");
+   status = houseportalredirect_redirected ("POST", request->provider);
    if (!status) {
-       echttp_submit (request->data, request->length,
-                      houselog_storage_response, context);
+       houselog_storage_submit (request);
        return;
    }
 
-   if ((--request->count) <= 0) { // Last response
-       free (request->data);
-       free (request);
+   housediscover_probe_end (&(request->probe), status);
+   houselog_metrics_elapsed (MetricStorageLatency, request->started);
+
+   if (status >= 200 && status < 300)
+       payload->accepted = 1;
+   else
+       houselog_metrics_count (MetricStorageRejected, 1);
+
+   if (status == 404 && request->item < 0) {
+       // This history service does not support batches.
+       if (StorageLegacyCount < 32 &&
+           !houselog_storage_is_legacy (request->provider)) {
+           DEBUG ("%s does not support batches\n", request->provider);
+           StorageLegacy[StorageLegacyCount++] = strdup(request->provider);
+       }
+       houselog_storage_post_items (payload, request->provider);
+   } else if (request->primary) {
+       houselog_storage_complete (payload);
    }
+
+   free (request->provider);
+   free (request);
+   houselog_storage_release (payload);
 }
 
-static void houselog_storage_send
-               (const char *service, void *context, const char *provider) {
+static void houselog_storage_submit (struct PendingRequest *request) {
 
-    DEBUG ("Sendig data to %s\n", provider);
+    struct StoragePayload *payload = request->payload;
 
-    struct PendingRequest *request = (struct PendingRequest *)context;
-    char url[1024];
-    snprintf (url, sizeof(url), "%s/log/%s", provider, request->logtype);
+    echttp_content_type_json();
+    if (request->item >= 0) {
+        struct StorageItem *item = payload->items + request->item;
+        echttp_submit (payload->data + item->offset, item->length,
+                       houselog_storage_response, request);
+    } else if (payload->compressed) {
+        echttp_attribute_set ("Content-Encoding", "deflate");
+        echttp_submit (payload->compressed, payload->compressedlength,
+                       houselog_storage_response, request);
+    } else {
+        echttp_submit (payload->data, payload->length,
+                       houselog_storage_response, request);
+    }
+}
 
-    const char *error = echttp_client ("POST", url);
-    if (error) return;
+static void houselog_storage_send (const char *service, void *context,
+                                   const char *provider, int rank) {
 
-    echttp_content_type_json();
-    echttp_submit (request->data, request->length,
-                   houselog_storage_response, context);
-    request->count += 1;
+    DEBUG ("Sending data to %s (rank %d)\n", provider, rank);
+
+    struct StoragePayload *payload = (struct StoragePayload *)context;
+    int primary = (StorageMode == HOUSEDISCOVER_PRIMARY) && (rank == 0);
+
+    if (houselog_storage_is_legacy (provider))
+        houselog_storage_post_items (payload, provider);
+    else
+        houselog_storage_post (payload, provider, -1, primary);
+}
+
+static void houselog_storage_compress (struct StoragePayload *payload) {
+
+    uLongf size = compressBound (payload->length);
+
+    payload->compressed = malloc (size);
+    if (compress2 ((Bytef *)payload->compressed, &size,
+                   (const Bytef *)payload->data, payload->length,
+                   Z_DEFAULT_COMPRESSION) != Z_OK || size >= payload->length) {
+        free (payload->compressed); // Not worth it.
+        payload->compressed = 0;
+        return;
+    }
+    payload->compressedlength = (int)size;
+    DEBUG ("Compressed batch from %d to %d bytes\n",
+           payload->length, payload->compressedlength);
+}
+
+static void houselog_storage_dispatch (struct StoragePayload *payload) {
+
+    payload->data[payload->length++] = ']';
+    payload->data[payload->length] = 0;
+
+    if (StorageCompress && payload->length > 1024)
+        houselog_storage_compress (payload);
+
+    DEBUG ("Flushing batch of %d documents (%d bytes)\n",
+           payload->count, payload->length);
+
+    housediscover_select ("history", StorageMode, StorageFastest,
+                          payload, houselog_storage_send);
+    houselog_storage_release (payload); // Release the batch's own reference.
+}
+
+static void houselog_storage_dispatch_batch (void) {
+
+    struct StoragePayload *payload = StorageBatch;
+
+    if (!payload) return;
+    StorageBatch = 0;
+    houselog_storage_dispatch (payload);
+}
+
+static struct StoragePayload *houselog_storage_new (void) {
+
+    struct StoragePayload *payload = calloc (1, sizeof(struct StoragePayload));
+    payload->refcount = 1;
+    payload->size = StorageBatchLimit + 64;
+    payload->data = malloc (payload->size);
+    payload->data[0] = '[';
+    payload->length = 1;
+    return payload;
+}
+
+static void houselog_storage_append (struct StoragePayload *payload,
+                                     const char *logtype,
+                                     const char *data, int length) {
+
+    static const char *separator = ",{\"log\":\"%s\",\"data\":";
+
+    int needed = payload->length + length + strlen(logtype) + 64;
+    if (needed > payload->size) {
+        payload->size = needed;
+        payload->data = realloc (payload->data, payload->size);
+    }
+    payload->length += snprintf (payload->data + payload->length,
+                                 payload->size - payload->length,
+                                 separator + (payload->count?0:1), logtype);
+
+    struct StorageItem *item = payload->items + (payload->count++);
+    snprintf (item->logtype, sizeof(item->logtype), "%s", logtype);
+    item->offset = payload->length;
+    item->length = length;
+
+    memcpy (payload->data + payload->length, data, length);
+    payload->length += length;
+    payload->data[payload->length++] = '}';
+}
+
+static void houselog_storage_replay (void) {
+
+    struct SpillHeader *spill = StorageSpill;
+
+    if (!spill || StorageReplayPending) return;
+
+    // Collect the oldest records, without removing them from the spill
+    // file yet: this is done only when a history service accepted them.
+    //
+    uint64_t saved = spill->tail;
+    uint32_t savedcount = spill->count;
+    struct StoragePayload *payload = 0;
+    struct SpillRecord *record;
+
+    while ((record = houselog_storage_spill_oldest ())) {
+        if (payload) {
+            if (payload->count >= STORAGE_MAX_ITEMS) break;
+            if (payload->length + record->length > StorageBatchLimit) break;
+        } else {
+            payload = houselog_storage_new ();
+            payload->replay = 1;
+        }
+        houselog_storage_append (payload, record->logtype,
+                                 (const char *)(record + 1), record->length);
+        houselog_storage_spill_pop (record);
+    }
+    if (!payload) return;
+
+    payload->spillend = spill->tail;
+    spill->tail = saved;
+    spill->count = savedcount;
+
+    DEBUG ("Replaying %d spilled documents\n", payload->count);
+    StorageReplayPending = 1;
+    houselog_storage_dispatch (payload);
 }
 
 int houselog_storage_flush (const char *logtype, const char *data) {
 
+    int length = strlen(data);
+    int providers;
+
     DEBUG ("Flushing: %s\n", data);
 
-    struct PendingRequest *request = malloc (sizeof(struct PendingRequest));
+    houselog_storage_spill_owned ();
+    housediscover_providers ("history", &providers);
+    if (!providers || (StorageSpill && StorageSpill->count > 0)) {
+        // No service is available, or older data must be sent first.
+        return houselog_storage_spill (logtype, data, length);
+    }
 
-    request->logtype = logtype;
-    request->data = strdup (data);
-    request->length = strlen(request->data);
-    request->count = 0;
+    if (StorageBatch) {
+        int needed = StorageBatch->length + length + 64;
+        if (StorageBatch->count >= STORAGE_MAX_ITEMS ||
+            (StorageBatch->count > 0 && needed > StorageBatchLimit)) {
+            houselog_storage_dispatch_batch ();
+        }
+    }
 
-    housediscovered ("history", request, houselog_storage_send);
-    if (request->count) return 1; // Pending.
+    if (!StorageBatch) {
+        StorageBatch = houselog_storage_new ();
+        StorageBatchTime = time(0);
+    }
 
-    // No request was issued: no service is available. Cancel the request.
-    free (request->data);
-    free (request);
-    return 0;
+    struct StoragePayload *payload = StorageBatch;
+    houselog_storage_append (payload, logtype, data, length);
+
+    if (StorageBatchDelay == 0 || payload->length >= StorageBatchLimit)
+        houselog_storage_dispatch_batch ();
+
+    return 1; // Pending.
 }
 
 void houselog_storage_background (time_t now) {
+
+    houselog_storage_spill_owned ();
     housediscover (now);
-}
 
+    if (StorageBatch && now >= StorageBatchTime + StorageBatchDelay)
+        houselog_storage_dispatch_batch ();
+
+    if (StorageSpill && StorageSpill->count > 0) {
+        int providers;
+        housediscover_providers ("history", &providers);
+        if (providers) houselog_storage_replay ();
+    }
+
+    if (now >= StorageSpillSaved + 3600) {
+        if (StorageSpillSaved) houselog_storage_spill_backup ();
+        StorageSpillSaved = now;
+    }
+}
@@ -21,6 +21,9 @@
  * houselog_storage.h - A module for sending logs to historical services.
  */
 
+void houselog_storage_initialize (const char *name,
+                                  int argc, const char **argv);
 int houselog_storage_flush (const char *logtype, const char *data);
+int houselog_storage_status (char *buffer, int size);
 void houselog_storage_background (time_t now);
 
@@ -45,6 +45,7 @@ static void hp_help (const char *argv0) {
 
     printf ("\nGeneral options:\n");
     printf ("   -h:              print this help.\n");
+    printf ("   -workers=N:      serve HTTP requests from N processes.\n");
 
     printf ("\nHTTP options:\n");
     help = echttp_help(i);
@@ -55,45 +56,53 @@ static void hp_help (const char *argv0) {
     exit (0);
 }
 
+// Respond with 304 Not Modified if the client already has the current data.
+//
+static int hp_portal_unchanged (void) {
+
+    const char *etag = hp_redirect_etag ();
+    const char *known = echttp_attribute_get ("If-None-Match");
+
+    echttp_attribute_set ("ETag", etag);
+    if (known && !strcmp (known, etag)) {
+        echttp_error (304, "Not Modified");
+        return 1;
+    }
+    return 0;
+}
+
 static const char *hp_portal_list (const char *method, const char *uri,
                                    const char *data, int length) {
-    static char buffer[8192];
 
-    buffer[0] = 0;
-    hp_redirect_list_json (0, buffer, sizeof(buffer));
+    if (hp_portal_unchanged ()) return "";
     echttp_content_type_json ();
-    return buffer;
+    return hp_redirect_list_json (0);
 }
 
 static const char *hp_portal_peers (const char *method, const char *uri,
                                     const char *data, int length) {
-    static char buffer[8192];
 
-    buffer[0] = 0;
-    hp_redirect_peers_json (buffer, sizeof(buffer));
+    if (hp_portal_unchanged ()) return "";
     echttp_content_type_json ();
-    return buffer;
+    return hp_redirect_peers_json ();
 }
 
 static const char *hp_portal_service (const char *method, const char *uri,
                                       const char *data, int length) {
-    static char buffer[8192];
 
     const char *name = echttp_parameter_get ("name");
 
-    buffer[0] = 0;
-    if (name)
-        hp_redirect_service_json (name, buffer, sizeof(buffer));
-    else
-        hp_redirect_list_json (1, buffer, sizeof(buffer));
+    if (hp_portal_unchanged ()) return "";
     echttp_content_type_json ();
-    return buffer;
+    if (name) return hp_redirect_service_json (name);
+    return hp_redirect_list_json (1);
 }
 
 static void hp_background (int fd, int mode) {
     time_t now = time(0);
     houselog_background (now);
     hp_redirect_background();
+    hp_worker_background (now);
 }
 
 static void hp_portal_protect (const char *method, const char *uri) {
@@ -126,9 +135,12 @@ int main (int argc, const char **argv) {
     echttp_route_uri ("/portal/service", hp_portal_service);
     echttp_static_route ("/", "/usr/local/share/house/public");
     hp_redirect_start (argc, argv);
+    int worker = hp_worker_start (argc, argv);
     echttp_background (&hp_background);
-    houselog_event ("SERVICE", "portal", "STARTED", "");
-    houselog_trace (HOUSE_INFO, "portal", "Started");
+    if (!worker) {
+        houselog_event ("SERVICE", "portal", "STARTED", "");
+        houselog_trace (HOUSE_INFO, "portal", "Started");
+    }
     echttp_loop();
 }
 
@@ -31,15 +31,30 @@
 #define DEBUG if (echttp_isdebug())
 
 void hp_redirect_start (int argc, const char **argv);
-void hp_redirect_list_json (int services, char *buffer, int size);
-void hp_redirect_peers_json (char *buffer, int size);
-void hp_redirect_service_json (const char *service, char *buffer, int size);
+const char *hp_redirect_list_json (int services);
+const char *hp_redirect_peers_json (void);
+const char *hp_redirect_service_json (const char *service);
+const char *hp_redirect_etag (void);
 void hp_redirect_background (void);
+void hp_redirect_share (void);
+void hp_redirect_worker (void);
+
+int  hp_worker_start (int argc, const char **argv);
+void hp_worker_background (time_t now);
 
 int  hp_udp_server (const char *service, int local, int *sockets, int size);
 int  hp_udp_receive (int socket, char *buffer, int size);
+typedef void hp_udp_consumer (char *data, int length);
+void hp_udp_batch (int size);
+int  hp_udp_receive_batch (int socket, hp_udp_consumer *consumer);
+void hp_udp_statistics (long *received, long *dropped, int *depth);
+int  hp_udp_subscribe (time_t expiration);
+void hp_udp_notify (const char *data, int length, time_t now);
 int  hp_udp_has_broadcast (void);;
 void hp_udp_response (const char *data, int length);
+int  hp_udp_source (void *address, int size);
+void hp_udp_sendto (const void *address, int length,
+                    const char *data, int size);
 void hp_udp_broadcast (const char *data, int length);
 void hp_udp_unicast (const char *destination, const char *data, int length);
 
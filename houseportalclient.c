@@ -50,7 +50,10 @@
  *
  * void houseportal_renew (void);
  *
- *    Renew the previous redirections.
+ *    Renew the previous redirections. The full registration messages are
+ *    sent on the first renewal after a registration, when the portal asks
+ *    for them, and every 5 minutes (for older portals). Otherwise one
+ *    compact message lists the identifiers of the registrations to renew.
  */
 
 #include <unistd.h>
@@ -76,9 +79,19 @@ static char *HousePortalRegistration[256];
 static int   HousePortalRegistrationLength[256];
 static int   HousePortalRegistrationCount = 0;
 
-static char HousePortalTemporaryBuffer[256]; // Don't make the name obvious.
-static char HousePortalSecondaryBuffer[256]; // Don't make the name obvious.
-static int  HousePortalTemporaryLength;
+// The compact renewal message refers to each registration by an identifier
+// derived from its content, and carries a sequence number:
+//    RENEW time sequence id .. [SHA-256 signature]
+//
+static unsigned int HousePortalRegistrationId[256];
+static long   HousePortalSequence = 0;
+static time_t HousePortalFullRenewal = 0;
+
+#define HOUSEPORTAL_FULL_INTERVAL 300
+#define HOUSEPORTAL_RENEW_IDS 20
+
+static char HousePortalCypher[32];
+static int  HousePortalKey = -1;
 
 static const char *HousePortalHost = 0;
 static const char *HousePortalPort = "70";
@@ -91,6 +104,26 @@ typedef struct {
 static PortMapping HousePortalPortMap[256];
 static int         HousePortalPortMapCount = 0;
 
+// The portal asks for the full registration when it does not recognize
+// a compact renewal, for example after it restarted.
+//
+static void houseportal_listen (int fd, int mode) {
+
+    static time_t LastResend = 0;
+
+    char buffer[1500];
+    time_t now = time(0);
+
+    if (hp_udp_client_receive (fd, buffer, sizeof(buffer)) <= 0) return;
+    if (strncmp (buffer, "RESEND ", 7)) return;
+
+    if (now < LastResend + 5) return; // Do not flood the portal.
+    LastResend = now;
+
+    HousePortalFullRenewal = 0;
+    houseportal_renew ();
+}
+
 void houseportal_initialize (int argc, const char **argv) {
 
     int i;
@@ -133,6 +166,13 @@ void houseportal_initialize (int argc, const char **argv) {
                  HousePortalHost, HousePortalPort);
         exit(1);
     }
+
+    int sockets[4];
+    int count = hp_udp_client_sockets (sockets, 4);
+    for (i = 0; i < count; ++i) {
+        echttp_listen (sockets[i], 1, houseportal_listen, 0);
+    }
+    HousePortalSequence = (long)time(0); // Keep it monotonic across restarts.
 }
 
 const char *houseportal_server (void) {
@@ -140,13 +180,18 @@ const char *houseportal_server (void) {
 }
 
 void houseportal_signature (const char *cypher, const char *key) {
-    strncpy (HousePortalSecondaryBuffer,
-             cypher, sizeof(HousePortalSecondaryBuffer));
-    HousePortalSecondaryBuffer[128] = 0;
-    strncpy (HousePortalTemporaryBuffer,
-             key, sizeof(HousePortalTemporaryBuffer));
-    HousePortalTemporaryBuffer[128] = 0;
-    HousePortalTemporaryLength = strlen(key) / 16; // Key must be long enough
+
+    // The key is decoded only once, and then its context is reused
+    // every time a registration is signed.
+    //
+    houseportalhmac_release (HousePortalKey);
+    HousePortalKey = -1;
+
+    if (strlen(key) < 16) return; // Key must be long enough.
+
+    strncpy (HousePortalCypher, cypher, sizeof(HousePortalCypher));
+    HousePortalCypher[sizeof(HousePortalCypher)-1] = 0;
+    HousePortalKey = houseportalhmac_key (HousePortalCypher, key);
 }
 
 void houseportal_register (int webport, const char **path, int count) {
@@ -159,6 +204,21 @@ void houseportal_register (int webport, const char **path, int count) {
 }
 
 
+// This must match the identifier calculated by the portal (see
+// hp_redirect.c).
+//
+static unsigned int houseportal_registration_id (const char *body,
+                                                 int length) {
+    int i;
+    unsigned int id = 2166136261u; // FNV-1a.
+
+    for (i = 0; i < length; ++i) {
+        id ^= (unsigned char)(body[i]);
+        id *= 16777619u;
+    }
+    return id;
+}
+
 void houseportal_register_more (int webport, const char **path, int count) {
 
     int i;
@@ -222,19 +282,48 @@ void houseportal_register_more (int webport, const char **path, int count) {
     }
     HousePortalRegistrationLength[index] =
         (int) (cursor - HousePortalRegistration[index]);
+
+    for (i = HousePortalRegistrationCount; i <= index; ++i) {
+        HousePortalRegistrationId[i] =
+            houseportal_registration_id (HousePortalRegistration[i],
+                                         HousePortalRegistrationLength[i]);
+    }
     HousePortalRegistrationCount = index+1;
 
+    HousePortalFullRenewal = 0; // Send the new registration in full.
     houseportal_renew();
 }
 
-void houseportal_renew (void) {
+// The key identifier is only sent in messages that older portals do not
+// know anyway (RENEW): an older portal would take it as part of the
+// signature of a REDIRECT message, and reject the registration.
+//
+static int houseportal_sign (char *buffer, int length, int size,
+                             int identify) {
+
+    if (HousePortalKey >= 0) {
+        const char *signature = houseportalhmac_sign (HousePortalKey, buffer);
+        if (signature) {
+            if (identify)
+                length += snprintf (buffer+length, size-length,
+                                    " %s %s %s", HousePortalCypher, signature,
+                                    houseportalhmac_id (HousePortalKey));
+            else
+                length += snprintf (buffer+length, size-length,
+                                    " %s %s", HousePortalCypher, signature);
+        }
+    }
+    return length;
+}
+
+static void houseportal_renew_full (time_t now) {
 
     int i;
     int blen;
     int total;
     char buffer[HOUSEPORTALPACKET+256]; // Added space for signature.
 
-    snprintf (buffer, sizeof(buffer), "REDIRECT %ld ", (long)time(0));
+    snprintf (buffer, sizeof(buffer), "REDIRECT %ld ", (long)now);
     blen = strlen(buffer);
 
     for (i = 0; i < HousePortalRegistrationCount; ++i) {
@@ -245,20 +334,41 @@ void houseportal_renew (void) {
         total = blen+HousePortalRegistrationLength[i];
         buffer[total] = 0; // Needed for HMAC.
 
-        if (HousePortalTemporaryLength) {
-            const char *signature =
-                houseportalhmac (HousePortalSecondaryBuffer,
-                                 HousePortalTemporaryBuffer, buffer);
-            if (signature) {
-                const char cypher[] = " SHA-256 ";
-                int cypherlen = sizeof(cypher)-1;
-                int signlen = strlen(signature);
-                memcpy (buffer+total, " SHA-256 ", cypherlen);
-                memcpy (buffer+total+cypherlen, signature, signlen);
-                total += (cypherlen + signlen);
-            }
+        total = houseportal_sign (buffer, total, sizeof(buffer), 0);
+        hp_udp_send (buffer, total);
+    }
+}
+
+static void houseportal_renew_compact (time_t now) {
+
+    int i = 0;
+    char buffer[512];
+
+    HousePortalSequence += 1;
+
+    while (i < HousePortalRegistrationCount) {
+        int n;
+        int total = snprintf (buffer, sizeof(buffer), "RENEW %ld %ld",
+                              (long)now, HousePortalSequence);
+
+        for (n = 0; n < HOUSEPORTAL_RENEW_IDS &&
+                    i < HousePortalRegistrationCount; ++n, ++i) {
+            total += snprintf (buffer+total, sizeof(buffer)-total,
+                               " %08x", HousePortalRegistrationId[i]);
         }
+        total = houseportal_sign (buffer, total, sizeof(buffer), 1);
         hp_udp_send (buffer, total);
     }
 }
 
+void houseportal_renew (void) {
+
+    time_t now = time(0);
+
+    if (now >= HousePortalFullRenewal + HOUSEPORTAL_FULL_INTERVAL) {
+        houseportal_renew_full (now);
+        HousePortalFullRenewal = now;
+    } else {
+        houseportal_renew_compact (now);
+    }
+}
@@ -31,4 +31,6 @@ const char *houseportal_server (void);
 
 int  hp_udp_client (const char *destination, const char *service);
 void hp_udp_send   (const char *data, int length);
+int  hp_udp_client_sockets (int *sockets, int size);
+int  hp_udp_client_receive (int socket, char *buffer, int size);
 
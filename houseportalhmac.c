@@ -24,10 +24,41 @@
  *
  * SYNOPSYS:
  *
+ * int houseportalhmac_key (const char *cypher, const char *hexkey);
+ *
+ *    Decode the key once and prepare a signature context for it, which
+ *    is then reused for every message signed with this key. Returns a key
+ *    handle, or -1 if the cypher is not supported.
+ *
+ * void houseportalhmac_release (int key);
+ *
+ *    Free the context associated with this key handle.
+ *
+ * const char *houseportalhmac_sign (int key, const char *data);
+ *
+ *    Return a signature as a hex string (static), or null if error.
+ *
+ * const char *houseportalhmac_id (int key);
+ *
+ *    Return the identifier of the key as a hex string. The identifier is
+ *    derived from the key, but does not reveal it. It is included in
+ *    messages so that the receiver does not have to try all its keys.
+ *
+ * int houseportalhmac_find (const char *cypher, const char *id);
+ *
+ *    Return the handle of the key that matches the identifier and cypher,
+ *    or -1 if none was found.
+ *
+ * int houseportalhmac_match (int key, const char *cypher);
+ *
+ *    Return true if the key is a valid handle for the specified cypher.
+ *
  * const char *houseportalhmac (const char *cypher,
  *                              const char *hexkey, const char *data);
  *
  *    Return a signature as a hex string (static), or null if error.
+ *    This is the one shot variant: the key context is created on the
+ *    first call and reused on subsequent calls with the same key.
  *
  * LIMITATIONS:
  *
@@ -35,13 +66,37 @@
  */
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 
 #include "houseportalhmac.h"
 
+typedef struct {
+    int used;
+    char cypher[16];
+    char id[9];
+    char *hexkey; // Only kept to find the key for houseportalhmac().
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC_CTX *context;
+#else
+    HMAC_CTX *context;
+#endif
+} HmacKey;
+
+static HmacKey *HmacKeys = 0;
+static int HmacKeysCount = 0;
+static int HmacKeysSize = 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static EVP_MAC *HmacAlgorithm = 0;
+#endif
+
 static char bin2hex (int value) {
     static const char bin2heximage[] = "0123456789abcdef";
     return bin2heximage[value&0x0f];
@@ -67,37 +122,167 @@ static int hmac_hex2bin (const char *hex, unsigned char *bin, int size) {
     length = length & (~1); // Force even length by truncating.
     if (length > 2 * size) length = 2 * size;
 
-    for (i = 0; i <= length; i += 2) {
+    for (i = 0; i < length; i += 2) {
         bin[i/2] = (char)(hex2bin(hex[i+1]) + 16 * hex2bin(hex[i]));
     }
     return length / 2;
 }
 
-const char *houseportalhmac (const char *cypher,
-                             const char *hexkey, const char *data) {
+static void hmac_bin2hex (const unsigned char *bin, int size, char *hex) {
+
+    int i;
+    for (i = 0; i < size; ++i) {
+        hex[2*i] = bin2hex(bin[i]>>4);
+        hex[2*i+1] = bin2hex(bin[i]);
+    }
+    hex[2*size] = 0;
+}
+
+static int houseportalhmac_valid (int key) {
+    return (key >= 0 && key < HmacKeysCount && HmacKeys[key].used);
+}
+
+int houseportalhmac_key (const char *cypher, const char *hexkey) {
+
+    int i;
+    unsigned char key[64];
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestlen = EVP_MAX_MD_SIZE;
+
+    if (strcmp(cypher, "SHA-256")) return -1;
+
+    int keylen = hmac_hex2bin (hexkey, key, sizeof(key));
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (!HmacAlgorithm) {
+        HmacAlgorithm = EVP_MAC_fetch (0, "HMAC", 0);
+        if (!HmacAlgorithm) return -1;
+    }
+    OSSL_PARAM parameters[2];
+    parameters[0] =
+        OSSL_PARAM_construct_utf8_string (OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    parameters[1] = OSSL_PARAM_construct_end();
+
+    EVP_MAC_CTX *context = EVP_MAC_CTX_new (HmacAlgorithm);
+    if (!context) return -1;
+    if (!EVP_MAC_init (context, key, keylen, parameters)) {
+        EVP_MAC_CTX_free (context);
+        return -1;
+    }
+#else
+    HMAC_CTX *context = HMAC_CTX_new ();
+    if (!context) return -1;
+    if (!HMAC_Init_ex (context, key, keylen, EVP_sha256(), 0)) {
+        HMAC_CTX_free (context);
+        return -1;
+    }
+#endif
 
-    if (strcmp(cypher, "SHA-256") == 0) {
-
-        unsigned char key[64];
-        unsigned char output[EVP_MAX_MD_SIZE];
-        unsigned int outlen = EVP_MAX_MD_SIZE;
-        int keylen = hmac_hex2bin (hexkey, key, sizeof(key));
-
-        unsigned char *result =
-            HMAC(EVP_sha256(), key, keylen, (unsigned char *)data, strlen(data), output, &outlen);
-        if (result) {
-            static char signature[9];
-            int i;
-            if (outlen > 4) outlen = 4;
-            for (i = 0; i < outlen; ++i) {
-                signature[2*i] = bin2hex(output[i]>>4);
-                signature[2*i+1] = bin2hex(output[i]);
-            }
-            signature[8] = 0;
-            return signature;
+    // Reuse a released slot, if any.
+    for (i = 0; i < HmacKeysCount; ++i) {
+        if (!HmacKeys[i].used) break;
+    }
+    if (i >= HmacKeysCount) {
+        if (HmacKeysCount >= HmacKeysSize) {
+            HmacKeysSize = HmacKeysCount + 4;
+            HmacKeys = realloc (HmacKeys, HmacKeysSize*sizeof(HmacKey));
         }
+        i = HmacKeysCount++;
+    }
+    HmacKeys[i].used = 1;
+    HmacKeys[i].context = context;
+    HmacKeys[i].hexkey = strdup(hexkey);
+    strncpy (HmacKeys[i].cypher, cypher, sizeof(HmacKeys[i].cypher));
+    HmacKeys[i].cypher[sizeof(HmacKeys[i].cypher)-1] = 0;
+
+    // The key identifier is the beginning of the key's own digest.
+    //
+    if (!EVP_Digest (key, keylen, digest, &digestlen, EVP_sha256(), 0)) {
+        digestlen = 0;
+    }
+    if (digestlen > 4) digestlen = 4;
+    hmac_bin2hex (digest, digestlen, HmacKeys[i].id);
+
+    return i;
+}
+
+void houseportalhmac_release (int key) {
+
+    if (!houseportalhmac_valid (key)) return;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC_CTX_free (HmacKeys[key].context);
+#else
+    HMAC_CTX_free (HmacKeys[key].context);
+#endif
+    free (HmacKeys[key].hexkey);
+    HmacKeys[key].context = 0;
+    HmacKeys[key].hexkey = 0;
+    HmacKeys[key].used = 0;
+}
+
+const char *houseportalhmac_sign (int key, const char *data) {
+
+    static char signature[9];
+    unsigned char output[EVP_MAX_MD_SIZE];
+
+    if (!houseportalhmac_valid (key)) return 0;
+
+    // Reinitializing the context with no key reuses the key that was
+    // decoded and set when the context was created.
+    //
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    size_t outlen = 0;
+    EVP_MAC_CTX *context = HmacKeys[key].context;
+    if (!EVP_MAC_init (context, 0, 0, 0)) return 0;
+    if (!EVP_MAC_update (context, (const unsigned char *)data, strlen(data)))
         return 0;
+    if (!EVP_MAC_final (context, output, &outlen, sizeof(output))) return 0;
+#else
+    unsigned int outlen = 0;
+    HMAC_CTX *context = HmacKeys[key].context;
+    if (!HMAC_Init_ex (context, 0, 0, 0, 0)) return 0;
+    if (!HMAC_Update (context, (const unsigned char *)data, strlen(data)))
+        return 0;
+    if (!HMAC_Final (context, output, &outlen)) return 0;
+#endif
+
+    if (outlen > 4) outlen = 4;
+    hmac_bin2hex (output, outlen, signature);
+    return signature;
+}
+
+const char *houseportalhmac_id (int key) {
+    if (!houseportalhmac_valid (key)) return 0;
+    return HmacKeys[key].id;
+}
+
+int houseportalhmac_match (int key, const char *cypher) {
+    if (!houseportalhmac_valid (key)) return 0;
+    return strcmp (HmacKeys[key].cypher, cypher) == 0;
+}
+
+int houseportalhmac_find (const char *cypher, const char *id) {
+
+    int i;
+    for (i = 0; i < HmacKeysCount; ++i) {
+        if (!HmacKeys[i].used) continue;
+        if (strcmp (HmacKeys[i].id, id)) continue;
+        if (strcmp (HmacKeys[i].cypher, cypher)) continue;
+        return i;
     }
-    return 0;
+    return -1;
 }
 
+const char *houseportalhmac (const char *cypher,
+                             const char *hexkey, const char *data) {
+
+    int i;
+    for (i = 0; i < HmacKeysCount; ++i) {
+        if (!HmacKeys[i].used) continue;
+        if (strcmp (HmacKeys[i].hexkey, hexkey)) continue;
+        if (strcmp (HmacKeys[i].cypher, cypher)) continue;
+        return houseportalhmac_sign (i, data);
+    }
+    return houseportalhmac_sign (houseportalhmac_key (cypher, hexkey), data);
+}
@@ -21,6 +21,15 @@
  * houseportalhmac.c - The houseportal program's client API for crypto.
  */
 
+int  houseportalhmac_key     (const char *cypher, const char *hexkey);
+void houseportalhmac_release (int key);
+
+const char *houseportalhmac_sign (int key, const char *data);
+const char *houseportalhmac_id   (int key);
+
+int houseportalhmac_find  (const char *cypher, const char *id);
+int houseportalhmac_match (int key, const char *cypher);
+
 const char *houseportalhmac (const char *cypher,
                              const char *hexkey, const char *data);
 
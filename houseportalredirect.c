@@ -0,0 +1,205 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houseportalredirect.c - A cache of the portal redirections.
+ *
+ * The URL of a service, as returned by the discovery, points to the portal
+ * of the machine where the service runs. Each request to that URL is
+ * redirected by the portal to the actual service, which costs a connection
+ * and a round trip to the portal. This module remembers where the portal
+ * redirected to, so that the next requests go straight to the service.
+ *
+ * SYNOPSYS:
+ *
+ * const char *houseportalredirect_client (const char *method,
+ *                                         const char *provider,
+ *                                         const char *url);
+ *
+ *    Same as echttp_client(), except that the URL is translated using
+ *    the cached redirection for this provider, if any. The provider is
+ *    the service URL returned by the discovery, and the URL must start
+ *    with it. If the cached target cannot be reached, the redirection is
+ *    forgotten and the original URL is used.
+ *
+ * int houseportalredirect_redirected (const char *method,
+ *                                     const char *provider);
+ *
+ *    Same as echttp_redirected(), except that the redirection is cached
+ *    for this provider. The cached redirection is kept for as long as
+ *    the portal allows (X-Portal-Lifetime, which reflects the route's
+ *    expiration), or else as long as Cache-Control allows, or else for
+ *    30 seconds. The portal sends its redirections with "no-cache", so
+ *    that browsers do not cache them. A cached redirection is forgotten
+ *    if the target service does not answer, or answers with a 5xx status.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "echttp.h"
+
+#include "houseportalredirect.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define REDIRECT_CACHE_DEFAULT 30
+#define REDIRECT_CACHE_MAX 600
+
+typedef struct {
+    char *provider;
+    char *target;
+    time_t expiration;
+} CachedRedirect;
+
+static CachedRedirect *CachedRedirects = 0;
+static int CachedRedirectsCount = 0;
+static int CachedRedirectsSize = 0;
+
+static CachedRedirect *houseportalredirect_search (const char *provider) {
+    int i;
+    for (i = 0; i < CachedRedirectsCount; ++i) {
+        if (!strcmp (CachedRedirects[i].provider, provider))
+            return CachedRedirects + i;
+    }
+    return 0;
+}
+
+static CachedRedirect *houseportalredirect_add (const char *provider) {
+
+    CachedRedirect *entry = houseportalredirect_search (provider);
+    if (entry) return entry;
+
+    if (CachedRedirectsCount >= CachedRedirectsSize) {
+        CachedRedirectsSize = CachedRedirectsCount + 16;
+        CachedRedirects = realloc (CachedRedirects,
+                                   CachedRedirectsSize*sizeof(CachedRedirect));
+    }
+    entry = CachedRedirects + CachedRedirectsCount++;
+    entry->provider = strdup (provider);
+    entry->target = 0;
+    entry->expiration = 0;
+    return entry;
+}
+
+static const char *houseportalredirect_path (const char *url) {
+    const char *host = strstr (url, "://");
+    host = host ? host + 3 : url;
+    const char *path = strchr (host, '/');
+    return path ? path : host + strlen(host);
+}
+
+// The portal either keeps the path of the original URL (the provider's
+// path is found at the beginning of the location's path), or else removes
+// the provider's path (hidden route). Either way, the provider's part
+// of the URL maps to the beginning of the location.
+//
+static void houseportalredirect_learn (const char *provider,
+                                       const char *location, int maxage) {
+
+    const char *ppath = houseportalredirect_path (provider);
+    const char *lpath = houseportalredirect_path (location);
+    int plength = strlen(ppath);
+    int hostlength = lpath - location;
+    int tlength = hostlength;
+
+    if (!strncmp (lpath, ppath, plength)) {
+        char next = lpath[plength];
+        if (next == 0 || next == '/' || next == '?')
+            tlength += plength;
+    }
+
+    CachedRedirect *entry = houseportalredirect_add (provider);
+    if (entry->target) free (entry->target);
+    entry->target = malloc (tlength + 1);
+    memcpy (entry->target, location, tlength);
+    entry->target[tlength] = 0;
+    entry->expiration = time(0) + maxage;
+    DEBUG ("redirect %s cached as %s for %d seconds\n",
+           provider, entry->target, maxage);
+}
+
+static int houseportalredirect_maxage (const char *lifetime,
+                                       const char *control) {
+
+    if (lifetime) {
+        int value = atoi (lifetime);
+        if (value < 0) return 0;
+        if (value > REDIRECT_CACHE_MAX) return REDIRECT_CACHE_MAX;
+        return value;
+    }
+    if (!control) return REDIRECT_CACHE_DEFAULT;
+    if (strstr (control, "no-store")) return 0;
+    const char *maxage = strstr (control, "max-age=");
+    if (!maxage) return REDIRECT_CACHE_DEFAULT;
+    int value = atoi (maxage + 8);
+    if (value < 0) return 0;
+    if (value > REDIRECT_CACHE_MAX) return REDIRECT_CACHE_MAX;
+    return value;
+}
+
+const char *houseportalredirect_client (const char *method,
+                                        const char *provider,
+                                        const char *url) {
+
+    CachedRedirect *entry = houseportalredirect_search (provider);
+
+    if (entry && entry->target && time(0) < entry->expiration) {
+        int plength = strlen(provider);
+        if (!strncmp (url, provider, plength)) {
+            char translated[2048];
+            snprintf (translated, sizeof(translated),
+                      "%s%s", entry->target, url + plength);
+            const char *error = echttp_client (method, translated);
+            if (!error) return 0;
+            DEBUG ("cannot access %s: %s\n", translated, error);
+            entry->expiration = 0;
+        }
+    }
+    return echttp_client (method, url);
+}
+
+int houseportalredirect_redirected (const char *method,
+                                    const char *provider) {
+
+    char location[1024];
+    const char *value = echttp_attribute_get ("Location");
+    if (value) {
+        snprintf (location, sizeof(location), "%s", value);
+    } else {
+        location[0] = 0;
+    }
+    int maxage =
+        houseportalredirect_maxage (echttp_attribute_get ("X-Portal-Lifetime"),
+                                    echttp_attribute_get ("Cache-Control"));
+
+    int status = echttp_redirected (method);
+    if (!status) {
+        if (location[0] && maxage > 0)
+            houseportalredirect_learn (provider, location, maxage);
+        return 0;
+    }
+    if (status <= 0 || status >= 500) {
+        CachedRedirect *entry = houseportalredirect_search (provider);
+        if (entry) entry->expiration = 0;
+    }
+    return status;
+}
@@ -0,0 +1,228 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houseportalregistry.c - Read the portal's registry from shared memory.
+ *
+ * The portal publishes its routes and peers in a file in /dev/shm, so that
+ * the clients running on the same host can read them without sending any
+ * HTTP request. The portal is the only writer: the table is protected by
+ * a sequence lock, and the clients map it read-only.
+ *
+ * SYNOPSYS:
+ *
+ * const char *houseportalregistry_path (const char *port);
+ *
+ *    Return the name of the registry file for the portal that listens
+ *    on the specified UDP port. The name is stored in a static buffer.
+ *
+ * const houseportalregistry *houseportalregistry_attach (const char *port,
+ *                                                        time_t now);
+ *
+ *    Return the registry of the local portal, or null if there is no
+ *    valid registry: no portal, an incompatible format, or a portal that
+ *    did not update it for 30 seconds (presumed dead). The registry file
+ *    is checked again every 10 seconds, in case the portal created a new
+ *    one. Never write to the registry.
+ *
+ *    The registry is ignored unless it is a regular file (not a symbolic
+ *    link) owned by root or by the user running this client: any other
+ *    local user could otherwise create a fake registry while the portal
+ *    is down, and redirect the clients' traffic, or truncate it later.
+ *
+ * int houseportalregistry_copy (const houseportalregistry *table,
+ *                               houseportalregistry **copy,
+ *                               uint32_t *imported);
+ *
+ *    Copy the registry if it changed since the sequence number in imported,
+ *    and only if the copy is consistent. Return true if a new copy was
+ *    made, in which case imported is updated. The copy is allocated, or
+ *    reallocated, to fit the registry's current content. This never waits
+ *    for the portal: if the registry was being modified, the copy is
+ *    attempted again on the next call.
+ *
+ * uint32_t houseportalregistry_used (const houseportalregistry *table);
+ *
+ *    Return the number of bytes used by the registry's current content.
+ *
+ * const houseportalregistry_route *houseportalregistry_routes
+ *                                     (const houseportalregistry *table);
+ * const houseportalregistry_peer *houseportalregistry_peers
+ *                                     (const houseportalregistry *table);
+ * const char *houseportalregistry_string (const houseportalregistry *table,
+ *                                         uint32_t offset);
+ *
+ *    Access the route array, the peer array and the strings of a registry.
+ *    These are meant to be used on a copy: an invalid string offset
+ *    returns an empty string.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "houseportalregistry.h"
+
+#define REGISTRY_ALIVE 30
+#define REGISTRY_CHECK 10
+
+static const houseportalregistry *RegistryMapped = 0;
+static ino_t  RegistryInode = 0;
+static time_t RegistryChecked = 0;
+
+const char *houseportalregistry_path (const char *port) {
+    static char path[256];
+    snprintf (path, sizeof(path), "/dev/shm/houseportal_%s.registry", port);
+    return path;
+}
+
+static void houseportalregistry_detach (void) {
+    if (!RegistryMapped) return;
+    munmap ((void *)RegistryMapped, HOUSEPORTALREGISTRY_MAX);
+    RegistryMapped = 0;
+    RegistryInode = 0;
+}
+
+static void houseportalregistry_map (const char *port) {
+
+    struct stat fileinfo;
+    const char *path = houseportalregistry_path (port);
+
+    if (lstat (path, &fileinfo)) {
+        houseportalregistry_detach ();
+        return;
+    }
+    if (RegistryMapped && fileinfo.st_ino == RegistryInode) return;
+    houseportalregistry_detach ();
+
+    // Only trust a file that was created by the portal, not by another
+    // local user. The checks apply to the file actually opened.
+    //
+    int fd = open (path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return;
+    if (fstat (fd, &fileinfo) ||
+        !S_ISREG(fileinfo.st_mode) ||
+        (fileinfo.st_uid != 0 && fileinfo.st_uid != geteuid()) ||
+        fileinfo.st_size < sizeof(houseportalregistry) ||
+        fileinfo.st_size > HOUSEPORTALREGISTRY_MAX) {
+        close (fd);
+        return;
+    }
+
+    // The whole maximum size is mapped, so that the table can grow
+    // without the need to map it again. Only the pages within the
+    // current size of the file are accessed.
+    //
+    void *map = mmap (0, HOUSEPORTALREGISTRY_MAX, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) return;
+
+    const houseportalregistry *table = (const houseportalregistry *)map;
+    if (table->magic != HOUSEPORTALREGISTRY_MAGIC ||
+        table->size > fileinfo.st_size) {
+        munmap (map, HOUSEPORTALREGISTRY_MAX);
+        return;
+    }
+    RegistryMapped = table;
+    RegistryInode = fileinfo.st_ino;
+}
+
+const houseportalregistry *houseportalregistry_attach (const char *port,
+                                                       time_t now) {
+
+    if (now >= RegistryChecked + REGISTRY_CHECK) {
+        houseportalregistry_map (port);
+        RegistryChecked = now;
+    }
+    if (!RegistryMapped) return 0;
+    if (RegistryMapped->alive + REGISTRY_ALIVE < now) return 0;
+    return RegistryMapped;
+}
+
+uint32_t houseportalregistry_used (const houseportalregistry *table) {
+    return sizeof(houseportalregistry)
+           + table->routes * sizeof(houseportalregistry_route)
+           + table->peers * sizeof(houseportalregistry_peer)
+           + table->strings;
+}
+
+int houseportalregistry_copy (const houseportalregistry *table,
+                              houseportalregistry **copy, uint32_t *imported) {
+
+    uint32_t sequence = table->sequence;
+    if (sequence == *imported) return 0;
+    if (sequence & 1) return 0; // Being written.
+    __sync_synchronize ();
+
+    // The counts may change while being read: the sequence check below
+    // detects it. Until then, only make sure that they fit in the table.
+    //
+    int routes = table->routes;
+    int peers = table->peers;
+    uint32_t strings = table->strings;
+    uint32_t size = table->size;
+    if (routes < 0 || routes > HOUSEPORTALREGISTRY_MAX) return 0;
+    if (peers < 0 || peers > HOUSEPORTALREGISTRY_MAX) return 0;
+    if (strings > HOUSEPORTALREGISTRY_MAX) return 0;
+    uint64_t used = sizeof(houseportalregistry)
+                    + (uint64_t)routes * sizeof(houseportalregistry_route)
+                    + (uint64_t)peers * sizeof(houseportalregistry_peer)
+                    + strings;
+    if (used > size || size > HOUSEPORTALREGISTRY_MAX) return 0;
+
+    houseportalregistry *buffer = realloc (*copy, used);
+    if (!buffer) return 0;
+    *copy = buffer;
+    memcpy (buffer, (const void *)table, used);
+
+    __sync_synchronize ();
+    if (table->sequence != sequence) return 0;
+
+    buffer->routes = routes;
+    buffer->peers = peers;
+    buffer->strings = strings;
+    buffer->size = used;
+    buffer->host[sizeof(buffer->host)-1] = 0;
+    if (strings > 0) ((char *)buffer)[used-1] = 0;
+    *imported = sequence;
+    return 1;
+}
+
+const houseportalregistry_route *houseportalregistry_routes
+                                    (const houseportalregistry *table) {
+    return (const houseportalregistry_route *)(table->data);
+}
+
+const houseportalregistry_peer *houseportalregistry_peers
+                                    (const houseportalregistry *table) {
+    return (const houseportalregistry_peer *)
+               (houseportalregistry_routes (table) + table->routes);
+}
+
+const char *houseportalregistry_string (const houseportalregistry *table,
+                                        uint32_t offset) {
+    if (offset >= table->strings) return "";
+    return (const char *)(houseportalregistry_peers (table) + table->peers)
+               + offset;
+}
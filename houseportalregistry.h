@@ -0,0 +1,79 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houseportalregistry.h - The portal's registry, shared with local clients.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#define HOUSEPORTALREGISTRY_MAGIC   0x48505232 // "HPR2"
+#define HOUSEPORTALREGISTRY_MAX     (16*1024*1024) // Size of the mapping.
+
+// The strings are stored as offsets in the table's string area: see
+// houseportalregistry_string().
+//
+typedef struct {
+    uint32_t path;
+    uint32_t service; // 0: no service.
+    uint32_t target;
+    int hide;
+    time_t expiration;
+} houseportalregistry_route;
+
+typedef struct {
+    uint32_t name;
+    time_t expiration;
+} houseportalregistry_peer;
+
+// The file grows when needed, but never beyond HOUSEPORTALREGISTRY_MAX:
+// the readers map that size, and access only the first size bytes.
+// The data is the route array, then the peer array, then the strings.
+//
+typedef struct {
+    uint32_t magic;
+    volatile uint32_t size;     // The current size of the file.
+    volatile uint32_t sequence; // Odd while the portal is writing.
+    volatile time_t alive;      // Updated by the portal every second.
+    long generation;
+    time_t started;             // When the portal started.
+    char host[128];
+    int routes;
+    int peers;
+    uint32_t strings;           // The size of the string area.
+    uint64_t data[];            // Aligned for the route and peer arrays.
+} houseportalregistry;
+
+const char *houseportalregistry_path (const char *port);
+
+const houseportalregistry *houseportalregistry_attach (const char *port,
+                                                       time_t now);
+
+int houseportalregistry_copy (const houseportalregistry *table,
+                              houseportalregistry **copy, uint32_t *imported);
+
+uint32_t houseportalregistry_used (const houseportalregistry *table);
+
+const houseportalregistry_route *houseportalregistry_routes
+                                    (const houseportalregistry *table);
+const houseportalregistry_peer *houseportalregistry_peers
+                                    (const houseportalregistry *table);
+const char *houseportalregistry_string (const houseportalregistry *table,
+                                        uint32_t offset);
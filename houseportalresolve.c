@@ -0,0 +1,185 @@
+/* houseport - A simple Web portal for home servers.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houseportalresolve.c - A cache of resolved UDP addresses.
+ *
+ * This module resolves names in the background, so that sending a UDP
+ * packet never waits for the name resolver. This is based on the glibc
+ * getaddrinfo_a() function.
+ *
+ * SYNOPSYS:
+ *
+ * const struct addrinfo *houseportalresolve (const char *name,
+ *                                            const char *service);
+ *
+ *    Return the cached list of UDP addresses for the specified name and
+ *    service, or null if the name was not (yet) resolved. This never
+ *    blocks: if there is no valid cache entry, an asynchronous resolution
+ *    is started and the previous result, if any, is returned until that
+ *    resolution completes. A successful resolution is kept for 5 minutes.
+ *    A failure is remembered for 30 seconds before the next attempt.
+ *    The result is only valid until the next call.
+ *
+ * int houseportalresolve_wait (const char *name,
+ *                              const char *service, int seconds);
+ *
+ *    Wait for the resolution of the specified name for, at most,
+ *    the specified time. Return true if this name was resolved. This is
+ *    meant to be used when initializing, before entering the event loop.
+ */
+
+#define _GNU_SOURCE // For getaddrinfo_a().
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "houseportalresolve.h"
+
+#define RESOLVE_TTL 300
+#define RESOLVE_NEGATIVE_TTL 30
+
+typedef struct {
+    char *name;
+    char *service;
+    struct addrinfo hints;
+    struct gaicb request;
+    struct addrinfo *result;
+    time_t expiration;
+    int pending;
+    int failed;
+} ResolvedName;
+
+// The entries are allocated individually because the resolver keeps
+// a pointer to the request while it is pending.
+//
+static ResolvedName **ResolvedNames = 0;
+static int ResolvedNamesCount = 0;
+static int ResolvedNamesSize = 0;
+
+static ResolvedName *houseportalresolve_search (const char *name,
+                                                const char *service) {
+    int i;
+
+    for (i = 0; i < ResolvedNamesCount; ++i) {
+        ResolvedName *entry = ResolvedNames[i];
+        if (strcmp (entry->name, name)) continue;
+        if (strcmp (entry->service, service)) continue;
+        return entry;
+    }
+
+    if (ResolvedNamesCount >= ResolvedNamesSize) {
+        ResolvedNamesSize = ResolvedNamesCount + 16;
+        ResolvedNames =
+            realloc (ResolvedNames, ResolvedNamesSize*sizeof(ResolvedName *));
+    }
+    ResolvedName *entry = calloc (1, sizeof(ResolvedName));
+    entry->name = strdup(name);
+    entry->service = strdup(service);
+    entry->hints.ai_flags = AI_ADDRCONFIG;
+    entry->hints.ai_family = AF_UNSPEC;
+    entry->hints.ai_socktype = SOCK_DGRAM;
+    ResolvedNames[ResolvedNamesCount++] = entry;
+    return entry;
+}
+
+static void houseportalresolve_failed (ResolvedName *entry,
+                                       time_t now, const char *reason) {
+    if (!entry->failed) {
+        fprintf (stderr, "cannot resolve %s:%s (%s)\n",
+                 entry->name, entry->service, reason);
+        entry->failed = 1;
+    }
+    entry->expiration = now + RESOLVE_NEGATIVE_TTL;
+}
+
+static void houseportalresolve_poll (ResolvedName *entry, time_t now) {
+
+    int status = gai_error (&(entry->request));
+
+    if (status == EAI_INPROGRESS) return;
+
+    entry->pending = 0;
+    if (status) {
+        // Keep the previous result, if any: it is better than nothing.
+        houseportalresolve_failed (entry, now, gai_strerror(status));
+        return;
+    }
+    if (entry->result) freeaddrinfo (entry->result);
+    entry->result = entry->request.ar_result;
+    entry->request.ar_result = 0;
+    entry->expiration = now + RESOLVE_TTL;
+    entry->failed = 0;
+}
+
+static void houseportalresolve_start (ResolvedName *entry, time_t now) {
+
+    struct gaicb *list[1];
+
+    entry->request.ar_name = entry->name;
+    entry->request.ar_service = entry->service;
+    entry->request.ar_request = &(entry->hints);
+    entry->request.ar_result = 0;
+    list[0] = &(entry->request);
+
+    int status = getaddrinfo_a (GAI_NOWAIT, list, 1, 0);
+    if (status) {
+        houseportalresolve_failed (entry, now, gai_strerror(status));
+        return;
+    }
+    entry->pending = 1;
+}
+
+static ResolvedName *houseportalresolve_refresh (const char *name,
+                                                 const char *service) {
+
+    time_t now = time(0);
+    ResolvedName *entry = houseportalresolve_search (name, service);
+
+    if (entry->pending) houseportalresolve_poll (entry, now);
+    if (!entry->pending && now >= entry->expiration)
+        houseportalresolve_start (entry, now);
+    return entry;
+}
+
+const struct addrinfo *houseportalresolve (const char *name,
+                                           const char *service) {
+    return houseportalresolve_refresh (name, service)->result;
+}
+
+int houseportalresolve_wait (const char *name,
+                             const char *service, int seconds) {
+
+    ResolvedName *entry = houseportalresolve_refresh (name, service);
+
+    if (entry->pending) {
+        const struct gaicb *list[1];
+        struct timespec timeout = {seconds, 0};
+
+        list[0] = &(entry->request);
+        gai_suspend (list, 1, &timeout);
+        houseportalresolve_poll (entry, time(0));
+    }
+    return entry->result != 0;
+}
@@ -27,17 +27,28 @@
  * int hp_udp_client (const char *destination, const char *service);
  *
  *    Open UDP sockets for the specified destination and returns the count
- *    of sockets that was opened (0 indicates failure).
+ *    of sockets that was opened (0 indicates failure). The destination is
+ *    resolved in the background: this waits a few seconds at most for
+ *    the first resolution to complete.
  *
  * void hp_udp_send (const char *data, int length)
  *
- *    Send a data packet.
+ *    Send a data packet. This never waits for the name resolution: the
+ *    packet is not sent if the destination has not been resolved yet.
+ *
+ * int hp_udp_client_sockets (int *sockets, int size);
+ *
+ *    Return the list of sockets used to send packets, so that the caller
+ *    can listen for responses from the destination.
+ *
+ * int hp_udp_client_receive (int socket, char *buffer, int size);
+ *
+ *    Receive a response packet. Returns the length of the data, or -1.
+ *    The data is null terminated.
  *
  * LIMITATIONS:
  *
- * Only supports IPv4 addresses for the time being.
- * Only supports local broadcast (address 255.255.255.255).
- * Only supports one socket per process.
+ * Only supports one destination per process.
  */
 
 #include <errno.h>
@@ -53,81 +64,94 @@
 #include <arpa/inet.h>
 
 #include "houseportalclient.h"
+#include "houseportalresolve.h"
 
-int UdpClient[16];
-int UdpClientCount = 0;
+static char *UdpDestination = 0;
+static char *UdpService = 0;
 
-int hp_udp_client (const char *destination, const char *service) {
+static int UdpClientIpv4 = -1;
+static int UdpClientIpv6 = -1;
+
+static int hp_udp_socket (int family) {
 
     int value;
-    int s;
-
-    static struct addrinfo hints;
-    struct addrinfo *resolved;
-    struct addrinfo *cursor;
-
-    hints.ai_flags = AI_ADDRCONFIG;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-
-    int retries = 200;
-    for (;;) {
-        int status = getaddrinfo (destination, service, &hints, &resolved);
-        if (!status) break; // Success.
-        fprintf (stderr, "cannot resolve %s:%s (%s)\n",
-                         destination, service, gai_strerror(status));
-        if (retries-- <= 0) return 0;
-        sleep(3); // Retry later. It might be a network initialization issue.
+    int s = socket(family, SOCK_DGRAM, 0);
+    if (s < 0) {
+       fprintf (stderr, "cannot open socket for port %s (%s): %s\n",
+                UdpService,
+                (family==AF_INET6)?"ipv6":"ipv4",
+                strerror(errno));
+       return -1;
     }
 
-    for (cursor = resolved; cursor; cursor = cursor->ai_next) {
-
-        if (cursor->ai_family != AF_INET && cursor->ai_family != AF_INET6)
-            continue;
-
-        s = socket(cursor->ai_family, cursor->ai_socktype, cursor->ai_protocol);
-        if (s < 0) {
-           fprintf (stderr, "cannot open socket for port %s (%s): %s\n",
-                    service,
-                    (cursor->ai_family==AF_INET6)?"ipv6":"ipv4",
-                    strerror(errno));
-           continue;
-        }
-
-        if (connect(s, cursor->ai_addr, cursor->ai_addrlen) < 0) {
-           fprintf (stderr, "cannot connect to port %s (%s): %s\n",
-                    service,
-                    (cursor->ai_family==AF_INET6)?"ipv6":"ipv4",
-                    strerror(errno));
-           close(s);
-           continue;
-        }
-
-        value = 256 * 1024;
-        if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
-           fprintf (stderr, "cannot set receive buffer to %d: %s\n",
-                    value, strerror(errno));
-        }
-        value = 256 * 1024;
-        if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0) {
-           fprintf (stderr, "cannot set send buffer to %d: %s\n",
-                    value, strerror(errno));
-        }
-
-        UdpClient[UdpClientCount++] = s;
-        if (UdpClientCount >= 16) break;
+    value = 256 * 1024;
+    if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
+       fprintf (stderr, "cannot set receive buffer to %d: %s\n",
+                value, strerror(errno));
     }
-    freeaddrinfo(resolved);
+    value = 256 * 1024;
+    if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0) {
+       fprintf (stderr, "cannot set send buffer to %d: %s\n",
+                value, strerror(errno));
+    }
+    return s;
+}
+
+int hp_udp_client (const char *destination, const char *service) {
+
+    int count = 0;
+
+    if (UdpDestination) free (UdpDestination);
+    UdpDestination = strdup(destination);
+    if (UdpService) free (UdpService);
+    UdpService = strdup(service);
 
-    return UdpClientCount;
+    if (UdpClientIpv4 < 0) UdpClientIpv4 = hp_udp_socket (AF_INET);
+    if (UdpClientIpv6 < 0) UdpClientIpv6 = hp_udp_socket (AF_INET6);
+    if (UdpClientIpv4 >= 0) count += 1;
+    if (UdpClientIpv6 >= 0) count += 1;
+
+    // Do not retry here: the resolution goes on in the background,
+    // and the next packets will be sent once it has completed.
+    //
+    if (count > 0 && !houseportalresolve_wait (destination, service, 3)) {
+        fprintf (stderr, "%s:%s not resolved yet\n", destination, service);
+    }
+    return count;
 }
 
 
 void hp_udp_send (const char *data, int length) {
 
-    int i;
-    for (i = 0; i < UdpClientCount; ++i) {
-        send (UdpClient[i], data, length, 0);
+    const struct addrinfo *cursor;
+
+    if (!UdpDestination) return;
+
+    for (cursor = houseportalresolve (UdpDestination, UdpService);
+         cursor; cursor = cursor->ai_next) {
+
+        int s = -1;
+        if (cursor->ai_family == AF_INET) s = UdpClientIpv4;
+        else if (cursor->ai_family == AF_INET6) s = UdpClientIpv6;
+        if (s < 0) continue;
+
+        sendto (s, data, length, 0, cursor->ai_addr, cursor->ai_addrlen);
     }
 }
 
+int hp_udp_client_sockets (int *sockets, int size) {
+
+    int count = 0;
+
+    if (UdpClientIpv4 >= 0 && count < size) sockets[count++] = UdpClientIpv4;
+    if (UdpClientIpv6 >= 0 && count < size) sockets[count++] = UdpClientIpv6;
+    return count;
+}
+
+int hp_udp_client_receive (int socket, char *buffer, int size) {
+
+    int length = recv (socket, buffer, size-1, MSG_DONTWAIT);
+    if (length < 0) return -1;
+    buffer[length] = 0;
+    return length;
+}
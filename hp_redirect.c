@@ -31,22 +31,59 @@
  *    This function should be called periodically. It checks for
  *    and applies configuration changes, prune obsolete items, etc.
  *
- * void hp_redirect_list_json (int services, char *buffer, int size);
+ *    A modified configuration is validated as a whole before being
+ *    applied: an invalid configuration is ignored, and the current one
+ *    remains in use. The live routes are kept, unless the signature keys
+ *    changed: a route registered with a key that is no longer accepted
+ *    is removed.
  *
- *    This function populates the buffer with a JSON string that represents
- *    the current redirect database. If services is not 0, only entries
- *    mapping to a service are listed.
+ * const char *hp_redirect_list_json (int services);
  *
- * void hp_redirect_peers_json (char *buffer, int size);
+ *    This function returns a JSON string that represents the current
+ *    redirect database. If services is not 0, only entries mapping to
+ *    a service are listed.
  *
- *    This function populates the buffer with a JSON string that represents
- *    the active peers.
+ * const char *hp_redirect_peers_json (void);
  *
- * void hp_redirect_service_json (const char *service, char *buffer, int size);
+ *    This function returns a JSON string that represents the active peers.
  *
- *    This function populates the buffer with a JSON string that represents
- *    the active targets for the specified service. If service is null, all
- *    services are reported.
+ * const char *hp_redirect_service_json (const char *service);
+ *
+ *    This function returns a JSON string that represents the active
+ *    targets for the specified service.
+ *
+ * const char *hp_redirect_etag (void);
+ *
+ *    Return an HTTP entity tag that represents the current generation of
+ *    the redirect and peer databases. The generation changes whenever
+ *    a route or peer is added, modified, pruned or expires.
+ *
+ * The JSON strings are generated only once for each generation: all
+ * requests made within the same generation get the same cached string.
+ *
+ * void hp_redirect_share (void);
+ *
+ *    Create a shared memory table where the redirect and peer databases
+ *    are published. This is called by hp_redirect_start(), before any
+ *    worker process is created. The table is a file in /dev/shm, so that
+ *    the local clients can read it too (see houseportalregistry.c).
+ *
+ *    The table also serves as a snapshot when the portal restarts: the
+ *    live routes and peers found in the previous table are restored with
+ *    their original expiration, and the clients that sent registrations
+ *    or subscriptions before the restart are asked to renew immediately
+ *    (RESEND) and told that the registry changed (CHANGED). The addresses
+ *    of these clients are kept in a separate file, readable only by the
+ *    portal. The previous files are used only if they belong to the
+ *    portal's user, and new files are always created.
+ *
+ * void hp_redirect_worker (void);
+ *
+ *    Turn the current process into a worker: it stops receiving UDP
+ *    messages, and instead copies the redirect and peer databases from
+ *    the shared table whenever the owner process publishes a change.
+ *    The table is protected by a sequence lock: the owner never waits
+ *    for the workers, and the workers never write to it.
  */
 
 #include <sys/mman.h>
@@ -54,16 +91,21 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <arpa/inet.h>
 #include <arpa/inet.h>
 
 #include <time.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 
 #include "houseportal.h"
 #include "houselog.h"
+#include "houselog_metrics.h"
 #include "houseportalhmac.h"
+#include "houseportalregistry.h"
 
 
 static const char *ConfigurationPath = "/etc/house/portal.config";
@@ -82,61 +124,246 @@ typedef struct {
     int length;
     int hide;
     time_t expiration;
+    unsigned int signature;
+    int next;
 } HttpRedirection;
 
-#define REDIRECT_MAX 128
 #define REDIRECT_LIFETIME 600
 
 static int RedirectionCount = 0;
-static HttpRedirection Redirections[REDIRECT_MAX];
+static int RedirectionSize = 0;
+static HttpRedirection *Redirections = 0;
+
+// Index of the redirections, keyed by path. This allows finding the best
+// match in a time proportional to the depth of the URI, not to the number
+// of redirections. The collision lists are chained through the redirection
+// entries themselves (field next, -1 terminates the list).
+//
+#define REDIRECT_HASH 256
+
+static int RedirectionIndex[REDIRECT_HASH];
+
+// The current time, updated on every background tick. This avoids calling
+// time() on every HTTP request or registration.
+//
+static time_t RedirectNow = 0;
+
+// The paths that were declared as echttp routes. A path is never removed
+// from this list because echttp cannot remove a route: a path that comes
+// back after having been pruned reuses its existing route and string.
+// This limits the echttp routes to the number of distinct paths ever seen,
+// not the number of registrations.
+//
+typedef struct {
+    char *path;
+    unsigned int signature;
+    int next;
+} RoutedPath;
+
+static int RoutedPathCount = 0;
+static int RoutedPathSize = 0;
+static RoutedPath *RoutedPaths = 0;
+static int RoutedPathIndex[REDIRECT_HASH];
 
 typedef struct {
     char *name;
     time_t expiration;
+    long config;       // The configuration that declared this static peer.
+    time_t advertised; // Expiration at the time of the last change.
+    long version;      // Local version of the last change to this entry.
+    long known;        // Latest version of this peer's table received.
+    time_t requested;  // Time of the last SYNC request to this peer.
+    int gossip;        // This peer supports the GOSSIP protocol.
 } PortalPeers;
 
 static int PeerCount = 0;
-static PortalPeers Peers[REDIRECT_MAX];
+static int PeerSize = 0;
+static PortalPeers *Peers = 0;
+
+// The version of the peer table is incremented on every change to
+// an entry, and every entry records the version of its last change.
+// This way a peer that knows version N only needs the entries with
+// a version higher than N. The version is initialized from the time
+// of startup, so that it remains (mostly) monotonic across restarts.
+//
+static long PeerVersion = 0;
+static long PeerPublished = 0;
+static time_t PeerLegacySeen = 0;
+
+#define GOSSIP_MAX_ENTRIES 24
+#define GOSSIP_MAX_DATA 1200
+#define GOSSIP_REQUEST_INTERVAL 10
+
+// The registrations received, so that a client can renew them with
+// a compact RENEW message that only lists their identifiers. This is
+// a short list (a few entries per local service), searched linearly.
+//
+typedef struct {
+    unsigned int id;
+    long sequence;
+    time_t expiration;
+    char *body;
+} HttpRegistration;
+
+static int RegistrationCount = 0;
+static int RegistrationSize = 0;
+static HttpRegistration *Registrations = 0;
 
 // Cryptographic keys.
 //
 typedef struct {
     char *method;
-    char *value;
+    int value;
+    unsigned int fingerprint;
 } HttpRequest;
 
 static HttpRequest IntermediateDecode[128]; // Don't make the name obvious.
 static int IntermediateDecodeLength = 0;
 
+// The configuration is loaded in two passes: the first pass only checks
+// the syntax (ConfigChecking set), the second pass applies the directives
+// (ConfigApplying set).
+//
+static int   ConfigChecking = 0;
+static int   ConfigApplying = 0;
+static long  ConfigSequence = 0;
+static char **ConfigLines = 0;
+static int   ConfigLinesCount = 0;
+static int   ConfigLinesSize = 0;
+
 static const char *HostName = 0;
 
-static const HttpRedirection *SearchBestRedirect (const char *path) {
+// The generation of the redirect and peer databases, used to invalidate
+// the cached JSON data. It is incremented on any change, including when
+// an entry expires.
+//
+static long   RedirectGeneration = 0;
+static int    RedirectExpirationKnown = 0;
+static time_t RedirectNextExpiration = 0;
+
+// Renewals only move the expiration of existing routes: this is not
+// a change of generation, but the JSON data shows the expirations.
+//
+static long   RedirectRenewals = 0;
+
+static void RedirectChanged (void) {
+    RedirectGeneration += 1;
+    RedirectExpirationKnown = 0;
+}
+
+// The change notifications: local clients subscribe using WATCH, and
+// are sent a CHANGED message whenever the generation changes, at most
+// once per second. The other portals are also notified, and relay the
+// notification to their own local subscribers.
+//
+#define WATCH_LIFETIME 180
+
+static long   RedirectNotified = 0;
+static time_t RedirectNotifiedTime = 0;
+
+static void hp_redirect_refresh_generation (void);
+static void hp_redirect_import (void);
+static void hp_redirect_export (void);
+static void hp_redirect_client (void);
+static void hp_redirect_wakeup (void);
+static void hp_redirect_republish (void);
+static void hp_redirect_share_keys (void);
+
+static int RedirectWorker = 0;
+static int RedirectWakeup = 0; // Clients to notify after a restart.
+
+// The metrics, see /portal/metrics.
+//
+static int MetricRedirectFound = -1;
+static int MetricRedirectMissed = -1;
+static int MetricRedirectLookup = -1;
+static int MetricUdpReceived = -1;
+static int MetricUdpRejected = -1;
+static int MetricUdpDropped = -1;
+static int MetricUdpVerify = -1;
+static int MetricGossipMessages = -1;
+static int MetricGossipBytes = -1;
+static int MetricJsonRequests = -1;
+static int MetricJsonRendered = -1;
+
+static unsigned int RedirectSignature (const char *path, int length) {
 
     int i;
-    int quality = 0;
-    time_t now = time(0);
-    HttpRedirection *found = 0;
+    unsigned int signature = 0;
 
-    if (path[0] == 0 || path[1] == 0) return 0;
+    for (i = 0; i < length; ++i) {
+        signature = (signature * 31) + (unsigned char)(path[i]);
+    }
+    return signature;
+}
 
-    for (i = 0; i < RedirectionCount; ++i) {
-        int length = Redirections[i].length;
-        time_t expiration = Redirections[i].expiration;
+static int *RedirectIndexLink (int i) {
+
+    int *link = RedirectionIndex + (Redirections[i].signature % REDIRECT_HASH);
 
-        if (length <= quality) continue;
-        if (expiration < now && expiration > 0) continue;
+    while (*link != i) link = &(Redirections[*link].next);
+    return link;
+}
+
+static void RedirectIndexAdd (int i) {
+
+    int bucket = Redirections[i].signature % REDIRECT_HASH;
+
+    Redirections[i].next = RedirectionIndex[bucket];
+    RedirectionIndex[bucket] = i;
+}
+
+static void RedirectIndexRemove (int i) {
+    *RedirectIndexLink(i) = Redirections[i].next;
+}
+
+static void RedirectIndexMove (int from, int to) {
+    *RedirectIndexLink(from) = to;
+    Redirections[to] = Redirections[from];
+}
+
+static int RedirectIndexFind (const char *path, int length) {
+
+    int i;
+    unsigned int signature = RedirectSignature (path, length);
+
+    for (i = RedirectionIndex[signature % REDIRECT_HASH];
+         i >= 0; i = Redirections[i].next) {
+        if (Redirections[i].signature != signature) continue;
+        if (Redirections[i].length != length) continue;
         if (strncmp (Redirections[i].path, path, length)) continue;
-        if (path[length] != 0 && path[length] != '/') continue;
+        return i;
+    }
+    return -1;
+}
+
+static const HttpRedirection *SearchBestRedirect (const char *path) {
+
+    int length;
+
+    if (path[0] == 0 || path[1] == 0) return 0;
 
-        found = Redirections + i;
-        quality = length;
+    // Try the whole path first, and then each shorter prefix that ends
+    // just before a '/'. The first active match is the longest one.
+    //
+    length = strlen(path);
+    while (length > 0) {
+        int i = RedirectIndexFind (path, length);
+        if (i >= 0) {
+            time_t expiration = Redirections[i].expiration;
+            if (expiration == 0 || expiration >= RedirectNow)
+                return Redirections + i;
+        }
+        while (--length > 0 && path[length] != '/') ;
     }
-    return found;
+    return 0;
 }
 
 static void DeprecatePermanentConfiguration (void) {
     int i;
 
+    // The routes that are declared again are restored by LoadConfig(),
+    // the others are pruned: this counts as a change only if pruned.
     for (i = 0; i < RedirectionCount; ++i) {
         if (Redirections[i].expiration == 0) Redirections[i].expiration = 1;
     }
@@ -145,10 +372,8 @@ static void DeprecatePermanentConfiguration (void) {
             free(IntermediateDecode[i].method);
             IntermediateDecode[i].method = 0;
         }
-        if (IntermediateDecode[i].value) {
-            free(IntermediateDecode[i].value);
-            IntermediateDecode[i].value = 0;
-        }
+        houseportalhmac_release (IntermediateDecode[i].value);
+        IntermediateDecode[i].value = -1;
     }
     IntermediateDecodeLength = 0;
     RestrictUdp2Local = 0;
@@ -165,12 +390,13 @@ static void PruneRedirect (time_t now) {
         houselog_event ("ROUTE", Redirections[i].path, "REMOVED",
                         "%s", Redirections[i].target);
 
-        // Do not free path: the echhtp route still uses it.
+        // Do not free path: this is the echttp route's own string.
         free (Redirections[i].target);
         if (Redirections[i].service) free (Redirections[i].service);
 
+        RedirectIndexRemove (i);
         if (i < RedirectionCount-1) {
-            Redirections[i] = Redirections[RedirectionCount-1];
+            RedirectIndexMove (RedirectionCount-1, i);
             RedirectionCount -= 1;
         } else {
             RedirectionCount = i;
@@ -179,6 +405,8 @@ static void PruneRedirect (time_t now) {
     }
     if (!pruned) return;
 
+    RedirectChanged ();
+
     DEBUG {
         printf ("After pruning:\n");
         for (i = 0; i < RedirectionCount; ++i) {
@@ -194,8 +422,13 @@ static void PruneRedirect (time_t now) {
 static const char *RedirectRoute (const char *method, const char *uri,
                                   const char *data, int length) {
 
+    hp_redirect_import ();
+
+    long long start = houselog_metrics_clock ();
     const HttpRedirection *r = SearchBestRedirect (uri);
+    houselog_metrics_elapsed (MetricRedirectLookup, start);
     if (r) {
+        houselog_metrics_count (MetricRedirectFound, 1);
         static char url[2048]; // Accessed once after return.
         char parameters[1024];
         if (r->hide) {
@@ -208,12 +441,26 @@ static const char *RedirectRoute (const char *method, const char *uri,
                      r->target, uri, parameters);
         else
            snprintf (url, sizeof(url), "http://%s%s", r->target, uri);
+
+        // Tell the House clients how long this redirection remains valid,
+        // so that they can skip the portal for the next requests. This is
+        // not told to the browsers: a service may restart on another port
+        // before the route expires.
+        static char lifetime[32]; // Accessed once after return.
         if (r->expiration) {
+            long maxage = (long)(r->expiration - RedirectNow);
+            snprintf (lifetime, sizeof(lifetime),
+                      "%ld", (maxage > 0) ? maxage : 0);
+            echttp_attribute_set ("X-Portal-Lifetime", lifetime);
+            echttp_attribute_set ("Cache-Control", "no-cache");
             echttp_redirect (url);
         } else {
+            snprintf (lifetime, sizeof(lifetime), "%d", REDIRECT_LIFETIME);
+            echttp_attribute_set ("X-Portal-Lifetime", lifetime);
             echttp_permanent_redirect (url);
         }
     } else {
+        houselog_metrics_count (MetricRedirectMissed, 1);
         echttp_error (500, "Unresolvable redirection.");
     }
     return "";
@@ -226,13 +473,50 @@ static const char *RedirectRouteAsync (const char *method, const char *uri,
     return RedirectRoute (method, uri, data, length);
 }
 
+static const char *RedirectRoutedPath (const char *path,
+                                       int length, unsigned int signature) {
+
+    int i;
+    int bucket = signature % REDIRECT_HASH;
+
+    for (i = RoutedPathIndex[bucket]; i >= 0; i = RoutedPaths[i].next) {
+        if (RoutedPaths[i].signature != signature) continue;
+        if (strcmp (RoutedPaths[i].path, path)) continue;
+        return RoutedPaths[i].path; // Already routed.
+    }
+
+    if (RoutedPathCount >= RoutedPathSize) {
+        RoutedPathSize = RoutedPathCount + 64;
+        RoutedPaths = realloc (RoutedPaths, RoutedPathSize*sizeof(RoutedPath));
+    }
+    i = RoutedPathCount++;
+    RoutedPaths[i].path = strdup(path);
+    RoutedPaths[i].signature = signature;
+    RoutedPaths[i].next = RoutedPathIndex[bucket];
+    RoutedPathIndex[bucket] = i;
+
+    // Since HousePortal will never process any content data on these
+    // redirected requests, better not wait and accumulate the data.
+    // Respond with a redirect as soon as the HTTP headers have been
+    // received, and then HousePortal will ignore the content data
+    // until the connection is closed.
+    //
+    int route = echttp_route_match (RoutedPaths[i].path, RedirectRoute);
+    if (route < 0) {
+        houselog_trace (HOUSE_FAILURE, path, "cannot add HTTP route");
+    } else {
+        echttp_asynchronous_route (route, RedirectRouteAsync);
+    }
+    return RoutedPaths[i].path;
+}
+
 static void AddSingleRedirect (int live, int hide,
                                const char *target,
                                const char *service, const char *path) {
 
     int i;
     char buffer[1024];
-    time_t expiration = (live)?time(0)+REDIRECT_LIFETIME:0;
+    time_t expiration = (live)?RedirectNow+REDIRECT_LIFETIME:0;
 
     if (!strchr(target, ':')) {
        snprintf (buffer, sizeof(buffer), "%s:%s", HostName, target);
@@ -243,71 +527,79 @@ static void AddSingleRedirect (int live, int hide,
     // It is OK to renew an obsolete entry. A renewal may change everything
     // but the path: target, permanent/live, hide option, etc..
     //
-    for (i = 0; i < RedirectionCount; ++i) {
-        if (strcmp (Redirections[i].path, path) == 0) {
-            if (live && Redirections[i].expiration == 0) return; // Permanent..
-            if (strcmp (Redirections[i].target, target)) {
-                houselog_event ("ROUTE", path, "REPLACED", "%s WITH %s",
-                                Redirections[i].target, target);
-                free (Redirections[i].target);
-                Redirections[i].target = strdup(target);
-            }
-            if (service) {
-                if (!Redirections[i].service) {
-                    houselog_event ("ROUTE", path, "UPDATED",
-                                    "NOW SERVICE %s", service);
-                    Redirections[i].service = strdup(service);
-                } else if (strcmp (Redirections[i].service, service)) {
-                    houselog_event ("ROUTE", path, "UPDATED",
-                                    "SERVICE CHANGED FROM %s TO %s",
-                                    Redirections[i].service, service);
-                    free (Redirections[i].service);
-                    Redirections[i].service = strdup(service);
-                }
-            } else if (Redirections[i].service) {
-                houselog_event ("ROUTE", path, "UPDATED", "NOT A SERVICE");
+    i = RedirectIndexFind (path, strlen(path));
+    if (i >= 0) {
+        time_t previous = Redirections[i].expiration;
+        if (live && previous == 0) return; // Permanent..
+        if (ConfigApplying && previous == 1) previous = 0; // Declared again.
+        if ((previous == 0) != (expiration == 0) ||
+            (previous > 0 && previous < RedirectNow) ||
+            Redirections[i].hide != hide) {
+            RedirectChanged (); // Changed state.
+        }
+        if (strcmp (Redirections[i].target, target)) {
+            houselog_event ("ROUTE", path, "REPLACED", "%s WITH %s",
+                            Redirections[i].target, target);
+            free (Redirections[i].target);
+            Redirections[i].target = strdup(target);
+            RedirectChanged ();
+        }
+        if (service) {
+            if (!Redirections[i].service) {
+                houselog_event ("ROUTE", path, "UPDATED",
+                                "NOW SERVICE %s", service);
+                Redirections[i].service = strdup(service);
+                RedirectChanged ();
+            } else if (strcmp (Redirections[i].service, service)) {
+                houselog_event ("ROUTE", path, "UPDATED",
+                                "SERVICE CHANGED FROM %s TO %s",
+                                Redirections[i].service, service);
                 free (Redirections[i].service);
-                Redirections[i].service = 0;
+                Redirections[i].service = strdup(service);
+                RedirectChanged ();
             }
-
-            Redirections[i].hide = hide;
-            Redirections[i].expiration = expiration;
-            return;
+        } else if (Redirections[i].service) {
+            houselog_event ("ROUTE", path, "UPDATED", "NOT A SERVICE");
+            free (Redirections[i].service);
+            Redirections[i].service = 0;
+            RedirectChanged ();
         }
+
+        Redirections[i].hide = hide;
+        if (Redirections[i].expiration != expiration) RedirectRenewals += 1;
+        Redirections[i].expiration = expiration;
+        return;
     }
 
     // Not a renewal: use a new slot.
-    // Do not reuse an expired slot: echttp does not handle dynamic changes
-    // to HTTP routes at this time.
+    // Pruned slots are reused, since the table is kept compact. The path
+    // string is shared with the echttp route, which is created only once.
     //
-    if (RedirectionCount < REDIRECT_MAX) {
-        char *p = strdup(path);
-        houselog_trace (HOUSE_INFO, p,
-                        "add %s route %s to %s%s",
-                        live?"live":"permanent",p,target,hide?" (hide)":"");
-        houselog_event ("ROUTE", p, "ADD",
-                        "%s (%s)", target, live?"live":"permanent");
-
-        // Since HousePortal will never process any content data on these
-        // redirected requests, better not wait and accumulate the data.
-        // Respond with a redirect as soon as the HTTP headers have been
-        // received, and then HousePortal will ignore the content data
-        // until the connection is closed.
-        //
-        echttp_asynchronous_route
-            (echttp_route_match (p, RedirectRoute), RedirectRouteAsync);
-
-        Redirections[RedirectionCount].path = p;
-        Redirections[RedirectionCount].target = strdup(target);
-        if (service)
-            Redirections[RedirectionCount].service = strdup(service);
-        else
-            Redirections[RedirectionCount].service = 0;
-        Redirections[RedirectionCount].length = strlen(path);
-        Redirections[RedirectionCount].hide = hide;
-        Redirections[RedirectionCount].expiration = expiration;
-        RedirectionCount += 1;
+    if (RedirectionCount >= RedirectionSize) {
+        RedirectionSize = RedirectionCount + 64;
+        Redirections = realloc (Redirections,
+                                RedirectionSize*sizeof(HttpRedirection));
     }
+    HttpRedirection *r = Redirections + RedirectionCount;
+    int length = strlen(path);
+    unsigned int signature = RedirectSignature (path, length);
+
+    r->path = (char *)RedirectRoutedPath (path, length, signature);
+    houselog_trace (HOUSE_INFO, r->path,
+                    "add %s route %s to %s%s",
+                    live?"live":"permanent",path,target,hide?" (hide)":"");
+    houselog_event ("ROUTE", r->path, "ADD",
+                    "%s (%s)", target, live?"live":"permanent");
+
+    r->target = strdup(target);
+    r->service = service ? strdup(service) : 0;
+    r->length = length;
+    r->hide = hide;
+    r->expiration = expiration;
+    r->signature = signature;
+    RedirectIndexAdd (RedirectionCount);
+    RedirectionCount += 1;
+    RedirectChanged ();
 }
 
 static void AddRedirect (int live, char **token, int count) {
@@ -316,7 +608,7 @@ static void AddRedirect (int live, char **token, int count) {
     int hide = 0;
     const char *target = token[0];
 
-    if (strcmp ("HIDE", token[1]) == 0) {
+    if (count > 1 && strcmp ("HIDE", token[1]) == 0) {
         hide = 1;
         i = 2;
     }
@@ -333,36 +625,82 @@ static void AddRedirect (int live, char **token, int count) {
     }
 }
 
-static void AddOnePeer (const char *name, time_t expiration) {
+static void PeerChanged (PortalPeers *peer) {
+    peer->version = ++PeerVersion;
+    if (peer->expiration)
+        peer->advertised = peer->expiration;
+    else // Static peers are advertised as live for a limited time.
+        peer->advertised = RedirectNow + REDIRECT_LIFETIME;
+}
+
+// A renewed expiration is not propagated every time: this would cause
+// all the entries to change all the time. The renewal is propagated only
+// when the expiration moved significantly since it was last propagated.
+//
+static int PeerRenewed (const PortalPeers *peer, time_t expiration) {
+    return expiration >= peer->advertised + REDIRECT_LIFETIME / 2;
+}
+
+static int AddOnePeer (const char *name, time_t expiration) {
 
     int i;
 
     for (i = 0; i < PeerCount; ++i) {
-        if (!strcmp(Peers[i].name, name)) {
-            if (Peers[i].expiration > 0 &&
-                Peers[i].expiration < expiration) { // No downgrade.
-                Peers[i].expiration = expiration;
+        PortalPeers *peer = Peers + i;
+        if (!strcmp(peer->name, name)) {
+            if (expiration == 0 && ConfigApplying) { // Declared static.
+                peer->config = ConfigSequence;
+                if (peer->expiration != 0) {
+                    peer->expiration = 0;
+                    PeerChanged (peer);
+                    RedirectChanged ();
+                }
+                return i;
+            }
+            if (peer->expiration > 0 &&
+                peer->expiration < expiration) { // No downgrade.
+                int revived = (peer->expiration <= RedirectNow);
+                if (revived) RedirectChanged ();
+                peer->expiration = expiration;
+                if (revived || PeerRenewed (peer, expiration))
+                    PeerChanged (peer);
                 DEBUG printf ("Peer %s updated to %ld\n", name, expiration);
             }
-            return;
+            return i;
         }
     }
 
     // This is a new peer: add to the list.
-    if (PeerCount < REDIRECT_MAX) {
-        Peers[PeerCount].name = strdup(name);
-        Peers[PeerCount].expiration = expiration;
-        PeerCount += 1;
+    if (PeerCount >= PeerSize) {
+        PeerSize = PeerCount + 16;
+        Peers = realloc (Peers, PeerSize*sizeof(PortalPeers));
     }
+    PortalPeers *peer = Peers + PeerCount;
+    peer->name = strdup(name);
+    peer->expiration = expiration;
+    peer->config = ConfigSequence;
+    peer->known = 0;
+    peer->requested = 0;
+    peer->gossip = 0;
+    PeerChanged (peer);
+    RedirectChanged ();
+    return PeerCount++;
 }
 
 static void AddPeers (int live, char **token, int count) {
 
     int i;
-    time_t default_expiration = (live)?time(0)+REDIRECT_LIFETIME:0;
+    time_t default_expiration = (live)?RedirectNow+REDIRECT_LIFETIME:0;
 
     if (!strcmp(HostName, token[0])) return; // Got our own packet.
 
+    if (live) {
+        // Keep sending the PEER message as long as older portals are
+        // detected. Newer portals send it only for compatibility.
+        int sender = AddOnePeer (token[0], default_expiration);
+        if (!Peers[sender].gossip) PeerLegacySeen = RedirectNow;
+    }
+
     for (i = 0; i < count; ++i) {
         time_t expiration = default_expiration;
         if (live) {
@@ -377,19 +715,292 @@ static void AddPeers (int live, char **token, int count) {
     }
 }
 
-static void DecodeMessage (char *buffer, int live) {
+// Sign and send a peer message. If there is no destination, the message
+// is sent as a broadcast, and as a unicast to each static peer.
+//
+static void PeerSend (const char *destination,
+                      char *buffer, int length, int size, int identify) {
+
+    int i;
+
+    if (IntermediateDecodeLength) {
+        int key = IntermediateDecode[0].value;
+        const char *signature = houseportalhmac_sign (key, buffer);
+        if (!signature) return;
+        if (identify)
+            snprintf (buffer+length, size-length, " %s %s %s",
+                      IntermediateDecode[0].method, signature,
+                      houseportalhmac_id (key));
+        else
+            snprintf (buffer+length, size-length,
+                      " %s %s", IntermediateDecode[0].method, signature);
+        length += strlen(buffer+length);
+    }
+
+    if (destination) {
+        DEBUG printf ("Send to %s: %s\n", destination, buffer);
+        hp_udp_unicast (destination, buffer, length);
+        return;
+    }
+
+    // There are two ways of publishing:
+    // * Use broadcast to talk to the discovered peers.
+    // * Use explicit unicast for each statically defined peer.
+    // We do this because the static peer feature is meant
+    // for peers that cannot be reached through broadcast.
+    //
+    DEBUG printf ("Publish: %s\n", buffer);
+    hp_udp_broadcast (buffer, length);
+    for (i = 1; i < PeerCount; ++i) { // Do not send to ourself.
+        if (Peers[i].expiration == 0)
+            hp_udp_unicast (Peers[i].name, buffer, length);
+    }
+}
+
+static int GossipCompare (const void *a, const void *b) {
+    long va = Peers[*((const int *)a)].version;
+    long vb = Peers[*((const int *)b)].version;
+    return (va > vb) - (va < vb);
+}
+
+// Send all the entries that changed after version "since", in order of
+// version. Each datagram covers a range of versions that starts where
+// the previous one ended, so that a receiver can detect a missing one.
+//
+static void GossipSend (const char *destination, long since) {
+
+    int i;
+    int count = 0;
+    int next = 0;
+    int *changed = malloc (PeerCount * sizeof(int));
+    char entries[GOSSIP_MAX_DATA];
+    char buffer[GOSSIP_MAX_DATA+256];
+
+    for (i = 0; i < PeerCount; ++i) {
+        time_t expiration = Peers[i].expiration;
+        if (Peers[i].version <= since) continue;
+        if (expiration && expiration < RedirectNow) continue;
+        changed[count++] = i;
+    }
+    qsort (changed, count, sizeof(int), GossipCompare);
+
+    do {
+        int length = 0;
+        int n = 0;
+        long upto = PeerVersion;
+
+        entries[0] = 0;
+        while (next < count && n < GOSSIP_MAX_ENTRIES) {
+            PortalPeers *peer = Peers + changed[next];
+            time_t expiration = peer->expiration;
+            if (!expiration) expiration = peer->advertised;
+            int wrote = snprintf (entries+length, sizeof(entries)-length,
+                                  " %s=%ld", peer->name, (long)expiration);
+            if (length + wrote >= sizeof(entries)) {
+                if (n > 0) break; // Keep this entry for the next datagram.
+                entries[length] = 0; // Name is too long, skip.
+            } else {
+                length += wrote;
+                n += 1;
+            }
+            next += 1;
+        }
+        if (next < count) upto = Peers[changed[next-1]].version;
+
+        snprintf (buffer, sizeof(buffer), "GOSSIP %ld %s %ld %ld%s",
+                  (long)RedirectNow, HostName, since, upto, entries);
+        houselog_metrics_count (MetricGossipMessages, 1);
+        houselog_metrics_count (MetricGossipBytes, strlen(buffer));
+        PeerSend (destination, buffer, strlen(buffer), sizeof(buffer), 1);
+        since = upto;
+
+    } while (next < count);
+
+    free (changed);
+}
+
+static void GossipRequest (int sender) {
+
+    char buffer[512];
+    PortalPeers *peer = Peers + sender;
+
+    if (peer->requested + GOSSIP_REQUEST_INTERVAL > RedirectNow) return;
+    peer->requested = RedirectNow;
+
+    snprintf (buffer, sizeof(buffer),
+              "SYNC %ld %s %ld", (long)RedirectNow, HostName, peer->known);
+    PeerSend (peer->name, buffer, strlen(buffer), sizeof(buffer), 1);
+}
+
+// Handle a GOSSIP message. There are two forms:
+//   GOSSIP time host version
+//   GOSSIP time host since version [host=expiration ..]
+// The first form is a heartbeat that only advertises the sender's version.
+// The second form carries every entry that changed after version "since",
+// up to and including "version". If the receiver has not seen version
+// "since", it missed some changes and requests them using SYNC.
+//
+static void GossipReceived (char **token, int count) {
+
+    int i;
+    long since = -1;
+    long version;
+
+    if (!strcmp(HostName, token[0])) return; // Got our own packet.
+
+    int sender = AddOnePeer (token[0], RedirectNow+REDIRECT_LIFETIME);
+    Peers[sender].gossip = 1;
+
+    if (count == 2) {
+        version = atol(token[1]);
+    } else {
+        since = atol (token[1]);
+        version = atol (token[2]);
+        for (i = 3; i < count; ++i) {
+            time_t expiration = RedirectNow+REDIRECT_LIFETIME;
+            char *s = strchr (token[i], '=');
+            if (s) {
+                expiration = atol(s+1);
+                *s = 0;
+            }
+            AddOnePeer (token[i], expiration);
+        }
+    }
+
+    PortalPeers *peer = Peers + sender; // AddOnePeer() may move the table.
+
+    if (version < peer->known) peer->known = 0; // The sender restarted.
+
+    if (since >= 0 && since <= peer->known) {
+        if (version > peer->known) peer->known = version;
+    } else if (version > peer->known) {
+        GossipRequest (sender);
+    }
+}
+
+// The identifier of a registration is derived from the content of
+// the REDIRECT message, excluding the time and signature. This way older
+// clients do not need to change their message. The client must use
+// the same function (see houseportalclient.c).
+//
+static unsigned int RegistrationId (const char *body) {
+
+    unsigned int id = 2166136261u; // FNV-1a.
+
+    while (*body >= ' ') {
+        id ^= (unsigned char)(*(body++));
+        id *= 16777619u;
+    }
+    return id;
+}
+
+static HttpRegistration *RegistrationSearch (unsigned int id) {
+
+    int i;
+
+    for (i = 0; i < RegistrationCount; ++i) {
+        if (Registrations[i].id == id) return Registrations + i;
+    }
+    return 0;
+}
+
+// Record a verified REDIRECT message, which data is:
+//    REDIRECT time [host:]port [HIDE] [[service:]path ..]
+//
+static void RegistrationRecord (const char *data) {
+
+    const char *body = strchr (data, ' ');
+    if (body) body = strchr (body+1, ' '); // Skip the time.
+    if (!body) return;
+    while (*body == ' ') body += 1;
+
+    unsigned int id = RegistrationId (body);
+    HttpRegistration *registration = RegistrationSearch (id);
+
+    if (!registration) {
+        if (RegistrationCount >= RegistrationSize) {
+            RegistrationSize = RegistrationCount + 16;
+            Registrations = realloc (Registrations,
+                                     RegistrationSize*sizeof(HttpRegistration));
+        }
+        registration = Registrations + (RegistrationCount++);
+        registration->id = id;
+        registration->sequence = 0;
+        registration->body = strdup (body);
+        DEBUG printf ("New registration %08x: %s\n", id, body);
+    }
+    registration->expiration = RedirectNow + REDIRECT_LIFETIME;
+}
+
+static void RegistrationPrune (time_t now) {
+
+    int i;
+
+    for (i = RegistrationCount - 1; i >= 0; --i) {
+        if (Registrations[i].expiration >= now) continue;
+        DEBUG printf ("Registration %08x expired\n", Registrations[i].id);
+        free (Registrations[i].body);
+        Registrations[i] = Registrations[--RegistrationCount];
+    }
+}
+
+static int DecodeMessage (char *buffer, int live);
+
+// Handle a RENEW message, which tokens (after the timestamp) are:
+//    sequence id ..
+// A registration is renewed only if the sequence is newer than the last
+// one used for this registration. The portal asks the client to resend
+// the full registration for every unknown or outdated identifier.
+//
+static void RegistrationRenew (char **token, int count) {
+
+    int i;
+    long sequence = atol(token[0]);
+    char resend[512];
+    int length;
+    int missing = 0;
+
+    snprintf (resend, sizeof(resend), "RESEND %ld", (long)RedirectNow);
+    length = strlen(resend);
+
+    for (i = 1; i < count; ++i) {
+        unsigned int id = (unsigned int) strtoul (token[i], 0, 16);
+        HttpRegistration *registration = RegistrationSearch (id);
+
+        if (registration && sequence > registration->sequence) {
+            char buffer[1500];
+            registration->sequence = sequence;
+            registration->expiration = RedirectNow + REDIRECT_LIFETIME;
+            snprintf (buffer, sizeof(buffer), "REDIRECT %ld %s",
+                      (long)RedirectNow, registration->body);
+            DecodeMessage (buffer, 1);
+            continue;
+        }
+        DEBUG printf ("Registration %s %s\n",
+                      token[i], registration?"outdated":"unknown");
+        if (length + 10 < sizeof(resend)) {
+            length += snprintf (resend+length, sizeof(resend)-length,
+                                " %s", token[i]);
+            missing = 1;
+        }
+    }
+    if (missing) hp_udp_response (resend, length);
+}
+
+// Return 0 if the message is not valid.
+//
+static int DecodeMessage (char *buffer, int live) {
 
     int i, start, count;
-    char *token[16];
+    char *token[GOSSIP_MAX_ENTRIES+8];
 
     // Split the line
     for (i = start = count = 0; buffer[i] >= ' '; ++i) {
         if (buffer[i] == ' ') {
-            if (count >= 14) {
+            if (count >= GOSSIP_MAX_ENTRIES+6) {
                 houselog_trace (HOUSE_WARNING, "HousePortal",
                                 "Too many tokens at %s", buffer+i);
-                if (!live) exit(1);
-                return;
+                return 0;
             }
             token[count++] = buffer + start;
             do {
@@ -407,9 +1018,9 @@ static void DecodeMessage (char *buffer, int live) {
         if (count < 3) {
             houselog_trace (HOUSE_WARNING, "HousePortal",
                             "Incomplete redirect (%d arguments)", count);
-            if (!live) exit(1);
-            return;
+            return 0;
         }
+        if (ConfigChecking) return 1;
         AddRedirect (live, token+live+1, count-1); // Remove the keyword.
 
     } else if (strcmp("PEER", token[0]) == 0) {
@@ -418,27 +1029,77 @@ static void DecodeMessage (char *buffer, int live) {
         if (count < 2) {
             houselog_trace (HOUSE_WARNING, "HousePortal",
                             "Incomplete peer (%d argument)", count);
-            if (!live) exit(1);
-            return;
+            return 0;
         }
+        if (ConfigChecking) return 1;
         AddPeers (live, token+live+1, count-1); // remove the keyword
 
+    } else if (live && strcmp("GOSSIP", token[0]) == 0) {
+
+        if (count < 4) {
+            houselog_trace (HOUSE_WARNING, "HousePortal",
+                            "Incomplete gossip (%d arguments)", count-2);
+            return 0;
+        }
+        GossipReceived (token+2, count-2); // Remove keyword and timestamp.
+
+    } else if (live && strcmp("RENEW", token[0]) == 0) {
+
+        if (count < 4) {
+            houselog_trace (HOUSE_WARNING, "HousePortal",
+                            "Incomplete renew (%d arguments)", count-2);
+            return 0;
+        }
+        RegistrationRenew (token+2, count-2); // Remove keyword and timestamp.
+
+    } else if (live && strcmp("CHANGED", token[0]) == 0) {
+
+        char buffer[512];
+
+        if (count != 4) {
+            houselog_trace (HOUSE_WARNING, "HousePortal",
+                            "Invalid changed (%d arguments)", count-2);
+            return 0;
+        }
+        if (!strcmp(HostName, token[2])) return 1; // Got our own packet.
+        int length = snprintf (buffer, sizeof(buffer), "CHANGED %s %s %s",
+                               token[1], token[2], token[3]);
+        hp_udp_notify (buffer, length, RedirectNow);
+
+    } else if (live && strcmp("SYNC", token[0]) == 0) {
+
+        if (count != 4) {
+            houselog_trace (HOUSE_WARNING, "HousePortal",
+                            "Invalid sync (%d arguments)", count-2);
+            return 0;
+        }
+        if (!strcmp(HostName, token[2])) return 1; // Got our own packet.
+        AddOnePeer (token[2], RedirectNow+REDIRECT_LIFETIME);
+        GossipSend (token[2], atol(token[3]));
+
     } else if (live) {
 
-        return; // Ignore other messages below.
+        return 1; // Ignore other messages below.
 
     } else if (strcmp("LOCAL", token[0]) == 0) {
 
+        if (ConfigChecking) return 1;
         houselog_trace (HOUSE_INFO, "HousePortal", "LOCAL mode");
         houselog_event ("SYSTEM", "HousePortal", "SET", "LOCAL MODE");
         RestrictUdp2Local = 1;
 
     } else if (strcmp("SIGN", token[0]) == 0) {
 
+        if (ConfigChecking) return 1;
         if (count == 3 && IntermediateDecodeLength < 128) {
             int index = IntermediateDecodeLength++;
             IntermediateDecode[index].method = strdup(token[1]);
-            IntermediateDecode[index].value = strdup(token[2]);
+            // An unknown cypher is accepted, but never matches a message.
+            IntermediateDecode[index].value =
+                houseportalhmac_key (token[1], token[2]);
+            IntermediateDecode[index].fingerprint =
+                RedirectSignature (token[1], strlen(token[1])) ^
+                RedirectSignature (token[2], strlen(token[2]));
             DEBUG printf ("%s signature key\n", token[1]);
             houselog_event ("SYSTEM", "HousePortal", "SET", "SIGNATURE");
         }
@@ -446,52 +1107,160 @@ static void DecodeMessage (char *buffer, int live) {
     } else {
         houselog_trace (HOUSE_WARNING, "HousePortal",
                         "Invalid keyword %s", token[0]);
-        if (!live) exit(1);
+        return 0;
     }
+    return 1;
 }
 
-static void LoadConfig (const char *name) {
+static int ConfigReadLines (const char *name) {
 
     char buffer[1024];
-    struct stat fileinfo;
-
-    if (stat (name, &fileinfo) == 0) {
-        ConfigurationTime = fileinfo.st_mtim.tv_sec;
-    }
 
     FILE *f = fopen (name, "r");
-    if (f == 0) {
-        houselog_trace (HOUSE_FAILURE, "HousePortal",
-                        "Cannot access configuration file %s", name);
-        exit(0);
-    }
+    if (f == 0) return 0;
+
+    while (ConfigLinesCount > 0) free (ConfigLines[--ConfigLinesCount]);
 
     while (!feof(f)) {
         buffer[0] = 0;
         fgets (buffer, sizeof(buffer), f);
-        if (buffer[0] != '#' && buffer[0] > ' ') {
-            DecodeMessage (buffer, 0);
+        if (buffer[0] == '#' || buffer[0] <= ' ') continue;
+        if (ConfigLinesCount >= ConfigLinesSize) {
+            ConfigLinesSize = ConfigLinesCount + 64;
+            ConfigLines = realloc (ConfigLines, ConfigLinesSize*sizeof(char *));
         }
+        ConfigLines[ConfigLinesCount++] = strdup(buffer);
     }
     fclose(f);
-
-    if (IntermediateDecodeLength)
-        houselog_trace (HOUSE_INFO,
-                        "HousePortal", "Registrations must be signed");
+    return 1;
 }
 
-static int hp_redirect_inspect2 (const char *data,
-                                 const char *method, const char *value) {
+// The live routes were accepted using the previous keys. They remain
+// valid if no key is required anymore, or if all previous keys are still
+// accepted.
+//
+static int ConfigKeysKept (const unsigned int *previous, int count) {
 
-    int i;
-    const char *signature;
+    int i, j;
 
-    for (i = 0; i < IntermediateDecodeLength; ++i) {
+    if (IntermediateDecodeLength <= 0) return 1;
+    if (count <= 0) return 0; // The live routes were not signed.
 
-        if (strcmp(IntermediateDecode[i].method, method)) continue;
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < IntermediateDecodeLength; ++j) {
+            if (IntermediateDecode[j].fingerprint == previous[i]) break;
+        }
+        if (j >= IntermediateDecodeLength) return 0;
+    }
+    return 1;
+}
+
+// Load the configuration. The whole configuration is checked first, so
+// that an invalid configuration does not replace the current one. The
+// new configuration is applied within the same call, so that no HTTP
+// request ever sees a partial configuration.
+//
+static const char *LoadConfig (const char *name) {
+
+    char buffer[1024];
+    struct stat fileinfo;
+    int i;
+
+    if (stat (name, &fileinfo) == 0) {
+        ConfigurationTime = fileinfo.st_mtim.tv_sec;
+    }
+
+    if (!ConfigReadLines (name)) {
+        houselog_trace (HOUSE_FAILURE, "HousePortal",
+                        "Cannot access configuration file %s", name);
+        return "cannot access the configuration";
+    }
+
+    ConfigChecking = 1;
+    for (i = 0; i < ConfigLinesCount; ++i) {
+        snprintf (buffer, sizeof(buffer), "%s", ConfigLines[i]);
+        if (!DecodeMessage (buffer, 0)) break;
+    }
+    ConfigChecking = 0;
+    if (i < ConfigLinesCount) {
+        houselog_trace (HOUSE_FAILURE, "HousePortal",
+                        "Invalid configuration file %s, line: %s",
+                        name, ConfigLines[i]);
+        return "invalid configuration";
+    }
 
-        signature = houseportalhmac (IntermediateDecode[i].method,
-                                     IntermediateDecode[i].value, data);
+    unsigned int previous[128];
+    int previouscount = IntermediateDecodeLength;
+    for (i = 0; i < previouscount; ++i)
+        previous[i] = IntermediateDecode[i].fingerprint;
+
+    DeprecatePermanentConfiguration();
+    ConfigSequence += 1;
+
+    ConfigApplying = 1;
+    for (i = 0; i < ConfigLinesCount; ++i) {
+        snprintf (buffer, sizeof(buffer), "%s", ConfigLines[i]);
+        DecodeMessage (buffer, 0);
+    }
+    ConfigApplying = 0;
+
+    // Static peers that are not declared anymore are kept as live peers:
+    // they will expire unless they are still heard from.
+    //
+    for (i = 0; i < PeerCount; ++i) {
+        PortalPeers *peer = Peers + i;
+        if (peer->expiration || peer->config == ConfigSequence) continue;
+        if (!strcmp (peer->name, HostName)) continue;
+        peer->expiration = RedirectNow + REDIRECT_LIFETIME;
+        PeerChanged (peer);
+        RedirectChanged ();
+    }
+
+    if (!ConfigKeysKept (previous, previouscount)) {
+        for (i = 0; i < RedirectionCount; ++i) {
+            if (Redirections[i].expiration > 1)
+                Redirections[i].expiration = 1;
+        }
+        houselog_trace (HOUSE_INFO, "HousePortal",
+                        "Signature keys changed, live routes removed");
+    }
+    PruneRedirect (RedirectNow); // Remove the routes not declared anymore.
+
+    if (IntermediateDecodeLength)
+        houselog_trace (HOUSE_INFO,
+                        "HousePortal", "Registrations must be signed");
+    hp_redirect_share_keys ();
+    return 0;
+}
+
+static int hp_redirect_inspect2 (const char *data,
+                                 const char *method, const char *value,
+                                 const char *id) {
+
+    int i;
+    const char *signature;
+
+    // If the client identified its key, there is only one key to try.
+    //
+    if (id) {
+        int key = houseportalhmac_find (method, id);
+        if (key >= 0) {
+            signature = houseportalhmac_sign (key, data);
+            if (signature && strcmp(signature, value) == 0) return 1; // Passed.
+            DEBUG printf ("Signature %s did not match client signature %s\n",
+                          signature, value);
+        }
+        houselog_trace (HOUSE_WARNING,
+                        "HousePortal", "No signature match for %s", data);
+        return 0;
+    }
+
+    for (i = 0; i < IntermediateDecodeLength; ++i) {
+
+        if (strcmp(IntermediateDecode[i].method, method)) continue;
+
+        signature = houseportalhmac_sign (IntermediateDecode[i].value, data);
+        if (!signature) continue;
 
         if (strcmp(signature, value) == 0) return 1; // Passed.
         DEBUG printf ("Signature %s did not match client signature %s\n",
@@ -523,25 +1292,95 @@ static int hp_redirect_inspect (char *data, int length) {
     if (IntermediateDecodeLength <= 0) return 1; // No key. Accept all.
 
     if (crypto) {
+        char *id = strchr (crypto, ' '); // Optional key identifier.
+        if (id) *(id++) = 0;
         crypto[-1] = 0; // Split cypher from signature.
-        return hp_redirect_inspect2 (data, cypher, crypto);
+        return hp_redirect_inspect2 (data, cypher, crypto, id);
     }
 
     return 0; // Not signed, but signature was required.
 }
 
-static void hp_redirect_udp (int fd, int mode) {
+// A WATCH subscription is not signed: it is only accepted from a local
+// client, and only causes CHANGED notifications to be sent back. The
+// response to a WATCH is a CHANGED message with the current generation.
+// Return 0 if the subscription was refused.
+//
+static int hp_redirect_watch (void) {
 
-    int   length;
-    char  buffer[1024];
+    char buffer[512];
 
-    length = hp_udp_receive (fd, buffer, sizeof(buffer));
-    if (length > 0) {
-        buffer[length] = 0;
-        DEBUG printf ("Received: %s\n", buffer);
-        if (hp_redirect_inspect (buffer, length)) {
-            DecodeMessage (buffer, 1);
+    if (!hp_udp_subscribe (RedirectNow + WATCH_LIFETIME)) return 0;
+
+    hp_redirect_refresh_generation ();
+    int length = snprintf (buffer, sizeof(buffer), "CHANGED %ld %s %ld",
+                           (long)RedirectNow, HostName, RedirectGeneration);
+    hp_udp_response (buffer, length);
+    return 1;
+}
+
+static void hp_redirect_notify (time_t now) {
+
+    char buffer[512];
+
+    hp_redirect_refresh_generation ();
+    if (RedirectGeneration == RedirectNotified) return;
+    if (now <= RedirectNotifiedTime) return;
+
+    int length = snprintf (buffer, sizeof(buffer), "CHANGED %ld %s %ld",
+                           (long)now, HostName, RedirectGeneration);
+    hp_udp_notify (buffer, length, now);
+    if (!RestrictUdp2Local) PeerSend (0, buffer, length, sizeof(buffer), 1);
+
+    RedirectNotified = RedirectGeneration;
+    RedirectNotifiedTime = now;
+}
+
+static void hp_redirect_packet (char *data, int length) {
+
+    DEBUG printf ("Received: %s\n", data);
+    houselog_metrics_count (MetricUdpReceived, 1);
+    if (strncmp (data, "WATCH ", 6) == 0) {
+        // Only remember the clients whose subscription was accepted.
+        if (hp_redirect_watch ()) hp_redirect_client ();
+        return;
+    }
+    long long start = houselog_metrics_clock ();
+    int accepted = hp_redirect_inspect (data, length);
+    houselog_metrics_elapsed (MetricUdpVerify, start);
+    if (accepted) {
+        if (strncmp (data, "REDIRECT ", 9) == 0) {
+            RegistrationRecord (data);
+            hp_redirect_client ();
+        } else if (strncmp (data, "RENEW ", 6) == 0) {
+            hp_redirect_client ();
         }
+        DecodeMessage (data, 1);
+    } else {
+        houselog_metrics_count (MetricUdpRejected, 1);
+    }
+}
+
+static void hp_redirect_udp (int fd, int mode) {
+    hp_udp_receive_batch (fd, hp_redirect_packet);
+    hp_redirect_export ();
+}
+
+static void hp_redirect_udp_statistics (void) {
+
+    static long LastDropped = 0;
+
+    long received;
+    long dropped;
+    int  depth;
+
+    hp_udp_statistics (&received, &dropped, &depth);
+    houselog_metrics_set (MetricUdpDropped, dropped);
+    if (dropped != LastDropped) {
+        houselog_trace (HOUSE_WARNING, "HousePortal",
+                        "%ld UDP packets dropped (%ld received, batch depth %d)",
+                        dropped - LastDropped, received, depth);
+        LastDropped = dropped;
     }
 }
 
@@ -549,7 +1388,7 @@ static void hp_redirect_open(void) {
 
     int count;
 
-    while (PortalUdpPointsCount >= 0) {
+    while (PortalUdpPointsCount > 0) {
         echttp_forget (PortalUdpPoints[--PortalUdpPointsCount]);
     }
 
@@ -568,49 +1407,70 @@ static void hp_redirect_open(void) {
     }
 }
 
-static void hp_redirect_publish (time_t now) {
+// The legacy PEER message, for older portals. The peers are split over
+// multiple messages, to fit the limits of these older versions.
+//
+#define PEER_LEGACY_ENTRIES 10
 
-    int i;
-    int length;
+static void hp_redirect_publish_legacy (time_t now) {
+
+    int i = 1;
     char buffer[1400];
 
-    snprintf (buffer, sizeof(buffer), "PEER %ld", now);
-    length = strlen(buffer);
+    do {
+        int n = 0;
+        int length;
+
+        snprintf (buffer, sizeof(buffer), "PEER %ld %s", now, HostName);
+        length = strlen(buffer);
+
+        for (; i < PeerCount && n < PEER_LEGACY_ENTRIES; ++i) {
+            time_t expiration = Peers[i].expiration;
+            if (expiration >= now)
+                snprintf (buffer+length, sizeof(buffer)-length,
+                          " %s=%ld", Peers[i].name, (long)expiration);
+            else if (!expiration)
+                snprintf (buffer+length, sizeof(buffer)-length,
+                          " %s", Peers[i].name);
+            else
+                continue;
+            length += strlen(buffer+length);
+            n += 1;
+        }
+
+        // The key identifier is not included here, because the peers are
+        // older versions of HousePortal that might not support it.
+        //
+        PeerSend (0, buffer, length, sizeof(buffer), 0);
+
+    } while (i < PeerCount);
+}
+
+static void hp_redirect_publish (time_t now) {
 
+    int i;
+
+    // Static peers do not expire, but are advertised with an expiration:
+    // renew it before it lapses.
+    //
     for (i = 0; i < PeerCount; ++i) {
-        time_t expiration = Peers[i].expiration;
-        if (expiration >= now)
-            snprintf (buffer+length, sizeof(buffer)-length,
-                      " %s=%ld", Peers[i].name, (long)expiration);
-        else if (!expiration)
-            snprintf (buffer+length, sizeof(buffer)-length,
-                      " %s", Peers[i].name);
-        length += strlen(buffer+length);
+        PortalPeers *peer = Peers + i;
+        if (peer->expiration == 0 && PeerRenewed (peer, now+REDIRECT_LIFETIME))
+            PeerChanged (peer);
     }
 
-    if (IntermediateDecodeLength) {
-        const char *signature =
-            houseportalhmac (IntermediateDecode[0].method,
-                             IntermediateDecode[0].value,
-                             buffer);
-        if (!signature) return;
-        snprintf (buffer+length, sizeof(buffer)-length,
-                  " %s %s", IntermediateDecode[0].method, signature);
-        length += strlen(buffer+length);
+    if (PeerVersion > PeerPublished) {
+        GossipSend (0, PeerPublished);
+        PeerPublished = PeerVersion;
+    } else {
+        char buffer[512];
+        snprintf (buffer, sizeof(buffer),
+                  "GOSSIP %ld %s %ld", (long)now, HostName, PeerVersion);
+        PeerSend (0, buffer, strlen(buffer), sizeof(buffer), 1);
     }
 
-    // There are two ways of publishing:
-    // * Use broadcast to talk to the discovered peers.
-    // * Use explicit unicast for each statically defined peer.
-    // We do this because the static peer feature is meant
-    // for peers that cannot be reached through broadcast.
-    //
-    DEBUG printf ("Publish: %s\n", buffer);
-    hp_udp_broadcast (buffer, length);
-    for (i = 1; i < PeerCount; ++i) { // Do not send to ourself.
-        if (Peers[i].expiration == 0)
-            hp_udp_unicast (Peers[i].name, buffer, length);
-    }
+    if (PeerLegacySeen && PeerLegacySeen + REDIRECT_LIFETIME > now)
+        hp_redirect_publish_legacy (now);
 }
 
 void hp_redirect_background (void) {
@@ -619,6 +1479,15 @@ void hp_redirect_background (void) {
     time_t now = time(0);
     struct stat fileinfo;
 
+    RedirectNow = now;
+
+    if (RedirectWorker) {
+        hp_redirect_import ();
+        return;
+    }
+    hp_redirect_wakeup ();
+    hp_redirect_notify (now);
+
     if (now > LastCheck + 30) {
         int pruned = 0;
         if (!RestrictUdp2Local && !hp_udp_has_broadcast()) {
@@ -630,45 +1499,134 @@ void hp_redirect_background (void) {
                 houselog_trace (HOUSE_INFO, "HousePortal",
                                 "Configuration file %s changed",
                                 ConfigurationPath);
-                DeprecatePermanentConfiguration();
-                LoadConfig (ConfigurationPath);
-                PruneRedirect (now+3000); // Force immediate expiration.
-                pruned = 1;
+                if (!LoadConfig (ConfigurationPath)) pruned = 1;
             }
         } else {
             houselog_trace (HOUSE_FAILURE, "HousePortal",
                             "Cannot stat %s", ConfigurationPath);
         }
         if (!pruned) PruneRedirect (now);
+        RegistrationPrune (now);
+        hp_redirect_republish ();
+
+        hp_redirect_udp_statistics ();
         if (!RestrictUdp2Local) hp_redirect_publish (now);
         LastCheck = now;
     }
+    hp_redirect_export ();
 }
 
-static int hp_redirect_preamble (time_t now, char *buffer, int size) {
+// The generation changes when an entry expires, since this changes
+// the JSON data. The next expiration is recalculated only after a change.
+//
+static void hp_redirect_refresh_generation (void) {
 
-    snprintf (buffer, size,
-             "{\"host\":\"%s\",\"timestamp\":%lld,\"portal\":{",
-             HostName, (long long)now);
-    return strlen(buffer);
+    int i;
+    time_t next = 0;
+
+    if (RedirectWorker) return; // The owner process decides.
+
+    if (RedirectExpirationKnown) {
+        if (!RedirectNextExpiration) return; // Nothing will expire.
+        if (RedirectNow < RedirectNextExpiration) return; // Not yet.
+        RedirectGeneration += 1; // At least one entry has expired.
+    }
+
+    for (i = 0; i < RedirectionCount; ++i) {
+        time_t expiration = Redirections[i].expiration;
+        if (expiration <= RedirectNow) continue;
+        if (!next || expiration < next) next = expiration;
+    }
+    for (i = 0; i < PeerCount; ++i) {
+        time_t expiration = Peers[i].expiration;
+        if (expiration <= RedirectNow) continue;
+        if (!next || expiration < next) next = expiration;
+    }
+    RedirectNextExpiration = next;
+    RedirectExpirationKnown = 1;
+}
+
+const char *hp_redirect_etag (void) {
+
+    static char etag[32];
+
+    hp_redirect_import ();
+    hp_redirect_refresh_generation ();
+    snprintf (etag, sizeof(etag), "\"%ld\"", RedirectGeneration);
+    return etag;
+}
+
+// A growable buffer that holds the JSON data for one generation.
+// Renewals do not change the generation, but they change the "expire"
+// values: the data is then rendered again, at most once per second.
+//
+typedef struct {
+    char  *buffer;
+    int    size;
+    int    length;
+    long   generation;
+    long   renewals;
+    time_t rendered;
+} RedirectJson;
+
+static int hp_redirect_json_valid (RedirectJson *json) {
+
+    hp_redirect_refresh_generation ();
+    if (json->buffer && json->generation == RedirectGeneration) {
+        if (json->renewals == RedirectRenewals) return 1;
+        if (json->rendered == RedirectNow) return 1;
+    }
+
+    json->length = 0;
+    json->generation = RedirectGeneration;
+    json->renewals = RedirectRenewals;
+    json->rendered = RedirectNow;
+    return 0;
+}
+
+static void hp_redirect_json_add (RedirectJson *json, const char *format, ...) {
+
+    va_list ap;
+
+    for (;;) {
+        int room = json->size - json->length;
+
+        va_start (ap, format);
+        int wrote = vsnprintf (json->buffer + json->length, room, format, ap);
+        va_end (ap);
+
+        if (wrote < room) {
+            json->length += wrote;
+            return;
+        }
+        json->size = json->length + wrote + 4096;
+        json->buffer = realloc (json->buffer, json->size);
+    }
+}
+
+static void hp_redirect_preamble (RedirectJson *json) {
+    houselog_metrics_count (MetricJsonRendered, 1);
+
+    hp_redirect_json_add (json,
+                          "{\"host\":\"%s\",\"timestamp\":%lld,\"portal\":{",
+                          HostName, (long long)RedirectNow);
 }
 
-void hp_redirect_list_json (int services, char *buffer, int size) {
+const char *hp_redirect_list_json (int services) {
+
+    static RedirectJson Cache[2];
 
     int i;
-    int length;
-    int reclen;
-    char *cursor;
     const char *prefix = "";
-    time_t now = time(0);
+    RedirectJson *json = Cache + (services != 0);
     char service[256];
 
-    length = hp_redirect_preamble (now, buffer, size);
-    cursor = buffer + length;
+    houselog_metrics_count (MetricJsonRequests, 1);
+
+    if (hp_redirect_json_valid (json)) return json->buffer;
 
-    snprintf (cursor, size-length, "\"redirect\":[");
-    length += strlen(cursor);
-    cursor = buffer + length;
+    hp_redirect_preamble (json);
+    hp_redirect_json_add (json, "\"redirect\":[");
 
     for (i = 0; i < RedirectionCount; ++i) {
 
@@ -682,7 +1640,7 @@ void hp_redirect_list_json (int services, char *buffer, int size) {
         else
             service[0] = 0;
 
-        snprintf (cursor, size-length,
+        hp_redirect_json_add (json,
                   "%s{\"path\":\"%*.*s\",%s\"expire\":%lld,\"target\":\"%s\",\"hide\":%s,\"active\":%s}",
                   prefix,
                   Redirections[i].length, Redirections[i].length,
@@ -691,64 +1649,80 @@ void hp_redirect_list_json (int services, char *buffer, int size) {
                   (long long)expiration,
                   Redirections[i].target,
                   Redirections[i].hide?"true":"false",
-                  (expiration == 0 || expiration > now)?"true":"false");
-        reclen = strlen(cursor);
+                  (expiration == 0 || expiration > RedirectNow)?"true":"false");
         prefix = ",";
-        if (length + reclen >= size) break;
-        length += reclen;
-        cursor += reclen;
     }
-    snprintf (cursor, size-length, "]}}");
-    buffer[size-1] = 0;
+    hp_redirect_json_add (json, "]}}");
+    return json->buffer;
 }
 
-void hp_redirect_peers_json (char *buffer, int size) {
+const char *hp_redirect_peers_json (void) {
+
+    static RedirectJson Cache;
 
     int i;
-    int length;
-    char *cursor;
+
+    houselog_metrics_count (MetricJsonRequests, 1);
     const char *prefix = "";
-    time_t now = time(0);
 
-    length = hp_redirect_preamble (now, buffer, size);
-    cursor = buffer + length;
+    if (hp_redirect_json_valid (&Cache)) return Cache.buffer;
 
-    snprintf (cursor, size-length, "\"peers\":[");
-    length += strlen(cursor);
-    cursor = buffer + length;
+    hp_redirect_preamble (&Cache);
+    hp_redirect_json_add (&Cache, "\"peers\":[");
 
     for (i = 0; i < PeerCount; ++i) {
 
         time_t expiration = Peers[i].expiration;
 
-        if (expiration && expiration <= now) continue;
+        if (expiration && expiration <= RedirectNow) continue;
 
-        snprintf (cursor, size-length, "%s\"%s\"", prefix, Peers[i].name);
-        length += strlen(cursor);
+        hp_redirect_json_add (&Cache, "%s\"%s\"", prefix, Peers[i].name);
         prefix = ",";
-        cursor = buffer + length;
     }
-    snprintf (cursor, size-length, "]}}");
-    buffer[size-1] = 0;
+    hp_redirect_json_add (&Cache, "]}}");
+    return Cache.buffer;
 }
 
-void hp_redirect_service_json (const char *name, char *buffer, int size) {
+// Keep the JSON data for the most recently requested services.
+//
+#define SERVICE_CACHE 8
+
+static struct {
+    char *name;
+    RedirectJson json;
+} ServiceCache[SERVICE_CACHE];
+
+static int ServiceCacheNext = 0;
+
+const char *hp_redirect_service_json (const char *name) {
 
     int i;
-    int length;
     int port = echttp_port(4);
     char hostaddress[1024];
-    char *cursor;
     const char *prefix = "";
-    time_t now = time(0);
+    RedirectJson *json = 0;
+
+    houselog_metrics_count (MetricJsonRequests, 1);
+
+    for (i = 0; i < SERVICE_CACHE; ++i) {
+        if (ServiceCache[i].name && !strcmp(ServiceCache[i].name, name)) {
+            json = &(ServiceCache[i].json);
+            break;
+        }
+    }
+    if (!json) {
+        i = ServiceCacheNext;
+        ServiceCacheNext = (ServiceCacheNext + 1) % SERVICE_CACHE;
+        if (ServiceCache[i].name) free (ServiceCache[i].name);
+        ServiceCache[i].name = strdup(name);
+        json = &(ServiceCache[i].json);
+        json->generation = RedirectGeneration - 1; // Force a refresh.
+    }
 
-    length = hp_redirect_preamble (now, buffer, size);
-    cursor = buffer + length;
+    if (hp_redirect_json_valid (json)) return json->buffer;
 
-    snprintf (cursor, size-length,
-              "\"service\":{\"name\":\"%s\",\"url\":[", name);
-    length += strlen(cursor);
-    cursor = buffer + length;
+    hp_redirect_preamble (json);
+    hp_redirect_json_add (json, "\"service\":{\"name\":\"%s\",\"url\":[", name);
 
     if (port == 80) {
         strncpy (hostaddress, HostName, sizeof(hostaddress));
@@ -761,38 +1735,664 @@ void hp_redirect_service_json (const char *name, char *buffer, int size) {
 
         time_t expiration = Redirections[i].expiration;
 
-        if (expiration && expiration <= now) continue;
+        if (expiration && expiration <= RedirectNow) continue;
 
         if (!Redirections[i].service) continue;
         if (strcmp(Redirections[i].service, name)) continue;
 
-        snprintf (cursor, size-length, "%s\"http://%s%s\"",
-                  prefix, hostaddress, Redirections[i].path);
-        length += strlen(cursor);
+        hp_redirect_json_add (json, "%s\"http://%s%s\"",
+                              prefix, hostaddress, Redirections[i].path);
         prefix = ",";
-        cursor = buffer + length;
     }
-    snprintf (cursor, size-length, "]}}}");
-    buffer[size-1] = 0;
+    hp_redirect_json_add (json, "]}}}");
+    return json->buffer;
+}
+
+// The shared table used to publish the redirect and peer databases to
+// the worker processes and to the local clients. The strings are stored
+// in a string area at the end of the table, so that the table does not
+// contain any pointer. The table grows when needed: every process maps
+// the maximum size (HOUSEPORTALREGISTRY_MAX), so that a larger file is
+// visible to all of them without mapping it again. Entries that do not
+// fit within the maximum size are not shared, which is reported.
+//
+typedef houseportalregistry_route SharedRoute;
+typedef houseportalregistry_peer SharedPeer;
+typedef houseportalregistry SharedTable;
+
+static SharedTable *RedirectShared = 0;
+static int RedirectSharedFd = -1; // -1: anonymous table.
+static uint32_t RedirectSharedFileSize = 0;
+static SharedTable *RedirectSharedCopy = 0; // Worker's private copy.
+static uint32_t RedirectSharedImported = 0;
+static int RedirectSharedDropped = 0;
+static int RedirectSharedForce = 1; // Export even if not changed.
+
+// The sources of the registrations and subscriptions, kept in a separate
+// file that only the portal can read, so that the portal can ask them to
+// renew after a restart. The file also records the fingerprints of the
+// signature keys that the live routes were accepted with.
+//
+#define REDIRECT_CLIENTS 256
+#define REDIRECT_KEYS    128
+
+typedef struct {
+    unsigned char address[32]; // A struct sockaddr_in or sockaddr_in6.
+    int length;
+    time_t expiration;
+} SharedClient;
+
+typedef struct {
+    uint32_t magic;
+    int keys;
+    unsigned int key[REDIRECT_KEYS];
+    int count;
+    SharedClient client[REDIRECT_CLIENTS];
+} SharedClients;
+
+static SharedClients *RedirectClients = 0;
+static int RedirectRestoreRoutes = 0;
+
+static int MetricSharedDropped = -1;
+
+static int hp_redirect_copy (char *to, int size, const char *from) {
+    int length = strlen (from);
+    if (length >= size) return 0;
+    memcpy (to, from, length+1);
+    return 1;
+}
+
+static const char *hp_redirect_clients_path (void) {
+    static char path[256];
+    snprintf (path, sizeof(path),
+              "/dev/shm/houseportal_%s.clients", PortalPort);
+    return path;
+}
+
+// Anyone can create files in /dev/shm: a previous file is used only if
+// it is a regular file that belongs to the portal's user.
+//
+static void *hp_redirect_share_previous (const char *path, off_t *size) {
+
+    struct stat fileinfo;
+
+    int fd = open (path, O_RDONLY|O_NOFOLLOW);
+    if (fd < 0) return MAP_FAILED;
+
+    void *map = MAP_FAILED;
+    if (fstat (fd, &fileinfo) == 0) {
+        if (S_ISREG(fileinfo.st_mode) && fileinfo.st_uid == geteuid()) {
+            *size = fileinfo.st_size;
+            if (*size > 0)
+                map = mmap (0, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        } else {
+            houselog_trace (HOUSE_WARNING, path,
+                            "not owned by the portal, ignored");
+        }
+    }
+    close (fd);
+    return map;
+}
+
+// A new file is always created: an existing file could have been created,
+// or replaced with a link, by another user.
+//
+static int hp_redirect_share_create (const char *path, mode_t mode,
+                                     off_t size) {
+
+    unlink (path);
+    int fd = open (path, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW, mode);
+    if (fd < 0) {
+        houselog_trace (HOUSE_FAILURE, path,
+                        "cannot create: %s", strerror(errno));
+        return -1;
+    }
+    fchmod (fd, mode); // In case of a restrictive umask.
+    if (ftruncate (fd, size)) {
+        houselog_trace (HOUSE_FAILURE, path,
+                        "cannot set the size: %s", strerror(errno));
+        close (fd);
+        unlink (path);
+        return -1;
+    }
+    return fd;
+}
+
+// The registry must be readable by the local clients.
+// If the file cannot be created, the workers still get an anonymous table.
+//
+static void *hp_redirect_share_file (void) {
+
+    const char *path = houseportalregistry_path (PortalPort);
+
+    int fd = hp_redirect_share_create (path, 0644, sizeof(SharedTable));
+    if (fd < 0) return MAP_FAILED;
+
+    void *shared = mmap (0, HOUSEPORTALREGISTRY_MAX, PROT_READ|PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED) {
+        houselog_trace (HOUSE_FAILURE, path,
+                        "cannot map the registry: %s", strerror(errno));
+        close (fd);
+        unlink (path);
+        return MAP_FAILED;
+    }
+    RedirectSharedFd = fd;
+    RedirectSharedFileSize = sizeof(SharedTable);
+    return shared;
+}
+
+// Restore the sources known before the restart in a new clients file.
+// If the file cannot be created, the clients are only kept in memory.
+//
+static void hp_redirect_share_clients (const SharedClients *previous,
+                                       off_t size) {
+
+    int i;
+    const char *path = hp_redirect_clients_path ();
+    SharedClients *clients = MAP_FAILED;
+
+    int fd = hp_redirect_share_create (path, 0600, sizeof(SharedClients));
+    if (fd >= 0) {
+        clients = mmap (0, sizeof(SharedClients), PROT_READ|PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+        close (fd);
+    }
+    if (clients == MAP_FAILED) clients = calloc (1, sizeof(SharedClients));
+    if (!clients) return;
+    clients->magic = HOUSEPORTALREGISTRY_MAGIC;
+    clients->count = 0;
+    RedirectClients = clients;
+    hp_redirect_share_keys ();
+
+    // Without a record of the previous keys, the live routes are restored
+    // only if no signature is required.
+    RedirectRestoreRoutes = ConfigKeysKept (0, 0);
+
+    if (previous == MAP_FAILED) return;
+    if (size != sizeof(SharedClients) ||
+        previous->magic != HOUSEPORTALREGISTRY_MAGIC ||
+        previous->keys < 0 || previous->keys > REDIRECT_KEYS ||
+        previous->count < 0 || previous->count > REDIRECT_CLIENTS) return;
+
+    RedirectRestoreRoutes = ConfigKeysKept (previous->key, previous->keys);
+
+    for (i = 0; i < previous->count; ++i) {
+        const SharedClient *client = previous->client + i;
+        if (client->expiration <= RedirectNow) continue;
+        if (client->length <= 0 ||
+            client->length > sizeof(client->address)) continue;
+        SharedClient *restored = clients->client + clients->count++;
+        *restored = *client;
+        if (restored->expiration > RedirectNow + REDIRECT_LIFETIME)
+            restored->expiration = RedirectNow + REDIRECT_LIFETIME;
+    }
+    RedirectWakeup = (clients->count > 0);
+}
+
+// Record the keys that the live routes are accepted with, so that a
+// restart does not restore routes that the current keys would reject.
+//
+static void hp_redirect_share_keys (void) {
+
+    int i;
+
+    if (!RedirectClients) return;
+    for (i = 0; i < IntermediateDecodeLength && i < REDIRECT_KEYS; ++i)
+        RedirectClients->key[i] = IntermediateDecode[i].fingerprint;
+    RedirectClients->keys = i;
+}
+
+// Restore the live routes and peers from the previous table, if any.
+// The permanent routes and peers come from the configuration. The
+// expirations are limited to what a new registration would get.
+//
+static void hp_redirect_restore (const SharedTable *table, off_t size) {
+
+    int i;
+    int routes = 0;
+    int peers = 0;
+    SharedTable *copy = 0;
+    uint32_t imported = 1; // Never the sequence of a consistent table.
+
+    // A table that was being written when the portal died is not
+    // consistent, and is ignored.
+    //
+    if (table == MAP_FAILED) return;
+    if (size < sizeof(SharedTable) ||
+        table->magic != HOUSEPORTALREGISTRY_MAGIC ||
+        table->size > size ||
+        !houseportalregistry_copy (table, &copy, &imported) ||
+        strcmp (copy->host, HostName)) {
+        if (copy) free (copy);
+        return;
+    }
+
+    time_t latest = RedirectNow + REDIRECT_LIFETIME;
+
+    if (!RedirectRestoreRoutes && copy->routes > 0) {
+        houselog_trace (HOUSE_WARNING, "HousePortal",
+                        "signature keys changed, live routes not restored");
+    }
+    const SharedRoute *route = houseportalregistry_routes (copy);
+    for (i = 0; RedirectRestoreRoutes && i < copy->routes; ++i, ++route) {
+        if (route->expiration <= RedirectNow) continue; // Permanent or expired.
+        const char *path = houseportalregistry_string (copy, route->path);
+        const char *target = houseportalregistry_string (copy, route->target);
+        const char *service =
+            houseportalregistry_string (copy, route->service);
+        if (path[0] != '/' || !target[0]) continue;
+        AddSingleRedirect (1, route->hide, target,
+                           service[0] ? service : 0, path);
+        int r = RedirectIndexFind (path, strlen(path));
+        if (r >= 0 && Redirections[r].expiration) {
+            if (route->expiration < latest)
+                Redirections[r].expiration = route->expiration;
+            routes += 1;
+        }
+    }
+
+    const SharedPeer *peer = houseportalregistry_peers (copy);
+    for (i = 0; i < copy->peers; ++i, ++peer) {
+        if (peer->expiration <= RedirectNow) continue; // Permanent or expired.
+        const char *name = houseportalregistry_string (copy, peer->name);
+        if (!name[0]) continue;
+        AddOnePeer (name,
+                    (peer->expiration < latest) ? peer->expiration : latest);
+        peers += 1;
+    }
+
+    free (copy);
+
+    if (routes || peers) {
+        houselog_event ("SYSTEM", "HousePortal", "RESTORED",
+                        "%d ROUTES, %d PEERS", routes, peers);
+    }
+}
+
+// Remember the source of a registration or subscription, so that it can
+// be asked to renew after a restart.
+//
+static void hp_redirect_client (void) {
+
+    int i;
+    int available = -1;
+    unsigned char address[sizeof(RedirectClients->client[0].address)];
+
+    if (!RedirectClients || RedirectWorker) return;
+
+    int length = hp_udp_source (address, sizeof(address));
+    if (length <= 0) return;
+
+    SharedClient *client = RedirectClients->client;
+    for (i = 0; i < RedirectClients->count; ++i) {
+        if (client[i].length == length &&
+            !memcmp (client[i].address, address, length)) break;
+        if (available < 0 && client[i].expiration < RedirectNow)
+            available = i;
+    }
+    if (i >= RedirectClients->count) {
+        if (available >= 0) {
+            i = available;
+        } else {
+            if (i >= REDIRECT_CLIENTS) return;
+            RedirectClients->count = i + 1;
+        }
+        memcpy (client[i].address, address, length);
+        client[i].length = length;
+    }
+    client[i].expiration = RedirectNow + REDIRECT_LIFETIME;
+}
+
+// Ask the clients known before the restart to send their full
+// registrations now, and to query the portal again. These are the same
+// messages as the responses to RENEW and WATCH, so that existing clients
+// react to them. This is done once the UDP sockets could be opened.
+//
+static void hp_redirect_wakeup (void) {
+
+    int i;
+    int count = 0;
+    char resend[64];
+    char changed[512];
+
+    if (!RedirectWakeup || !RedirectClients || PortalUdpPointsCount <= 0)
+        return;
+    RedirectWakeup = 0;
+
+    hp_redirect_refresh_generation ();
+    int resendlength =
+        snprintf (resend, sizeof(resend), "RESEND %ld", (long)RedirectNow);
+    int changedlength =
+        snprintf (changed, sizeof(changed), "CHANGED %ld %s %ld",
+                  (long)RedirectNow, HostName, RedirectGeneration);
+
+    for (i = 0; i < RedirectClients->count; ++i) {
+        const SharedClient *client = RedirectClients->client + i;
+        if (client->expiration < RedirectNow) continue;
+        hp_udp_sendto (client->address, client->length, resend, resendlength);
+        hp_udp_sendto (client->address, client->length, changed, changedlength);
+        count += 1;
+    }
+    houselog_trace (HOUSE_INFO, "HousePortal",
+                    "asked %d clients to renew", count);
+}
+
+// Renewals do not change the generation: the table is published again
+// periodically anyway, so that the expirations saved for a restart stay
+// current.
+//
+static void hp_redirect_republish (void) {
+    RedirectSharedForce = 1;
+}
+
+void hp_redirect_share (void) {
+
+    off_t size = 0;
+
+    if (RedirectShared) return;
+
+    const char *path = hp_redirect_clients_path ();
+    void *previous = hp_redirect_share_previous (path, &size);
+    hp_redirect_share_clients ((const SharedClients *)previous, size);
+    if (previous != MAP_FAILED) munmap (previous, size);
+
+    path = houseportalregistry_path (PortalPort);
+    previous = hp_redirect_share_previous (path, &size);
+    hp_redirect_restore ((const SharedTable *)previous, size);
+    if (previous != MAP_FAILED) munmap (previous, size);
+
+    void *shared = hp_redirect_share_file ();
+    if (shared == MAP_FAILED) {
+        shared = mmap (0, HOUSEPORTALREGISTRY_MAX, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        RedirectSharedFileSize = HOUSEPORTALREGISTRY_MAX;
+    }
+    if (shared == MAP_FAILED) {
+        houselog_trace (HOUSE_FAILURE, "HousePortal",
+                        "cannot create the shared table: %s", strerror(errno));
+        return;
+    }
+    RedirectShared = (SharedTable *)shared;
+
+    // Clients ignore the table until it is consistent: it is odd while
+    // the header is written.
+    RedirectShared->sequence |= 1;
+    __sync_synchronize ();
+    RedirectShared->magic = HOUSEPORTALREGISTRY_MAGIC;
+    RedirectShared->size = sizeof(SharedTable);
+    RedirectShared->routes = 0;
+    RedirectShared->peers = 0;
+    RedirectShared->strings = 0;
+    hp_redirect_copy (RedirectShared->host, sizeof(RedirectShared->host),
+                      HostName);
+    RedirectShared->alive = RedirectNow;
+    RedirectShared->started = RedirectNow;
+    RedirectShared->generation = RedirectGeneration;
+    __sync_synchronize ();
+    RedirectShared->sequence += 1;
+
+    RedirectSharedForce = 1;
+
+    hp_redirect_export ();
+}
+
+// Make the table large enough for the specified content. The file must
+// grow before the new size is published, so that the clients never access
+// a page beyond the end of the file.
+//
+static int hp_redirect_share_grow (uint64_t needed) {
+
+    if (needed <= RedirectShared->size) return 1;
+    if (needed > HOUSEPORTALREGISTRY_MAX) return 0;
+
+    uint64_t size = (uint64_t)RedirectShared->size * 2;
+    if (size < needed) size = needed;
+    if (size > HOUSEPORTALREGISTRY_MAX) size = HOUSEPORTALREGISTRY_MAX;
+
+    if (RedirectSharedFd >= 0 && size > RedirectSharedFileSize) {
+        if (ftruncate (RedirectSharedFd, size)) {
+            houselog_trace (HOUSE_FAILURE, "HousePortal",
+                            "cannot grow the registry: %s", strerror(errno));
+            return 0;
+        }
+        RedirectSharedFileSize = size;
+    }
+    __sync_synchronize ();
+    RedirectShared->size = size;
+    return 1;
+}
+
+// Select the peers, then the routes, that fit within the specified size.
+// All the peers and routes normally fit: this is only a safeguard.
+//
+static uint64_t hp_redirect_share_fit (uint64_t limit,
+                                       int *routes, int *peers) {
+
+    int i;
+    uint64_t used = sizeof(SharedTable) + 1; // The empty string.
+
+    for (i = 0; i < PeerCount; ++i) {
+        uint64_t cost = sizeof(SharedPeer) + strlen(Peers[i].name) + 1;
+        if (used + cost > limit) break;
+        used += cost;
+    }
+    *peers = i;
+
+    for (i = 0; i < RedirectionCount; ++i) {
+        const HttpRedirection *r = Redirections + i;
+        uint64_t cost = sizeof(SharedRoute)
+                        + strlen(r->path) + strlen(r->target) + 2;
+        if (r->service) cost += strlen(r->service) + 1;
+        if (used + cost > limit) break;
+        used += cost;
+    }
+    *routes = i;
+    return used;
+}
+
+static uint32_t hp_redirect_share_string (char *area, uint32_t *offset,
+                                          const char *text) {
+    uint32_t start = *offset;
+    int length = strlen(text) + 1;
+    memcpy (area + start, text, length);
+    *offset += length;
+    return start;
+}
+
+static void hp_redirect_export (void) {
+
+    int i;
+    int routes, peers;
+
+    if (!RedirectShared || RedirectWorker) return;
+    RedirectShared->alive = RedirectNow; // Tell the clients we are alive.
+    hp_redirect_refresh_generation ();
+    if (!RedirectSharedForce &&
+        RedirectShared->generation == RedirectGeneration) return;
+    RedirectSharedForce = 0;
+
+    uint64_t used =
+        hp_redirect_share_fit (HOUSEPORTALREGISTRY_MAX, &routes, &peers);
+    if (!hp_redirect_share_grow (used))
+        hp_redirect_share_fit (RedirectShared->size, &routes, &peers);
+
+    int dropped = (RedirectionCount - routes) + (PeerCount - peers);
+    if (dropped != RedirectSharedDropped) {
+        if (dropped > 0) {
+            houselog_trace (HOUSE_FAILURE, "HousePortal",
+                            "registry full: %d routes, %d peers not shared",
+                            RedirectionCount - routes, PeerCount - peers);
+            houselog_metrics_count (MetricSharedDropped, dropped);
+        }
+        RedirectSharedDropped = dropped;
+    }
+
+    RedirectShared->sequence += 1; // Odd: writing.
+    __sync_synchronize ();
+
+    // The arrays move when the counts change: set the counts first.
+    RedirectShared->routes = routes;
+    RedirectShared->peers = peers;
+    SharedRoute *route =
+        (SharedRoute *)houseportalregistry_routes (RedirectShared);
+    SharedPeer *peer =
+        (SharedPeer *)houseportalregistry_peers (RedirectShared);
+    char *area = (char *)(peer + peers);
+    uint32_t offset = 1;
+    area[0] = 0;
+
+    for (i = 0; i < routes; ++i, ++route) {
+        const HttpRedirection *r = Redirections + i;
+        route->path = hp_redirect_share_string (area, &offset, r->path);
+        route->target = hp_redirect_share_string (area, &offset, r->target);
+        route->service =
+            r->service ? hp_redirect_share_string (area, &offset, r->service)
+                       : 0;
+        route->hide = r->hide;
+        route->expiration = r->expiration;
+    }
+
+    for (i = 0; i < peers; ++i, ++peer) {
+        peer->name = hp_redirect_share_string (area, &offset, Peers[i].name);
+        peer->expiration = Peers[i].expiration;
+    }
+    RedirectShared->strings = offset;
+    RedirectShared->generation = RedirectGeneration;
+
+    __sync_synchronize ();
+    RedirectShared->sequence += 1; // Even: consistent.
+}
+
+// Copy the shared table, then check that it did not change meanwhile.
+// If it did, the import will be attempted again on the next call.
+//
+static int hp_redirect_snapshot (void) {
+    return houseportalregistry_copy (RedirectShared, &RedirectSharedCopy,
+                                     &RedirectSharedImported);
+}
+
+static void hp_redirect_import (void) {
+
+    int i;
+
+    if (!RedirectShared || !RedirectWorker) return;
+    if (!hp_redirect_snapshot ()) return;
+
+    SharedTable *copy = RedirectSharedCopy;
+
+    // The path strings are kept: they are shared with the echttp routes.
+    for (i = 0; i < RedirectionCount; ++i) {
+        free (Redirections[i].target);
+        if (Redirections[i].service) free (Redirections[i].service);
+    }
+    for (i = 0; i < REDIRECT_HASH; ++i) RedirectionIndex[i] = -1;
+
+    if (copy->routes > RedirectionSize) {
+        RedirectionSize = copy->routes + 64;
+        Redirections = realloc (Redirections,
+                                RedirectionSize*sizeof(HttpRedirection));
+    }
+    const SharedRoute *route = houseportalregistry_routes (copy);
+    for (i = 0; i < copy->routes; ++i, ++route) {
+        HttpRedirection *r = Redirections + i;
+        const char *path = houseportalregistry_string (copy, route->path);
+        const char *service =
+            houseportalregistry_string (copy, route->service);
+        int length = strlen(path);
+        r->signature = RedirectSignature (path, length);
+        r->path = (char *)RedirectRoutedPath (path, length, r->signature);
+        r->length = length;
+        r->target = strdup (houseportalregistry_string (copy, route->target));
+        r->service = service[0] ? strdup (service) : 0;
+        r->hide = route->hide;
+        r->expiration = route->expiration;
+        RedirectIndexAdd (i);
+    }
+    RedirectionCount = copy->routes;
+
+    for (i = 0; i < PeerCount; ++i) free (Peers[i].name);
+    if (copy->peers > PeerSize) {
+        PeerSize = copy->peers + 16;
+        Peers = realloc (Peers, PeerSize*sizeof(PortalPeers));
+    }
+    const SharedPeer *peer = houseportalregistry_peers (copy);
+    for (i = 0; i < copy->peers; ++i, ++peer) {
+        memset (Peers + i, 0, sizeof(PortalPeers));
+        Peers[i].name = strdup (houseportalregistry_string (copy, peer->name));
+        Peers[i].expiration = peer->expiration;
+    }
+    PeerCount = copy->peers;
+
+    RedirectGeneration = copy->generation;
+    RedirectRenewals += 1; // The expirations may have changed.
+    DEBUG printf ("Imported generation %ld: %d routes, %d peers\n",
+                  RedirectGeneration, RedirectionCount, PeerCount);
+}
+
+void hp_redirect_worker (void) {
+
+    if (!RedirectShared) return;
+
+    RedirectWorker = 1;
+    while (PortalUdpPointsCount > 0) {
+        int fd = PortalUdpPoints[--PortalUdpPointsCount];
+        echttp_forget (fd);
+        close (fd);
+    }
+    if (RedirectSharedFd >= 0) {
+        close (RedirectSharedFd); // The workers never grow the table.
+        RedirectSharedFd = -1;
+    }
+    RedirectSharedCopy = 0;
+    RedirectSharedImported = 0;
+    hp_redirect_import ();
 }
 
 void hp_redirect_start (int argc, const char **argv) {
 
     int i;
+    const char *batch;
 
     char hostname[1000];
 
     gethostname (hostname, sizeof(hostname));
     HostName = strdup(hostname);
 
+    RedirectNow = time(0);
+    RedirectGeneration = (long)RedirectNow; // Unique across restarts.
+    for (i = 0; i < REDIRECT_HASH; ++i) {
+        RedirectionIndex[i] = -1;
+        RoutedPathIndex[i] = -1;
+    }
+
     for (i = 1; i < argc; ++i) {
         echttp_option_match ("-config=", argv[i], &ConfigurationPath);
         echttp_option_match ("-portal-port=", argv[i], &PortalPort);
+        if (echttp_option_match ("-udp-batch=", argv[i], &batch)) {
+            hp_udp_batch (atoi(batch));
+        }
     }
 
+    MetricRedirectFound = houselog_metrics_counter ("redirect.found");
+    MetricRedirectMissed = houselog_metrics_counter ("redirect.missed");
+    MetricRedirectLookup = houselog_metrics_latency ("redirect.lookup");
+    MetricUdpReceived = houselog_metrics_counter ("udp.received");
+    MetricUdpRejected = houselog_metrics_counter ("udp.rejected");
+    MetricUdpDropped = houselog_metrics_counter ("udp.dropped");
+    MetricUdpVerify = houselog_metrics_latency ("udp.verify");
+    MetricGossipMessages = houselog_metrics_counter ("gossip.messages");
+    MetricGossipBytes = houselog_metrics_counter ("gossip.bytes");
+    MetricJsonRequests = houselog_metrics_counter ("json.requests");
+    MetricJsonRendered = houselog_metrics_counter ("json.rendered");
+    MetricSharedDropped = houselog_metrics_counter ("registry.dropped");
+
+    PeerVersion = (long)RedirectNow;
     AddOnePeer (HostName, 0); // List ourself first.
-    LoadConfig (ConfigurationPath);
+    if (LoadConfig (ConfigurationPath)) exit(1);
 
     hp_redirect_open();
+    hp_redirect_share ();
+    hp_redirect_wakeup ();
 }
 
@@ -37,10 +37,41 @@
  *
  *    Receive a UDP packet. Returns the length of the data, or -1.
  *
+ * void hp_udp_batch (int size);
+ *
+ *    Set the maximum number of UDP packets received at once by
+ *    hp_udp_receive_batch(). A size of 1 disables batching.
+ *
+ * int hp_udp_receive_batch (int socket, hp_udp_consumer *consumer);
+ *
+ *    Receive all pending UDP packets, up to the batch size, using a single
+ *    system call, then call the consumer for each packet received. The
+ *    source of each packet becomes the current source before the consumer
+ *    is called, so that hp_udp_response() can be used. The data is null
+ *    terminated. Returns the number of packets received, or -1.
+ *
+ * void hp_udp_statistics (long *received, long *dropped, int *depth);
+ *
+ *    Return the total number of packets received, the number of packets
+ *    dropped (by the kernel because the receive buffer was full, or
+ *    because the packet was too large) and the deepest batch received.
+ *
  * void hp_udp_response (const char *data, int length)
  *
  *    Send a data packet to the source address of the last received message.
  *
+ * int hp_udp_source (void *address, int size);
+ *
+ *    Copy the source address of the last received message. Return the
+ *    length of the address, or 0 if it does not fit.
+ *
+ * void hp_udp_sendto (const void *address, int length,
+ *                     const char *data, int size);
+ *
+ *    Send a data packet to an address returned by hp_udp_source(), using
+ *    the server socket for the same address family. This is used to reach
+ *    the clients known before the portal restarted.
+ *
  * void hp_udp_broadcast (const char *data, int length) {
  *
  *    Send a broadcast packet. Uses IPv4 only (no broadcast on IPv6).
@@ -49,7 +80,20 @@
  *
  *    Send a unicast packet to the specified destination. This might send
  *    the packet multiple times if the destination name matches multiple
- *    addresses, including IPv4 and IPv6 addresses.
+ *    addresses, including IPv4 and IPv6 addresses. The destination name
+ *    is resolved in the background: the packet is not sent if the name
+ *    has not been resolved yet.
+ *
+ * int hp_udp_subscribe (time_t expiration);
+ *
+ *    Record the source address of the last received message as a
+ *    subscriber to notifications, until the specified expiration time.
+ *    Only local (loopback) sources are accepted. Return 1 on success, 0
+ *    if the subscription was refused.
+ *
+ * void hp_udp_notify (const char *data, int length, time_t now);
+ *
+ *    Send a data packet to all current subscribers.
  *
  * int hp_udp_has_broadcast (void);
  *
@@ -62,7 +106,10 @@
  * Only supports local broadcast (address 255.255.255.255).
  */
 
+#define _GNU_SOURCE // For recvmmsg().
+
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -76,6 +123,7 @@
 
 #include "houseportal.h"
 #include "houselog.h"
+#include "houseportalresolve.h"
 
 static union {
     struct sockaddr_in  ipv4;
@@ -89,8 +137,52 @@ static const char *UdpService = 0;
 
 static int Ipv6UdpSocket = -1;
 static int BroadcastUdpSocket = -1;
+
+static int UdpServerSocket[2] = {-1, -1}; // IPv4, IPv6, local or not.
 static struct sockaddr_in BroadcastAddress;
 
+// The preallocated ring of buffers used to receive packets in batches.
+//
+#define UDP_BATCH_MAX 64
+#define UDP_PACKET_MAX 1500
+
+static int UdpBatchSize = 32;
+
+static char UdpBatchData[UDP_BATCH_MAX][UDP_PACKET_MAX+1];
+static struct iovec UdpBatchIo[UDP_BATCH_MAX];
+static struct mmsghdr UdpBatchHeader[UDP_BATCH_MAX];
+static union {
+    struct sockaddr_in  ipv4;
+    struct sockaddr_in6 ipv6;
+} UdpBatchSource[UDP_BATCH_MAX];
+static char UdpBatchControl[UDP_BATCH_MAX][CMSG_SPACE(sizeof(uint32_t))];
+
+// The subscribers to notifications (see hp_udp_subscribe()).
+//
+#define UDP_MAX_SUBSCRIBERS 64
+static struct {
+    union {
+        struct sockaddr_in  ipv4;
+        struct sockaddr_in6 ipv6;
+    } address;
+    unsigned int length;
+    int socket;
+    time_t expiration;
+} UdpSubscribers[UDP_MAX_SUBSCRIBERS];
+static int UdpSubscribersCount = 0;
+
+static long UdpStatsReceived = 0;
+static long UdpStatsDropped = 0;
+static int  UdpStatsDepth = 0;
+
+// The kernel reports a cumulative count of dropped packets per socket.
+//
+#define UDP_DROP_TRACKING 8
+static struct {
+    int socket;
+    uint32_t dropped;
+} UdpDropTracking[UDP_DROP_TRACKING];
+
 
 int hp_udp_server (const char *service, int local, int *sockets, int size) {
 
@@ -116,6 +208,7 @@ int hp_udp_server (const char *service, int local, int *sockets, int size) {
         close(BroadcastUdpSocket);
         BroadcastUdpSocket = -1;
     }
+    UdpServerSocket[0] = UdpServerSocket[1] = -1;
 
     hints.ai_flags = (local?0:AI_PASSIVE) | AI_ADDRCONFIG;
     hints.ai_family = AF_UNSPEC;
@@ -192,6 +285,12 @@ int hp_udp_server (const char *service, int local, int *sockets, int size) {
                             "Cannot set send buffer to %d: %s",
                             value, strerror(errno));
         }
+        value = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &value, sizeof(value)) < 0) {
+            houselog_trace (HOUSE_FAILURE, "HousePortal",
+                            "Cannot track dropped packets: %s",
+                            strerror(errno));
+        }
 
         if (!local && cursor->ai_family == AF_INET) {
             value = 1;
@@ -208,6 +307,7 @@ int hp_udp_server (const char *service, int local, int *sockets, int size) {
         if (!local && cursor->ai_family == AF_INET6) {
             Ipv6UdpSocket = s;
         }
+        UdpServerSocket[(cursor->ai_family == AF_INET6) ? 1 : 0] = s;
 
         houselog_trace (HOUSE_INFO, "HousePortal",
                         "UDP socket port %s is open (%s)",
@@ -229,10 +329,99 @@ int hp_udp_has_broadcast (void) {
 int hp_udp_receive (int socket, char *buffer, int size) {
 
     UdpReceivedSocket = socket;
-    return recvfrom (socket, buffer, size, 0,
-		             (struct sockaddr *)(&UdpReceived), &UdpReceivedLength);
+    UdpReceivedLength = sizeof(UdpReceived);
+    int length = recvfrom (socket, buffer, size, 0,
+                           (struct sockaddr *)(&UdpReceived),
+                           &UdpReceivedLength);
+    if (length > 0) UdpStatsReceived += 1;
+    return length;
+}
+
+void hp_udp_batch (int size) {
+    if (size < 1) size = 1;
+    if (size > UDP_BATCH_MAX) size = UDP_BATCH_MAX;
+    UdpBatchSize = size;
+}
+
+static void hp_udp_dropped (int socket, struct msghdr *header) {
+
+    int i;
+    struct cmsghdr *control;
+
+    for (control = CMSG_FIRSTHDR(header);
+         control; control = CMSG_NXTHDR(header, control)) {
+
+        if (control->cmsg_level != SOL_SOCKET) continue;
+        if (control->cmsg_type != SO_RXQ_OVFL) continue;
+
+        uint32_t dropped;
+        memcpy (&dropped, CMSG_DATA(control), sizeof(dropped));
+
+        int available = -1;
+        for (i = 0; i < UDP_DROP_TRACKING; ++i) {
+            if (UdpDropTracking[i].socket == socket + 1) break;
+            if (available < 0 && UdpDropTracking[i].socket == 0) available = i;
+        }
+        if (i >= UDP_DROP_TRACKING) {
+            if (available < 0) return;
+            i = available;
+            UdpDropTracking[i].socket = socket + 1; // Avoid 0 as a valid value.
+            UdpDropTracking[i].dropped = 0;
+        }
+        UdpStatsDropped += (long)(dropped - UdpDropTracking[i].dropped);
+        UdpDropTracking[i].dropped = dropped;
+    }
+}
+
+int hp_udp_receive_batch (int socket, hp_udp_consumer *consumer) {
+
+    int i;
+    int count;
+
+    for (i = 0; i < UdpBatchSize; ++i) {
+        UdpBatchIo[i].iov_base = UdpBatchData[i];
+        UdpBatchIo[i].iov_len = UDP_PACKET_MAX;
+        UdpBatchHeader[i].msg_hdr.msg_name = &(UdpBatchSource[i]);
+        UdpBatchHeader[i].msg_hdr.msg_namelen = sizeof(UdpBatchSource[i]);
+        UdpBatchHeader[i].msg_hdr.msg_iov = UdpBatchIo + i;
+        UdpBatchHeader[i].msg_hdr.msg_iovlen = 1;
+        UdpBatchHeader[i].msg_hdr.msg_control = UdpBatchControl[i];
+        UdpBatchHeader[i].msg_hdr.msg_controllen = sizeof(UdpBatchControl[i]);
+        UdpBatchHeader[i].msg_hdr.msg_flags = 0;
+    }
+
+    count = recvmmsg (socket, UdpBatchHeader, UdpBatchSize, MSG_DONTWAIT, 0);
+    if (count <= 0) return -1;
+
+    UdpStatsReceived += count;
+    if (count > UdpStatsDepth) UdpStatsDepth = count;
+    DEBUG printf ("Received a batch of %d packets\n", count);
+
+    // The drop count is the same in all packets of a batch: it reflects
+    // the state of the socket when the system call was made.
+    //
+    hp_udp_dropped (socket, &(UdpBatchHeader[count-1].msg_hdr));
+
+    UdpReceivedSocket = socket;
+    for (i = 0; i < count; ++i) {
+        int length = UdpBatchHeader[i].msg_len;
+        if (UdpBatchHeader[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            UdpStatsDropped += 1;
+            continue;
+        }
+        UdpBatchData[i][length] = 0;
+        memcpy (&UdpReceived, UdpBatchSource+i, sizeof(UdpReceived));
+        UdpReceivedLength = UdpBatchHeader[i].msg_hdr.msg_namelen;
+        consumer (UdpBatchData[i], length);
+    }
+    return count;
 }
 
+void hp_udp_statistics (long *received, long *dropped, int *depth) {
+    *received = UdpStatsReceived;
+    *dropped = UdpStatsDropped;
+    *depth = UdpStatsDepth;
+}
 
 void hp_udp_response (const char *data, int length) {
 
@@ -240,6 +429,83 @@ void hp_udp_response (const char *data, int length) {
             (struct sockaddr *)(&UdpReceived), UdpReceivedLength);
 }
 
+int hp_udp_source (void *address, int size) {
+
+    if (UdpReceivedLength <= 0 || UdpReceivedLength > size) return 0;
+    memcpy (address, &UdpReceived, UdpReceivedLength);
+    return UdpReceivedLength;
+}
+
+void hp_udp_sendto (const void *address, int length,
+                    const char *data, int size) {
+
+    const struct sockaddr *destination = (const struct sockaddr *)address;
+    if (length < sizeof(struct sockaddr_in)) return;
+
+    int s = UdpServerSocket[(destination->sa_family == AF_INET6) ? 1 : 0];
+    if (s < 0) return;
+    sendto (s, data, size, 0, destination, length);
+}
+
+static int hp_udp_source_is_local (void) {
+
+    if (UdpReceived.ipv4.sin_family == AF_INET) {
+        return (ntohl(UdpReceived.ipv4.sin_addr.s_addr) >> 24) == 127;
+    }
+    if (UdpReceived.ipv6.sin6_family == AF_INET6) {
+        const struct in6_addr *a = &(UdpReceived.ipv6.sin6_addr);
+        if (IN6_IS_ADDR_LOOPBACK(a)) return 1;
+        if (IN6_IS_ADDR_V4MAPPED(a)) return a->s6_addr[12] == 127;
+    }
+    return 0;
+}
+
+int hp_udp_subscribe (time_t expiration) {
+
+    int i;
+    int available = -1;
+    time_t now = time(0);
+
+    if (!hp_udp_source_is_local ()) return 0;
+
+    for (i = 0; i < UdpSubscribersCount; ++i) {
+        if (UdpSubscribers[i].length == UdpReceivedLength &&
+            !memcmp (&(UdpSubscribers[i].address),
+                     &UdpReceived, UdpReceivedLength)) break;
+        if (available < 0 && UdpSubscribers[i].expiration < now)
+            available = i;
+    }
+    if (i >= UdpSubscribersCount) {
+        if (available >= 0) {
+            i = available;
+        } else {
+            if (UdpSubscribersCount >= UDP_MAX_SUBSCRIBERS) return 0;
+            i = UdpSubscribersCount++;
+        }
+        memcpy (&(UdpSubscribers[i].address), &UdpReceived, UdpReceivedLength);
+        UdpSubscribers[i].length = UdpReceivedLength;
+    }
+    UdpSubscribers[i].socket = UdpReceivedSocket;
+    UdpSubscribers[i].expiration = expiration;
+    return 1;
+}
+
+void hp_udp_notify (const char *data, int length, time_t now) {
+
+    int i;
+
+    for (i = 0; i < UdpSubscribersCount; ++i) {
+        if (UdpSubscribers[i].expiration < now) continue;
+        sendto (UdpSubscribers[i].socket, data, length, 0,
+                (struct sockaddr *)(&(UdpSubscribers[i].address)),
+                UdpSubscribers[i].length);
+    }
+    while (UdpSubscribersCount > 0 &&
+           UdpSubscribers[UdpSubscribersCount-1].expiration < now) {
+        UdpSubscribersCount -= 1;
+    }
+}
+
 void hp_udp_broadcast (const char *data, int length) {
 
     if (BroadcastUdpSocket < 0) return;
@@ -251,16 +517,17 @@ void hp_udp_broadcast (const char *data, int length) {
 
 void hp_udp_unicast (const char *destination, const char *data, int length) {
 
-    struct addrinfo hints = {0};
-    struct addrinfo *resolved;
-    struct addrinfo *cursor;
+    const struct addrinfo *cursor;
 
-    hints.ai_flags = AI_ADDRCONFIG;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-    if (getaddrinfo (destination, UdpService, &hints, &resolved)) return;
+    if (!UdpService) return;
 
-    for (cursor = resolved; cursor; cursor = cursor->ai_next) {
+    cursor = houseportalresolve (destination, UdpService);
+    if (!cursor) {
+        DEBUG printf ("%s not resolved yet\n", destination);
+        return;
+    }
+
+    for (; cursor; cursor = cursor->ai_next) {
 
         if (cursor->ai_family == AF_INET && BroadcastUdpSocket >= 0) {
             DEBUG printf ("IPv4 to %s:%s\n", destination, UdpService);
@@ -272,6 +539,5 @@ void hp_udp_unicast (const char *destination, const char *data, int length) {
                     cursor->ai_addr, cursor->ai_addrlen);
         }
     }
-    freeaddrinfo (resolved);
 }
 
@@ -0,0 +1,198 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * hp_worker.c - Run the HTTP server in multiple processes.
+ *
+ * SYNOPSYS:
+ *
+ * int hp_worker_start (int argc, const char **argv);
+ *
+ *    Create the worker processes requested using the -workers=N option.
+ *    The N processes, including the original one, all accept the HTTP
+ *    requests from the same listening socket. The original process
+ *    (the owner) is the only one that receives the UDP messages: it
+ *    publishes the redirect and peer databases to the workers through
+ *    a shared table (see hp_redirect_share()). Return 0 in the owner
+ *    process, or the worker's index (1 to N-1) in a worker process.
+ *
+ *    This must be called after hp_redirect_start(), and before entering
+ *    the echttp loop.
+ *
+ *    The metrics of all processes are shared, so that the metrics page
+ *    reports the same totals whichever process serves the request.
+ *
+ *    The workers are created, and restarted when they die, by a supervisor
+ *    process forked before the echttp loop starts. A restarted worker is
+ *    thus a copy of a process that never had any HTTP client connection:
+ *    forking from the owner would share the owner's client connections
+ *    with the new worker. The supervisor does nothing else: the new worker
+ *    logs its own restart.
+ *
+ * void hp_worker_background (time_t now);
+ *
+ *    Detect that the supervisor died, which also terminates the workers.
+ *    The owner then continues alone. This is called periodically, and does
+ *    nothing in a worker process.
+ */
+
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "houseportal.h"
+#include "houselog.h"
+#include "houselog_metrics.h"
+
+#define MAX_WORKERS 16
+
+static pid_t WorkerPid[MAX_WORKERS];
+static int   WorkerCount = 0;
+static int   WorkerIndex = 0; // 0: owner, or not using workers.
+
+static pid_t WorkerSupervisor = 0;
+static pid_t WorkerDiedPid = 0; // The worker replaced by this one, if any.
+
+// All processes wait on the same listening socket, but only one gets each
+// new connection: the listening socket must not block the other ones.
+//
+static void hp_worker_nonblocking (void) {
+
+    int fd;
+    for (fd = 3; fd < 1024; ++fd) {
+        int listening = 0;
+        socklen_t size = sizeof(listening);
+        if (getsockopt (fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size))
+            continue;
+        if (!listening) continue;
+        fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+static pid_t hp_worker_fork (int index) {
+
+    pid_t pid = fork ();
+    if (pid < 0) {
+        houselog_trace (HOUSE_FAILURE, "portal",
+                        "cannot create worker %d: %s", index, strerror(errno));
+        return 0;
+    }
+    if (pid == 0) {
+        prctl (PR_SET_PDEATHSIG, SIGTERM); // Do not survive the supervisor.
+        WorkerIndex = index;
+        WorkerCount = 0;
+        houselog_metrics_process (index);
+        hp_redirect_worker ();
+        if (WorkerDiedPid) {
+            houselog_event ("WORKER", "portal", "RESTARTED",
+                            "WORKER %d (PID %d) DIED", index, (int)WorkerDiedPid);
+        }
+        return 0;
+    }
+    return pid;
+}
+
+// The supervisor only waits for its workers to die, and replaces them.
+// It returns only in a new worker process, with the worker's index.
+//
+static int hp_worker_supervise (void) {
+
+    int i;
+
+    for (i = 1; i < WorkerCount; ++i) {
+        WorkerPid[i] = hp_worker_fork (i);
+        if (WorkerIndex) return WorkerIndex;
+    }
+
+    for (;;) {
+        int status;
+        pid_t pid = waitpid (-1, &status, 0);
+        if (pid < 0) {
+            if (errno != EINTR) sleep (1);
+            continue;
+        }
+        for (i = 1; i < WorkerCount; ++i) {
+            if (WorkerPid[i] != pid) continue;
+            sleep (1); // Do not spin if the worker dies on startup.
+            WorkerDiedPid = pid;
+            WorkerPid[i] = hp_worker_fork (i);
+            if (WorkerIndex) return WorkerIndex; // This is the new worker.
+            break;
+        }
+    }
+}
+
+int hp_worker_start (int argc, const char **argv) {
+
+    int i;
+    const char *value = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-workers=", argv[i], &value);
+    }
+    if (!value) return 0;
+
+    int count = atoi (value);
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+    if (count <= 1) return 0;
+
+    hp_redirect_share ();
+    hp_worker_nonblocking ();
+    houselog_metrics_share (count);
+
+    WorkerCount = count;
+    WorkerSupervisor = fork ();
+    if (WorkerSupervisor < 0) {
+        houselog_trace (HOUSE_FAILURE, "portal",
+                        "cannot create the supervisor: %s", strerror(errno));
+        WorkerSupervisor = 0;
+        WorkerCount = 0;
+        return 0;
+    }
+    if (WorkerSupervisor == 0) {
+        prctl (PR_SET_PDEATHSIG, SIGTERM); // Do not survive the owner.
+        signal (SIGTERM, SIG_DFL); // Never runs the echttp loop.
+        return hp_worker_supervise ();
+    }
+    houselog_trace (HOUSE_INFO, "portal", "started %d workers", count - 1);
+    return 0;
+}
+
+void hp_worker_background (time_t now) {
+
+    static time_t LastCheck = 0;
+
+    if (WorkerIndex || !WorkerSupervisor) return;
+    if (now == LastCheck) return;
+    LastCheck = now;
+
+    int status;
+    if (waitpid (WorkerSupervisor, &status, WNOHANG) == WorkerSupervisor) {
+        houselog_event ("WORKER", "portal", "STOPPED",
+                        "SUPERVISOR (PID %d) DIED", (int)WorkerSupervisor);
+        WorkerSupervisor = 0;
+        WorkerCount = 0;
+    }
+}
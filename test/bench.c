@@ -0,0 +1,219 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * bench.c - Common tools for the houseportal benchmarks.
+ *
+ * SYNOPSYS:
+ *
+ * long long bench_clock (void);
+ *
+ *    Return the current monotonic time in nanoseconds.
+ *
+ * void bench_reset  (void);
+ * void bench_sample (long long nanoseconds);
+ * void bench_report (const char *name, long long elapsed);
+ *
+ *    Collect the duration of each operation, then print the number of
+ *    operations, the throughput (using the elapsed time of the whole run,
+ *    in nanoseconds) and the p50, p99 and maximum latencies.
+ *
+ * int bench_http_get (const char *host, const char *port, const char *path,
+ *                     char *buffer, int size);
+ *
+ *    Send a blocking HTTP GET request (one connection per request, so
+ *    that the cost of the connection is part of the measurement), and
+ *    return the HTTP status, or 0 on failure. The response, including
+ *    the header, is stored in the buffer if one is provided.
+ *
+ * int bench_key (const char *path, const char **cypher, const char **key);
+ *
+ *    Read a signature key file, using the same format as test.key: the
+ *    cypher name followed by the hexadecimal key. Return 1 on success.
+ *
+ * long long bench_metric (const char *json, const char *name);
+ *
+ *    Retrieve the value of a counter from the response to a /metrics
+ *    request, or the count of a latency histogram. Return 0 if the metric
+ *    is not present.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "bench.h"
+
+static long long *BenchSamples = 0;
+static int BenchSamplesCount = 0;
+static int BenchSamplesSize = 0;
+
+long long bench_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)(now.tv_sec) * 1000000000LL + now.tv_nsec;
+}
+
+void bench_reset (void) {
+    BenchSamplesCount = 0;
+}
+
+void bench_sample (long long nanoseconds) {
+
+    if (BenchSamplesCount >= BenchSamplesSize) {
+        BenchSamplesSize = BenchSamplesCount + 65536;
+        BenchSamples = realloc (BenchSamples,
+                                BenchSamplesSize*sizeof(long long));
+    }
+    BenchSamples[BenchSamplesCount++] = nanoseconds;
+}
+
+static int bench_compare (const void *a, const void *b) {
+    long long x = *((const long long *)a);
+    long long y = *((const long long *)b);
+    return (x < y) ? -1 : (x > y);
+}
+
+static double bench_percentile (int percent) {
+    int i = (int)(((long long)BenchSamplesCount * percent) / 100);
+    if (i >= BenchSamplesCount) i = BenchSamplesCount - 1;
+    return BenchSamples[i] / 1000.0;
+}
+
+void bench_report (const char *name, long long elapsed) {
+
+    if (BenchSamplesCount <= 0 || elapsed <= 0) {
+        printf ("%-24s no sample\n", name);
+        return;
+    }
+    qsort (BenchSamples, BenchSamplesCount, sizeof(long long), bench_compare);
+
+    printf ("%-24s %9d ops %12.0f ops/s"
+                "  p50 %9.2f us  p99 %9.2f us  max %9.2f us\n",
+            name, BenchSamplesCount,
+            (BenchSamplesCount * 1000000000.0) / elapsed,
+            bench_percentile (50), bench_percentile (99),
+            BenchSamples[BenchSamplesCount-1] / 1000.0);
+    fflush (stdout);
+}
+
+static int bench_connect (const char *host, const char *port) {
+
+    struct addrinfo hints;
+    struct addrinfo *resolved;
+    struct addrinfo *cursor;
+    int fd = -1;
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (host, port, &hints, &resolved)) return -1;
+
+    for (cursor = resolved; cursor; cursor = cursor->ai_next) {
+        fd = socket (cursor->ai_family, cursor->ai_socktype, 0);
+        if (fd < 0) continue;
+        if (connect (fd, cursor->ai_addr, cursor->ai_addrlen) == 0) break;
+        close (fd);
+        fd = -1;
+    }
+    freeaddrinfo (resolved);
+    return fd;
+}
+
+int bench_http_get (const char *host, const char *port, const char *path,
+                    char *buffer, int size) {
+
+    char local[1024];
+    if (!buffer) {
+        buffer = local;
+        size = sizeof(local);
+    }
+    int fd = bench_connect (host, port);
+    if (fd < 0) return 0;
+
+    int length = snprintf (buffer, size,
+                           "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                               "Connection: close\r\n\r\n", path, host);
+    if (send (fd, buffer, length, MSG_NOSIGNAL) != length) {
+        close (fd);
+        return 0;
+    }
+
+    // Read the whole response: the portal closes the connection after it.
+    // Only the beginning is kept if the buffer is too small.
+    //
+    length = 0;
+    for (;;) {
+        int received;
+        if (length < size - 1) {
+            received = recv (fd, buffer+length, size-length-1, 0);
+            if (received > 0) length += received;
+        } else {
+            char discard[4096];
+            received = recv (fd, discard, sizeof(discard), 0);
+        }
+        if (received <= 0) break;
+    }
+    close (fd);
+    buffer[length] = 0;
+
+    if (strncmp (buffer, "HTTP/1.", 7)) return 0;
+    const char *code = strchr (buffer, ' ');
+    return code ? atoi (code + 1) : 0;
+}
+
+int bench_key (const char *path, const char **cypher, const char **key) {
+
+    static char buffer[512];
+
+    FILE *f = fopen (path, "r");
+    if (!f) return 0;
+    int ok = (fgets (buffer, sizeof(buffer), f) != 0);
+    fclose (f);
+    if (!ok) return 0;
+
+    char *p = strchr (buffer, '\n');
+    if (p) *p = 0;
+    p = strchr (buffer, ' ');
+    if (!p) return 0;
+    *(p++) = 0;
+    *cypher = buffer;
+    *key = p;
+    return 1;
+}
+
+long long bench_metric (const char *json, const char *name) {
+
+    char pattern[128];
+    snprintf (pattern, sizeof(pattern), "\"%s\":", name);
+    const char *value = strstr (json, pattern);
+    if (!value) return 0;
+    value += strlen(pattern);
+    if (*value == '{') {
+        value = strstr (value, "\"count\":");
+        if (!value) return 0;
+        value += 8;
+    }
+    return atoll (value);
+}
@@ -0,0 +1,35 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * bench.h - Common tools for the houseportal benchmarks.
+ */
+
+long long bench_clock (void);
+
+void bench_reset  (void);
+void bench_sample (long long nanoseconds);
+void bench_report (const char *name, long long elapsed);
+
+int bench_http_get (const char *host, const char *port, const char *path,
+                    char *buffer, int size);
+
+int bench_key (const char *path, const char **cypher, const char **key);
+
+long long bench_metric (const char *json, const char *name);
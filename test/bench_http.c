@@ -0,0 +1,234 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * bench_http.c - Measure the portal's HTTP redirection performance.
+ *
+ * SYNOPSYS:
+ *
+ * bench_http [-portal=HOST] [-http-port=N] [-services=N] [-requests=N]
+ *            [-concurrency=N] [-key=FILE] [-no-register]
+ *
+ *    Register N services with the portal (50 by default) using the
+ *    houseportal client API, then send GET requests to the portal using
+ *    a mix of paths that resembles a home network's traffic: mostly deep
+ *    paths under a registered route, some exact routes, some unknown paths
+ *    and some requests to the portal's own JSON API. Each request uses
+ *    a new connection. The requests are shared between the specified
+ *    number of concurrent processes.
+ *
+ *    The throughput and latencies are reported for each kind of path and
+ *    for the whole run, followed by a count of the HTTP status returned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "echttp.h"
+
+#include "houseportalclient.h"
+
+#include "bench.h"
+
+static const char *PortalHost = "localhost";
+static const char *HttpPort = "80";
+
+static int Services = 50;
+static int Requests = 10000;
+static int Concurrency = 4;
+
+// The mix of paths, in percent of all requests.
+//
+#define BENCH_PATH_DEEP    0
+#define BENCH_PATH_EXACT   1
+#define BENCH_PATH_UNKNOWN 2
+#define BENCH_PATH_PORTAL  3
+#define BENCH_PATH_KINDS   4
+
+static const char *BenchPathName[BENCH_PATH_KINDS] = {
+    "http.deep", "http.exact", "http.unknown", "http.portal"
+};
+static const int BenchPathWeight[BENCH_PATH_KINDS] = {60, 20, 10, 10};
+
+struct BenchResult {
+    long long latency; // Nanoseconds.
+    short status;
+    char kind;
+};
+
+static struct BenchResult *Results = 0; // Shared with the child processes.
+
+static int bench_http_kind (unsigned int *seed) {
+    int kind;
+    int draw = rand_r (seed) % 100;
+    for (kind = 0; kind < BENCH_PATH_KINDS - 1; ++kind) {
+        draw -= BenchPathWeight[kind];
+        if (draw < 0) break;
+    }
+    return kind;
+}
+
+static void bench_http_path (int kind, unsigned int *seed,
+                             char *buffer, int size) {
+
+    int service = rand_r (seed) % Services;
+
+    switch (kind) {
+    case BENCH_PATH_DEEP:
+        snprintf (buffer, size, "/bench%d/path%d/status?since=%d",
+                  service, rand_r (seed) % 2, rand_r (seed) % 1000);
+        break;
+    case BENCH_PATH_EXACT:
+        snprintf (buffer, size, "/bench%d/path%d", service, rand_r (seed) % 2);
+        break;
+    case BENCH_PATH_UNKNOWN:
+        snprintf (buffer, size, "/nosuch%d/index.html", service);
+        break;
+    default:
+        snprintf (buffer, size, "/portal/list");
+    }
+}
+
+static void bench_http_run (int worker) {
+
+    char path[256];
+    char response[4096];
+    unsigned int seed = 12345 + worker;
+    int i;
+
+    for (i = worker; i < Requests; i += Concurrency) {
+        int kind = bench_http_kind (&seed);
+        bench_http_path (kind, &seed, path, sizeof(path));
+
+        long long start = bench_clock ();
+        int status =
+            bench_http_get (PortalHost, HttpPort, path,
+                            response, sizeof(response));
+        Results[i].latency = bench_clock () - start;
+        Results[i].status = status;
+        Results[i].kind = kind;
+    }
+}
+
+static void bench_http_register (int argc, const char **argv,
+                                 const char *keyfile) {
+
+    int i;
+
+    houseportal_initialize (argc, argv);
+    if (keyfile) {
+        const char *cypher;
+        const char *key;
+        if (!bench_key (keyfile, &cypher, &key)) {
+            fprintf (stderr, "invalid key file %s\n", keyfile);
+            exit (1);
+        }
+        houseportal_signature (cypher, key);
+    }
+    for (i = 0; i < Services; ++i) {
+        char path0[64];
+        char path1[64];
+        const char *paths[2] = {path0, path1};
+        snprintf (path0, sizeof(path0), "/bench%d/path0", i);
+        snprintf (path1, sizeof(path1), "/bench%d/path1", i);
+        houseportal_register_more (20000 + i, paths, 2);
+    }
+    houseportal_renew ();
+    sleep (1); // Let the portal process the registrations.
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    int kind;
+    const char *value;
+    const char *keyfile = 0;
+    int registration = 1;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-portal=", argv[i], &PortalHost);
+        echttp_option_match ("-http-port=", argv[i], &HttpPort);
+        echttp_option_match ("-key=", argv[i], &keyfile);
+        if (echttp_option_present ("-no-register", argv[i]))
+            registration = 0;
+        if (echttp_option_match ("-services=", argv[i], &value))
+            Services = atoi(value);
+        if (echttp_option_match ("-requests=", argv[i], &value))
+            Requests = atoi(value);
+        if (echttp_option_match ("-concurrency=", argv[i], &value))
+            Concurrency = atoi(value);
+    }
+    if (Services <= 0) Services = 1;
+    if (Requests <= 0) Requests = 1;
+    if (Concurrency <= 0) Concurrency = 1;
+
+    if (registration) bench_http_register (argc, argv, keyfile);
+
+    Results = mmap (0, Requests * sizeof(struct BenchResult),
+                    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (Results == MAP_FAILED) {
+        perror ("mmap");
+        return 1;
+    }
+    printf ("Sending %d requests to %s:%s (%d concurrent clients)\n",
+            Requests, PortalHost, HttpPort, Concurrency);
+    fflush (stdout); // Not to be repeated by the child processes.
+
+    long long start = bench_clock ();
+    for (i = 0; i < Concurrency; ++i) {
+        pid_t pid = fork ();
+        if (pid == 0) {
+            bench_http_run (i);
+            exit (0);
+        }
+        if (pid < 0) {
+            perror ("fork");
+            return 1;
+        }
+    }
+    while (wait (0) > 0) ;
+    long long elapsed = bench_clock () - start;
+
+    for (kind = 0; kind < BENCH_PATH_KINDS; ++kind) {
+        bench_reset ();
+        for (i = 0; i < Requests; ++i) {
+            if (Results[i].kind == kind) bench_sample (Results[i].latency);
+        }
+        bench_report (BenchPathName[kind], elapsed);
+    }
+    int statistics[6] = {0}; // Failed, 1xx, 2xx, 3xx, 4xx, 5xx.
+    bench_reset ();
+    for (i = 0; i < Requests; ++i) {
+        int class = Results[i].status / 100;
+        if (class < 0 || class > 5) class = 0;
+        statistics[class] += 1;
+        bench_sample (Results[i].latency);
+    }
+    bench_report ("http.all", elapsed);
+    printf ("%-24s %d 2xx, %d 3xx, %d 4xx, %d 5xx, %d failed\n", "http.status",
+            statistics[2], statistics[3],
+            statistics[4], statistics[5], statistics[0] + statistics[1]);
+    return 0;
+}
@@ -0,0 +1,99 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * bench_log.c - Microbenchmarks of the event log.
+ *
+ * SYNOPSYS:
+ *
+ * bench_log [-iterations=N]
+ *
+ *    Measure the recording of an event, and the generation of the JSON
+ *    event list (houselog_event_json) for a full history and for the few
+ *    most recent events, as requested by the web pages that poll for
+ *    new events.
+ *
+ *    This program includes houselog_live.c, so that the static functions
+ *    can be called directly. The events are never sent to storage.
+ */
+
+#include "../houselog_live.c"
+
+#include "bench.h"
+
+static int Iterations = 100000;
+
+static void bench_log_record (void) {
+
+    int i;
+
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < Iterations; ++i) {
+        long long t = bench_clock ();
+        houselog_event_local ("SENSOR", "kitchen", "CHANGED",
+                              "TEMPERATURE %d F", 60 + (i % 20));
+        bench_sample (bench_clock () - t);
+    }
+    bench_report ("event.record", bench_clock () - start);
+}
+
+static void bench_log_json (const char *name, int recent) {
+
+    int i;
+    long length = 0;
+    time_t now = time(0);
+
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < Iterations; ++i) {
+        long long t = bench_clock ();
+        const char *json =
+            houselog_event_json (now, EventLatestId - recent, 0);
+        bench_sample (bench_clock () - t);
+        if (i == 0) length = strlen(json);
+    }
+    bench_report (name, bench_clock () - start);
+    printf ("%-24s %ld bytes\n", name, length);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-iterations=", argv[i], &value))
+            Iterations = atoi(value);
+    }
+    if (Iterations < EVENT_DEPTH) Iterations = EVENT_DEPTH;
+
+    // Never flush: there is no storage service here.
+    //
+    EventStream = houselog_flush_register ("events", Iterations, Iterations,
+                                           3600);
+    gethostname (LocalHost, sizeof(LocalHost));
+    PortalHost = LocalHost;
+
+    printf ("%d iterations, %d events in history\n", Iterations, EVENT_DEPTH);
+    bench_log_record ();
+    bench_log_json ("event.json.full", EVENT_DEPTH);
+    bench_log_json ("event.json.recent", 5);
+    return 0;
+}
@@ -0,0 +1,236 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * bench_redirect.c - Microbenchmarks of the portal's internal functions.
+ *
+ * SYNOPSYS:
+ *
+ * bench_redirect [-routes=N] [-iterations=N] [-key=FILE]
+ *
+ *    Measure the route search (SearchBestRedirect), the signature of
+ *    a registration (houseportalhmac), the verification of a signed
+ *    registration and the full decoding of a registration message, using
+ *    N routes (1000 by default). The key file uses the format of test.key;
+ *    the key in test.key is used if none is provided.
+ *
+ *    This program includes hp_redirect.c, so that the static functions
+ *    can be called directly. No UDP socket is opened and no message is
+ *    sent: the registrations are submitted through the same function
+ *    as the UDP receiver's.
+ */
+
+#include "../hp_redirect.c"
+
+#include "bench.h"
+
+static int Routes = 1000;
+static int Iterations = 200000;
+
+static const char *BenchCypher = "SHA-256";
+static const char *BenchKey =
+    "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+
+static void bench_redirect_setup (void) {
+
+    int i;
+    char path[128];
+    char port[16];
+
+    HostName = "benchhost";
+    RedirectNow = time(0);
+    for (i = 0; i < REDIRECT_HASH; ++i) {
+        RedirectionIndex[i] = -1;
+        RoutedPathIndex[i] = -1;
+    }
+    for (i = 0; i < Routes; ++i) {
+        snprintf (path, sizeof(path), "/bench%d/path%d", i / 2, i % 2);
+        snprintf (port, sizeof(port), "%d", 20000 + (i / 2));
+        AddSingleRedirect (1, 0, port, 0, path);
+    }
+}
+
+// Measure the cost of reading the clock, which is included in every
+// sample below.
+//
+static void bench_redirect_clock (void) {
+
+    int i;
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < Iterations; ++i) {
+        long long t = bench_clock ();
+        bench_sample (bench_clock () - t);
+    }
+    bench_report ("clock", bench_clock () - start);
+}
+
+static void bench_redirect_search (const char *name, const char *format,
+                                   int divider) {
+
+    int i;
+    int found = 0;
+    char path[256];
+
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < Iterations; ++i) {
+        int route = i % Routes;
+        snprintf (path, sizeof(path),
+                  format, route / divider, route % 2, route);
+        long long t = bench_clock ();
+        if (SearchBestRedirect (path)) found += 1;
+        bench_sample (bench_clock () - t);
+    }
+    bench_report (name, bench_clock () - start);
+    if (found && found != Iterations)
+        printf ("%-24s %d paths of %d found\n", name, found, Iterations);
+}
+
+static int bench_redirect_format (char *buffer, int size, int service) {
+    return snprintf (buffer, size, "REDIRECT %ld %d /bench%d/path0 /bench%d/path1",
+                     (long)RedirectNow, 20000 + service, service, service);
+}
+
+static int bench_redirect_sign (int key, char *buffer, int size, int service,
+                                int identified) {
+
+    int length = bench_redirect_format (buffer, size, service);
+    const char *signature = houseportalhmac_sign (key, buffer);
+    if (!signature) return 0;
+    if (identified)
+        length += snprintf (buffer+length, size-length, " %s %s %s",
+                            BenchCypher, signature, houseportalhmac_id (key));
+    else
+        length += snprintf (buffer+length, size-length, " %s %s",
+                            BenchCypher, signature);
+    return length;
+}
+
+static void bench_redirect_hmac (int key) {
+
+    int i;
+    char buffer[1024];
+
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < Iterations; ++i) {
+        bench_redirect_format (buffer, sizeof(buffer), (i % Routes) / 2);
+        long long t = bench_clock ();
+        houseportalhmac_sign (key, buffer);
+        bench_sample (bench_clock () - t);
+    }
+    bench_report ("hmac.sign", bench_clock () - start);
+}
+
+static void bench_redirect_verify (const char *name, int key, int identified) {
+
+    int i;
+    int rejected = 0;
+    char message[1024];
+    char buffer[1024];
+
+    int length = bench_redirect_sign (key, message, sizeof(message), 0,
+                                      identified);
+
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < Iterations; ++i) {
+        memcpy (buffer, message, length+1); // The data is modified.
+        long long t = bench_clock ();
+        if (!hp_redirect_inspect (buffer, length)) rejected += 1;
+        bench_sample (bench_clock () - t);
+    }
+    bench_report (name, bench_clock () - start);
+    if (rejected) printf ("%-24s %d rejected\n", name, rejected);
+}
+
+// The full processing of a registration renewal, as done when a message
+// is received: verification, registration tracking and route update.
+//
+static void bench_redirect_packet (int key) {
+
+    int i;
+    char buffer[1024];
+
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < Iterations; ++i) {
+        int length = bench_redirect_sign (key, buffer, sizeof(buffer),
+                                          (i % Routes) / 2, 1);
+        long long t = bench_clock ();
+        hp_redirect_packet (buffer, length);
+        bench_sample (bench_clock () - t);
+    }
+    bench_report ("udp.packet", bench_clock () - start);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    const char *keyfile = 0;
+    char sign[512];
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-key=", argv[i], &keyfile);
+        if (echttp_option_match ("-routes=", argv[i], &value))
+            Routes = atoi(value);
+        if (echttp_option_match ("-iterations=", argv[i], &value))
+            Iterations = atoi(value);
+    }
+    if (Routes < 2) Routes = 2;
+    if (Iterations <= 0) Iterations = 1;
+
+    if (keyfile && !bench_key (keyfile, &BenchCypher, &BenchKey)) {
+        fprintf (stderr, "invalid key file %s\n", keyfile);
+        return 1;
+    }
+
+    // The routes are echttp routes: echttp must be initialized, but the
+    // HTTP port does not matter.
+    //
+    const char *options[] = {argv[0], "-http-service=dynamic", 0};
+    echttp_open (2, options);
+
+    bench_redirect_setup ();
+    printf ("%d routes, %d iterations\n", Routes, Iterations);
+
+    bench_redirect_clock ();
+    bench_redirect_search ("search.exact", "/bench%d/path%d", 2);
+    bench_redirect_search ("search.deep", "/bench%d/path%d/a/b/c?id=%d", 2);
+    bench_redirect_search ("search.miss", "/nosuch%d/path%d/%d", 2);
+
+    int key = houseportalhmac_key (BenchCypher, BenchKey);
+    if (key < 0) {
+        fprintf (stderr, "unsupported cypher %s\n", BenchCypher);
+        return 1;
+    }
+    bench_redirect_hmac (key);
+
+    // Declare the key as the portal's configuration does.
+    //
+    snprintf (sign, sizeof(sign), "SIGN %s %s", BenchCypher, BenchKey);
+    DecodeMessage (sign, 0);
+
+    bench_redirect_verify ("verify.identified", key, 1);
+    bench_redirect_verify ("verify.anonymous", key, 0);
+    bench_redirect_packet (key);
+    return 0;
+}
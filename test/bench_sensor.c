@@ -0,0 +1,129 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * bench_sensor.c - Microbenchmarks of the sensor data log.
+ *
+ * SYNOPSYS:
+ *
+ * bench_sensor [-iterations=N]
+ *
+ *    Measure the recording of a sensor sample, and the generation of the
+ *    JSON documents sent to storage: one houselog_sensor_json document per
+ *    SENSOR_LEGACY_DEPTH samples, or one compact document for a full
+ *    buffer.
+ *
+ *    This program includes houselog_sensor.c, so that the static functions
+ *    can be called directly. The data is never sent to storage.
+ */
+
+#include "../houselog_sensor.c"
+
+#include "bench.h"
+
+static int Iterations = 100000;
+
+static const char *BenchLocation[] = {
+    "kitchen", "garage", "bedroom", "office", "porch", "attic", "basement", 0
+};
+
+static void bench_sensor_fill (int count) {
+
+    int i;
+    struct timeval timestamp;
+
+    houselog_sensor_reset ();
+    gettimeofday (&timestamp, 0);
+    for (i = 0; i < count; ++i) {
+        timestamp.tv_usec = (timestamp.tv_usec + 250000) % 1000000;
+        if (!timestamp.tv_usec) timestamp.tv_sec += 1;
+        houselog_sensor_numeric (&timestamp, BenchLocation[i % 7],
+                                 "temperature", 60 + (i % 20), "F");
+    }
+}
+
+static void bench_sensor_record (void) {
+
+    int i;
+    struct timeval timestamp;
+
+    houselog_sensor_reset ();
+    gettimeofday (&timestamp, 0);
+
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < Iterations; ++i) {
+        if (SensorCount >= SENSOR_CAPACITY - 1) houselog_sensor_reset ();
+        timestamp.tv_usec = (timestamp.tv_usec + 1000) % 1000000;
+        if (!timestamp.tv_usec) timestamp.tv_sec += 1;
+        long long t = bench_clock ();
+        houselog_sensor_real (&timestamp, BenchLocation[i % 7],
+                              "temperature", 60.5 + (i % 20), "F");
+        bench_sample (bench_clock () - t);
+    }
+    bench_report ("sensor.record", bench_clock () - start);
+}
+
+static void bench_sensor_json (const char *name, int compact) {
+
+    int i;
+    long length = 0;
+    time_t now = time(0);
+    int count = compact ? SENSOR_CAPACITY - 1 : SENSOR_LEGACY_DEPTH;
+    int iterations = Iterations / (count / 64);
+
+    bench_sensor_fill (count);
+
+    bench_reset ();
+    long long start = bench_clock ();
+    for (i = 0; i < iterations; ++i) {
+        long long t = bench_clock ();
+        const char *json = compact ? houselog_sensor_compact_json (now)
+                                   : houselog_sensor_json (now, 0, count);
+        bench_sample (bench_clock () - t);
+        if (i == 0) length = strlen(json);
+    }
+    bench_report (name, bench_clock () - start);
+    printf ("%-24s %ld bytes for %d samples\n", name, length, count);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-iterations=", argv[i], &value))
+            Iterations = atoi(value);
+    }
+    if (Iterations < SENSOR_CAPACITY) Iterations = SENSOR_CAPACITY;
+
+    // Never flush: there is no storage service here.
+    //
+    SensorStream = houselog_flush_register ("sensor", SENSOR_CAPACITY,
+                                            SENSOR_CAPACITY, 3600);
+    gethostname (LocalHost, sizeof(LocalHost));
+    PortalHost = LocalHost;
+
+    printf ("%d iterations\n", Iterations);
+    bench_sensor_record ();
+    bench_sensor_json ("sensor.json", 0);
+    bench_sensor_json ("sensor.compact", 1);
+    return 0;
+}
@@ -0,0 +1,223 @@
+/* houseportal - A simple web portal for home servers
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * bench_udp.c - Flood the portal with service registrations.
+ *
+ * SYNOPSYS:
+ *
+ * bench_udp [-portal=HOST] [-portal-port=N] [-http-port=N]
+ *           [-services=N] [-paths=N] [-messages=N] [-rate=N] [-key=FILE]
+ *
+ *    Simulate N services (100 by default), each registering a few paths,
+ *    and send the registrations to the portal as fast as possible (or at
+ *    the specified rate, in messages per second). The registrations are
+ *    sent unsigned first, then signed if a key file is provided (see
+ *    test.key for the format). The portal's own key, if any, decides
+ *    whether the unsigned registrations are rejected.
+ *
+ *    For each pass, the time needed to format, sign and send a message is
+ *    reported, as well as the number of messages received, rejected and
+ *    dropped by the portal (from the portal's /portal/metrics counters).
+ *    The routes created expire after a few minutes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "echttp.h"
+
+#include "houseportalhmac.h"
+
+#include "bench.h"
+
+static const char *PortalHost = "localhost";
+static const char *PortalPort = "70";
+static const char *HttpPort = "80";
+
+static int Services = 100;
+static int Paths = 2;
+static int Messages = 100000;
+static int Rate = 0;
+
+static int UdpSocket = -1;
+static struct sockaddr_storage UdpAddress;
+static socklen_t UdpAddressLength = 0;
+
+static int Key = -1;
+static const char *KeyCypher = 0;
+
+static void bench_udp_open (void) {
+
+    struct addrinfo hints;
+    struct addrinfo *resolved;
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo (PortalHost, PortalPort, &hints, &resolved)) {
+        fprintf (stderr, "cannot resolve %s\n", PortalHost);
+        exit (1);
+    }
+    memcpy (&UdpAddress, resolved->ai_addr, resolved->ai_addrlen);
+    UdpAddressLength = resolved->ai_addrlen;
+    freeaddrinfo (resolved);
+
+    UdpSocket = socket (AF_INET, SOCK_DGRAM, 0);
+    if (UdpSocket < 0) {
+        perror ("socket");
+        exit (1);
+    }
+}
+
+// Use the same message format as houseportalclient.c.
+//
+static int bench_udp_format (char *buffer, int size, int service, int key) {
+
+    int i;
+    int length = snprintf (buffer, size, "REDIRECT %ld %d",
+                           (long)time(0), 20000 + service);
+    for (i = 0; i < Paths && length < size; ++i) {
+        length += snprintf (buffer+length, size-length,
+                            " /bench%d/path%d", service, i);
+    }
+    if (length >= size) return 0;
+
+    if (key >= 0) {
+        const char *signature = houseportalhmac_sign (key, buffer);
+        if (signature) {
+            length += snprintf (buffer+length, size-length, " %s %s %s",
+                                KeyCypher, signature, houseportalhmac_id (key));
+        }
+    }
+    return length < size ? length : 0;
+}
+
+static const char *bench_udp_metrics (void) {
+
+    static char buffer[65536];
+    if (bench_http_get (PortalHost, HttpPort, "/portal/metrics",
+                        buffer, sizeof(buffer)) != 200) return "";
+    return buffer;
+}
+
+static void bench_udp_pass (const char *name, int key) {
+
+    char buffer[1500];
+    char metric[64];
+    int i;
+
+    const char *before = bench_udp_metrics ();
+    long long received = bench_metric (before, "udp.received");
+    long long rejected = bench_metric (before, "udp.rejected");
+    long long dropped = bench_metric (before, "udp.dropped");
+    int failed = 0;
+
+    bench_reset ();
+    long long start = bench_clock ();
+
+    for (i = 0; i < Messages; ++i) {
+
+        if (Rate > 0) {
+            long long due = start + (i * 1000000000LL) / Rate;
+            long long now = bench_clock ();
+            if (due > now) usleep ((due - now) / 1000);
+        }
+
+        long long sent = bench_clock ();
+        int length =
+            bench_udp_format (buffer, sizeof(buffer), i % Services, key);
+        if (length <= 0 ||
+            sendto (UdpSocket, buffer, length, 0,
+                    (struct sockaddr *)(&UdpAddress), UdpAddressLength) < 0) {
+            failed += 1;
+            continue;
+        }
+        bench_sample (bench_clock () - sent);
+    }
+    bench_report (name, bench_clock () - start);
+
+    sleep (1); // Let the portal process its backlog.
+
+    const char *after = bench_udp_metrics ();
+    if (!after[0]) {
+        printf ("%-24s no portal metrics available\n", name);
+        return;
+    }
+    received = bench_metric (after, "udp.received") - received;
+    rejected = bench_metric (after, "udp.rejected") - rejected;
+    dropped = bench_metric (after, "udp.dropped") - dropped;
+
+    snprintf (metric, sizeof(metric), "%s (portal)", name);
+    printf ("%-24s %9d sent, %lld received, %lld rejected, %lld dropped,"
+                " %lld lost, %d send errors\n",
+            metric, Messages - failed, received, rejected, dropped,
+            (Messages - failed) - received, failed);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    const char *keyfile = 0;
+
+    for (i = 1; i < argc; ++i) {
+        echttp_option_match ("-portal=", argv[i], &PortalHost);
+        echttp_option_match ("-portal-port=", argv[i], &PortalPort);
+        echttp_option_match ("-http-port=", argv[i], &HttpPort);
+        echttp_option_match ("-key=", argv[i], &keyfile);
+        if (echttp_option_match ("-services=", argv[i], &value))
+            Services = atoi(value);
+        if (echttp_option_match ("-paths=", argv[i], &value))
+            Paths = atoi(value);
+        if (echttp_option_match ("-messages=", argv[i], &value))
+            Messages = atoi(value);
+        if (echttp_option_match ("-rate=", argv[i], &value))
+            Rate = atoi(value);
+    }
+    if (Services <= 0) Services = 1;
+    if (Paths <= 0) Paths = 1;
+
+    if (keyfile) {
+        const char *hexkey;
+        if (!bench_key (keyfile, &KeyCypher, &hexkey)) {
+            fprintf (stderr, "invalid key file %s\n", keyfile);
+            exit (1);
+        }
+        Key = houseportalhmac_key (KeyCypher, hexkey);
+        if (Key < 0) {
+            fprintf (stderr, "unsupported cypher %s\n", KeyCypher);
+            exit (1);
+        }
+    }
+
+    bench_udp_open ();
+    printf ("Registering %d services (%d paths each) with %s:%s\n",
+            Services, Paths, PortalHost, PortalPort);
+
+    bench_udp_pass ("udp.unsigned", -1);
+    if (Key >= 0) bench_udp_pass ("udp.signed", Key);
+    return 0;
+}